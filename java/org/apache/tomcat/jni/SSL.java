@@ -727,6 +727,75 @@ public final class SSL {
      */
     public static native void randSet(String filename);
 
+    /**
+     * Reseed the OpenSSL PRNG from the operating system in a background thread, every {@code interval} milliseconds
+     * and once {@code bytes} random bytes were drawn through this library. The PRNG is otherwise only seeded by
+     * {@link #initialize(String)} and when a random file is set. Calling it again replaces the schedule.
+     *
+     * @param interval Milliseconds between reseeds, or 0 for none
+     * @param bytes    Random bytes between reseeds, or 0 for no limit
+     *
+     * @return APR status code
+     *
+     * @throws Exception if the thread could not be started, or the library is not initialized
+     */
+    public static native int setReseedSchedule(long interval, long bytes) throws Exception;
+
+    /**
+     * Reseed the OpenSSL PRNG from the operating system now.
+     */
+    public static native void reseed();
+
+    /**
+     * Get the PRNG statistics.
+     *
+     * @param stats Array receiving the number of reseeds, failed reseeds, bytes drawn through {@link #randomBytes} and
+     *                  {@link #randomBytesBatch} since the last reseed, counted only while a byte limit is set with
+     *                  {@link #setReseedSchedule}, and the reseed counters of the primary DRBG and of the public and
+     *                  private DRBGs of the calling thread, in that order. The counters are -1 when not available.
+     */
+    public static native void getRandomStats(long[] stats);
+
+    /**
+     * Fill memory with random bytes from the DRBGs of the calling thread, which need no locking shared with other
+     * threads.
+     *
+     * @param address Memory address of the buffer, e.g. from {@link Buffer#address(java.nio.ByteBuffer)}
+     * @param len     Number of bytes
+     * @param secret  Use the private DRBG, for values that must not be learned by a peer such as session IDs
+     *
+     * @throws Exception if the bytes could not be generated
+     */
+    public static native void randomBytes(long address, int len, boolean secret) throws Exception;
+
+    /**
+     * Fill {@code count} buffers with random bytes in one call. Small buffers share a single request to the DRBG.
+     *
+     * @param addresses Memory addresses of the buffers
+     * @param lens      Lengths of the buffers
+     * @param offset    First index of the arrays to use
+     * @param count     Number of buffers
+     * @param secret    Use the private DRBG
+     *
+     * @throws Exception if the bytes could not be generated
+     */
+    public static native void randomBytesBatch(long[] addresses, int[] lens, int offset, int count, boolean secret)
+            throws Exception;
+
+    /**
+     * Fill part of an array with random bytes.
+     *
+     * @param buf    The array
+     * @param offset First byte to fill
+     * @param len    Number of bytes
+     * @param secret Use the private DRBG
+     *
+     * @throws Exception if the bytes could not be generated
+     *
+     * @see SSLSecureRandomSpi
+     */
+    public static native void randomBytesArray(byte[] buf, int offset, int len, boolean secret) throws Exception;
+
     /**
      * Return the handshake completed count.
      *
@@ -797,6 +866,57 @@ public final class SSL {
      */
     public static native long newSSL(long ctx, boolean server);
 
+    /**
+     * Offset of the update sequence in the state block. The sequence is odd while the native code updates the block;
+     * a consistent snapshot is one read between two equal, even, sequence values.
+     */
+    public static final int SSL_STATE_SEQUENCE = 0;
+    /**
+     * Offset of the bytes count available for reading in the SSL instance (SSL_pending).
+     */
+    public static final int SSL_STATE_PENDING_READ = 4;
+    /**
+     * Offset of the bytes count written by the SSL instance that has not been read from the network BIO yet.
+     */
+    public static final int SSL_STATE_PENDING_WRITE = 8;
+    /**
+     * Offset of the shutdown state (SSL_get_shutdown).
+     */
+    public static final int SSL_STATE_SHUTDOWN = 12;
+    /**
+     * Offset of the in handshake flag (SSL_in_init).
+     */
+    public static final int SSL_STATE_IN_INIT = 16;
+    /**
+     * Offset of the handshake completed count.
+     */
+    public static final int SSL_STATE_HANDSHAKE_COUNT = 20;
+    /**
+     * Offset of the renegotiation state.
+     */
+    public static final int SSL_STATE_RENEG_STATE = 24;
+    /**
+     * Offset of the post handshake authentication state.
+     */
+    public static final int SSL_STATE_PHA_STATE = 28;
+    /**
+     * Size of the state block in bytes.
+     */
+    public static final int SSL_STATE_SIZE = 32;
+
+    /**
+     * Bind a state block to the SSL instance. The native code refreshes the block after every data-path call and
+     * from the handshake callbacks, so that the connection state can be read from memory instead of calling
+     * pendingReadableBytesInSSL, pendingWrittenBytesInBIO, getShutdown, isInInit and getHandshakeCount. All fields
+     * are 32-bit integers in native byte order, see the SSL_STATE constants for the layout.
+     * <p>
+     * The memory must remain valid until the SSL instance is freed or the block is unbound.
+     *
+     * @param ssl     the SSL instance (SSL *)
+     * @param address Pointer to {@link #SSL_STATE_SIZE} bytes of memory, or 0 to unbind the current block
+     */
+    public static native void bindState(long ssl, long address);
+
     /**
      * BIO_ctrl_pending.
      *
@@ -848,6 +968,43 @@ public final class SSL {
      */
     public static native int writeToSSL(long ssl, long wbuf, int wlen);
 
+    /**
+     * Gathering SSL_write. The application data of several buffers is packed into full sized TLS records, so that
+     * small buffers (headers, chunk framing) do not each end up in a record of their own. At most 64 buffers are
+     * handled by a single call.
+     * <p>
+     * As with SSL_write, a call that fails with {@link #SSL_ERROR_WANT_WRITE} must be repeated with the same
+     * unconsumed buffers.
+     *
+     * @param ssl    the SSL instance (SSL *)
+     * @param wbufs  Buffer pointers
+     * @param wlens  Write lengths
+     * @param offset Index of the first buffer to write
+     * @param count  Number of buffers to write
+     *
+     * @return the bytes count written
+     */
+    public static native int writeToSSLv(long ssl, long[] wbufs, int[] wlens, int offset, int count);
+
+    /**
+     * Encrypt a range of a file without copying it into Java. The file is read natively in full record sized chunks
+     * and written to the network BIO or the socket bound with {@link #attachSocket(long, long)}. With kernel TLS
+     * active for sending, the kernel sends the file directly.
+     * <p>
+     * A call that fails with {@link #SSL_ERROR_WANT_WRITE} must be repeated with the offset and length adjusted by the
+     * progress reported so far.
+     *
+     * @param ssl    the SSL instance (SSL *)
+     * @param fd     the native file descriptor (a HANDLE on Windows)
+     * @param offset Offset of the first byte to send
+     * @param len    Number of bytes to send
+     *
+     * @return the bytes count written, or the SSL_write result if nothing was written
+     *
+     * @throws Exception if the file could not be read
+     */
+    public static native long sendfile(long ssl, long fd, long offset, long len) throws Exception;
+
     /**
      * SSL_read
      *
@@ -859,6 +1016,203 @@ public final class SSL {
      */
     public static native int readFromSSL(long ssl, long rbuf, int rlen);
 
+    /**
+     * Scattering SSL_read. The buffers are filled in order; once some data has been read, reading stops when nothing
+     * more is buffered in the SSL, so the call does not wait for the network. With read ahead and pipelining enabled
+     * on the context, several records are decrypted for each network read. At most 64 buffers are handled by a
+     * single call.
+     *
+     * @param ssl    the SSL instance (SSL *)
+     * @param rbufs  Buffer pointers
+     * @param rlens  Read lengths
+     * @param offset Index of the first buffer to fill
+     * @param count  Number of buffers to fill
+     *
+     * @return the bytes count read
+     */
+    public static native int readFromSSLv(long ssl, long[] rbufs, int[] rlens, int offset, int count);
+
+    /**
+     * Ciphertext is waiting in the network BIO to be sent to the peer.
+     */
+    public static final int SSL_STATUS_NETWORK_PENDING = 0x01;
+    /**
+     * Decrypted application data is still buffered in the SSL instance.
+     */
+    public static final int SSL_STATUS_SSL_PENDING = 0x02;
+    /**
+     * The handshake has not completed yet.
+     */
+    public static final int SSL_STATUS_IN_INIT = 0x04;
+    /**
+     * The handshake completed during the call.
+     */
+    public static final int SSL_STATUS_HANDSHAKE_DONE = 0x08;
+    /**
+     * The close_notify alert of the peer has been received.
+     */
+    public static final int SSL_STATUS_RECEIVED_SHUTDOWN = 0x10;
+    /**
+     * Record bytes read ahead from the network BIO are buffered in the SSL instance, but not decrypted yet. They may
+     * be an incomplete record, so this does not mean application data can be read without feeding more network data.
+     * Not reported with LibreSSL.
+     */
+    public static final int SSL_STATUS_RECORD_PENDING = 0x20;
+
+    /**
+     * Writes ciphertext into the network BIO, advances the handshake if required and reads as much application data
+     * as fits into the output buffer. This replaces the sequence of BIO_write, SSL_do_handshake, SSL_read,
+     * SSL_pending and BIO_ctrl_pending calls with a single native call.
+     * <p>
+     * Lengths larger than 2<sup>27</sup>-1 bytes are truncated for a single call. The individual fields of the
+     * returned value are extracted with {@link #getConsumed(long)}, {@link #getProduced(long)},
+     * {@link #getError(long)} and {@link #getStatus(long)}.
+     *
+     * @param bio  the network BIO (BIO *)
+     * @param ssl  the SSL instance (SSL *)
+     * @param rbuf Buffer pointer holding the ciphertext
+     * @param rlen Number of bytes of ciphertext available
+     * @param wbuf Buffer pointer receiving the application data
+     * @param wlen Capacity of the application data buffer
+     *
+     * @return the packed number of bytes consumed and produced, the SSL_get_error state and the SSL_STATUS flags
+     */
+    public static native long unwrap(long bio, long ssl, long rbuf, int rlen, long wbuf, int wlen);
+
+    /**
+     * Encrypts application data and reads the resulting records out of the network BIO into the output buffer,
+     * looping until either the input is consumed or the output is full. Ciphertext already queued in the network BIO
+     * (handshake messages, alerts) is copied out first, and the handshake is advanced if it has not completed yet.
+     * This replaces the sequence of SSL_write, BIO_ctrl_pending and BIO_read calls with a single native call.
+     * <p>
+     * As with SSL_write, a call that ends with {@link #SSL_ERROR_WANT_WRITE} must be repeated with the same
+     * unconsumed application data. The returned value is packed the same way as for
+     * {@link #unwrap(long, long, long, int, long, int)}.
+     *
+     * @param bio  the network BIO (BIO *)
+     * @param ssl  the SSL instance (SSL *)
+     * @param rbuf Buffer pointer holding the application data
+     * @param rlen Number of bytes of application data available
+     * @param wbuf Buffer pointer receiving the ciphertext
+     * @param wlen Capacity of the ciphertext buffer
+     *
+     * @return the packed number of bytes consumed and produced, the SSL_get_error state and the SSL_STATUS flags
+     */
+    public static native long wrap(long bio, long ssl, long rbuf, int rlen, long wbuf, int wlen);
+
+    /**
+     * SSL_write returning a packed status.
+     * <p>
+     * The result of SSL_write, the SSL_get_error state, the pending OpenSSL error and the SSL_STATUS flags are
+     * returned together, so that no follow-up calls are needed to handle a failure. The individual fields are
+     * extracted with {@link #getResult(long)}, {@link #getError(long)}, {@link #getErrorLibrary(long)},
+     * {@link #getErrorReason(long)} and {@link #getStatus(long)}.
+     *
+     * @param ssl  the SSL instance (SSL *)
+     * @param wbuf Buffer pointer
+     * @param wlen Write length
+     *
+     * @return the packed status
+     */
+    public static native long writeToSSLEx(long ssl, long wbuf, int wlen);
+
+    /**
+     * SSL_read returning a packed status, see {@link #writeToSSLEx(long, long, int)}.
+     *
+     * @param ssl  the SSL instance (SSL *)
+     * @param rbuf Buffer pointer
+     * @param rlen Read length
+     *
+     * @return the packed status
+     */
+    public static native long readFromSSLEx(long ssl, long rbuf, int rlen);
+
+    /**
+     * SSL_do_handshake returning a packed status, see {@link #writeToSSLEx(long, long, int)}.
+     *
+     * @param ssl the SSL instance (SSL *)
+     *
+     * @return the packed status
+     */
+    public static native long doHandshakeEx(long ssl);
+
+    /**
+     * Return value of the SSL call of a packed status.
+     *
+     * @param status the value returned by the native call
+     *
+     * @return the bytes count read or written, or the handshake status
+     */
+    public static int getResult(long status) {
+        return (int) status;
+    }
+
+    /**
+     * Library code of the OpenSSL error pending after the SSL call of a packed status.
+     *
+     * @param status the value returned by the native call
+     *
+     * @return the library code, 0 if no error was pending
+     */
+    public static int getErrorLibrary(long status) {
+        return (int) ((status >>> 46) & 0xFF);
+    }
+
+    /**
+     * Reason code of the OpenSSL error pending after the SSL call of a packed status, truncated to 14 bits.
+     *
+     * @param status the value returned by the native call
+     *
+     * @return the reason code, 0 if no error was pending
+     */
+    public static int getErrorReason(long status) {
+        return (int) ((status >>> 32) & 0x3FFF);
+    }
+
+    /**
+     * Number of input bytes consumed by a packed data-path call.
+     *
+     * @param result the value returned by the native call
+     *
+     * @return the bytes count consumed
+     */
+    public static int getConsumed(long result) {
+        return (int) ((result >>> 27) & 0x7FFFFFF);
+    }
+
+    /**
+     * Number of output bytes produced by a packed data-path call.
+     *
+     * @param result the value returned by the native call
+     *
+     * @return the bytes count produced
+     */
+    public static int getProduced(long result) {
+        return (int) (result & 0x7FFFFFF);
+    }
+
+    /**
+     * SSL_get_error state of the last SSL operation of a packed data-path call.
+     *
+     * @param result the value returned by the native call
+     *
+     * @return one of the SSL_ERROR constants
+     */
+    public static int getError(long result) {
+        return (int) ((result >>> 54) & 0x0F);
+    }
+
+    /**
+     * SSL_STATUS flags of a packed data-path call.
+     *
+     * @param result the value returned by the native call
+     *
+     * @return the SSL_STATUS flags
+     */
+    public static int getStatus(long result) {
+        return (int) (result >>> 58);
+    }
+
     /**
      * SSL_get_shutdown
      *
@@ -889,6 +1243,77 @@ public final class SSL {
      */
     public static native long makeNetworkBIO(long ssl);
 
+    /**
+     * Wire up a network BIO for the given SSL instance that reads and writes
+     * records directly in the buffers passed to {@link #unwrap} and
+     * {@link #wrap}, avoiding the copy through a BIO pair. Records produced
+     * outside of wrap, or that did not fit, are kept by the BIO and returned
+     * by the next wrap; {@link #pendingWrittenBytesInBIO} reports their size.
+     * <p>
+     * The returned BIO can only be used with unwrap and wrap, not with
+     * readFromBIO or writeToBIO.
+     * <p>
+     * <b>Warning: you must explicitly free this resource by calling freeBIO</b>
+     *
+     * @param ssl the SSL instance (SSL *)
+     *
+     * @return pointer to the Network BIO (BIO *)
+     */
+    public static native long makeBufferNetworkBIO(long ssl);
+
+    /**
+     * Bind the given SSL instance to a connected socket instead of a BIO
+     * pair. readFromSSL, writeToSSL and doHandshake then read from and write
+     * to the socket natively, so only plaintext crosses into Java. On a
+     * non-blocking socket they fail with SSL_ERROR_WANT_READ or
+     * SSL_ERROR_WANT_WRITE when the socket would block.
+     * <p>
+     * The socket remains owned by the caller and is not closed by freeSSL.
+     *
+     * @param ssl the SSL instance (SSL *)
+     * @param fd the native socket descriptor
+     *
+     * @return APR status code
+     */
+    public static native int attachSocket(long ssl, long fd);
+
+    /**
+     * Kernel TLS offload is active for sending.
+     */
+    public static final int SSL_KTLS_TX = 0x01;
+    /**
+     * Kernel TLS offload is active for receiving.
+     */
+    public static final int SSL_KTLS_RX = 0x02;
+    /**
+     * Kernel TLS offload was requested with {@link #enableKTLS(long)}.
+     */
+    public static final int SSL_KTLS_REQUESTED = 0x04;
+
+    /**
+     * Request kernel TLS offload for the given SSL instance. It must be bound
+     * to a socket with {@link #attachSocket(long, long)} and the call must be
+     * made before the handshake. Once the keys are known, OpenSSL installs
+     * them on the socket if the kernel supports the negotiated cipher,
+     * otherwise records keep being processed in user space.
+     *
+     * @param ssl the SSL instance (SSL *)
+     *
+     * @return {@code true} if the OpenSSL library supports kernel TLS
+     */
+    public static native boolean enableKTLS(long ssl);
+
+    /**
+     * Report which directions are offloaded to the kernel. After the
+     * handshake, {@link #SSL_KTLS_REQUESTED} without {@link #SSL_KTLS_TX}
+     * means the kernel or the cipher did not allow offload.
+     *
+     * @param ssl the SSL instance (SSL *)
+     *
+     * @return a combination of the SSL_KTLS_* flags
+     */
+    public static native int getKTLSStatus(long ssl);
+
     /**
      * BIO_free
      *
@@ -905,6 +1330,85 @@ public final class SSL {
      */
     public static native int shutdownSSL(long ssl);
 
+    /**
+     * Create up to {@code count} SSL instances, each with a network BIO as made by {@link #makeNetworkBIO(long)}, in
+     * one call. Creation stops at the first failure; the instances made so far are kept.
+     *
+     * @param ctx    Server or Client context to use.
+     * @param server if true configure the SSL instances to use accept handshake routines
+     * @param ssls   Array receiving the SSL instances (SSL *)
+     * @param bios   Array receiving the network BIOs (BIO *), or {@code null} to create no BIOs
+     * @param offset First index of the arrays to fill
+     * @param count  Number of connections to create
+     *
+     * @return the number of connections created
+     *
+     * @throws Exception if no connection could be created, or if {@code offset} and {@code count} do not describe a
+     *                       range within both arrays
+     */
+    public static native int newSSLBatch(long ctx, boolean server, long[] ssls, long[] bios, int offset, int count)
+            throws Exception;
+
+    /**
+     * Free {@code count} SSL instances and their network BIOs in one call, as {@link #freeBIO(long)} and
+     * {@link #freeSSL(long)} do. Zero entries are skipped.
+     * <p>
+     * With {@code shutdown} a close_notify alert is sent first to each connection past its handshake. For connections
+     * bound with {@link #attachSocket(long, long)} it goes straight to the socket. For a BIO pair it is left in the
+     * network BIO; pass {@code bufs} and {@code lens} to have the ciphertext pending in each network BIO, the alert
+     * included, copied out before the BIO is freed, then write it to the peer.
+     *
+     * @param ssls     The SSL instances (SSL *)
+     * @param bios     The network BIOs (BIO *), or {@code null}
+     * @param bufs     Buffers receiving the pending ciphertext of each network BIO (char *), or {@code null} to drop
+     *                     it. Requires {@code bios} and {@code lens}
+     * @param lens     The sizes of the buffers, each replaced by the number of bytes copied into it
+     * @param offset   First index of the arrays to use
+     * @param count    Number of connections to free
+     * @param shutdown Send close_notify before freeing
+     *
+     * @throws Exception if {@code offset} and {@code count} do not describe a range within the arrays given, or
+     *                       {@code bufs} is given without {@code bios} and {@code lens}
+     */
+    public static native void freeSSLBatch(long[] ssls, long[] bios, long[] bufs, int[] lens, int offset, int count,
+            boolean shutdown) throws Exception;
+
+    /**
+     * SSL_shutdown for {@code count} SSL instances in one call.
+     *
+     * @param ssls    The SSL instances (SSL *)
+     * @param results Array receiving the status of each SSL_shutdown, or {@code null}
+     * @param offset  First index of the arrays to use
+     * @param count   Number of connections
+     *
+     * @return the number of connections whose shutdown completed
+     */
+    public static native int shutdownSSLBatch(long[] ssls, int[] results, int offset, int count);
+
+    /**
+     * {@link #pendingWrittenBytesInBIO(long)} for {@code count} BIOs in one call.
+     *
+     * @param bios    The network BIOs (BIO *)
+     * @param pending Array receiving the number of pending bytes of each BIO
+     * @param offset  First index of the arrays to use
+     * @param count   Number of BIOs
+     *
+     * @return the number of BIOs with pending bytes
+     */
+    public static native int pendingWrittenBytesInBIOBatch(long[] bios, int[] pending, int offset, int count);
+
+    /**
+     * {@link #pendingReadableBytesInSSL(long)} for {@code count} SSL instances in one call.
+     *
+     * @param ssls    The SSL instances (SSL *)
+     * @param pending Array receiving the number of readable bytes of each SSL
+     * @param offset  First index of the arrays to use
+     * @param count   Number of connections
+     *
+     * @return the number of connections with readable bytes
+     */
+    public static native int pendingReadableBytesInSSLBatch(long[] ssls, int[] pending, int offset, int count);
+
     /**
      * Get the error number representing the last error OpenSSL encountered on this thread.
      *
@@ -93,10 +93,13 @@ public final class SSLConf {
      * @param cctx SSL_CONF context to use.
      * @param ctx  SSL context to assign to the given SSL_CONF context.
      *
+     * @throws Exception If a Tomcat specific setting could not be put in place, e.g. the thread downloading the CRLs
+     *                       of {@code CRL_DP_FETCH} could not be started
+     *
      * @see <a href="https://www.openssl.org/docs/man1.0.2/ssl/SSL_CONF_CTX_set_ssl_ctx.html">OpenSSL
      *          SSL_CONF_CTX_set_ssl_ctx</a>
      */
-    public static native void assign(long cctx, long ctx);
+    public static native void assign(long cctx, long ctx) throws Exception;
 
     /**
      * Apply a command to an SSL_CONF context.
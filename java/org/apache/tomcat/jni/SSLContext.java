@@ -143,7 +143,14 @@ public final class SSLContext {
      * The files in this directory have to be PEM-encoded and are accessed through hash filenames. So usually you can't
      * just place the Certificate files there: you also have to create symbolic links named hash-value.N. And you should
      * always make sure this directory contains the appropriate symbolic links. Use the Makefile which comes with
-     * mod_ssl to accomplish this task.
+     * mod_ssl to accomplish this task. <br>
+     * With the {@code CRL_DP_FETCH} command of {@link SSLConf} the CRLs named by the HTTP distribution points of the
+     * peer certificates are downloaded in the background, refreshed before their nextUpdate and used next to these.
+     * Until the first CRL of a distribution point is there the certificate is accepted, so that no handshake waits for
+     * the network. With {@code CRL_DP_SOFT_FAIL} set to {@code false} handshakes wait for the download instead and
+     * fail if it fails. <br>
+     * Once {@link #reloadTrust(long, String, String, String, String, int)} was called this fails, the CRLs are then
+     * given to that method.
      *
      * @param ctx  Server or Client context to use.
      * @param file File of concatenated PEM-encoded CA CRLs for Client Auth.
@@ -151,10 +158,66 @@ public final class SSLContext {
      *
      * @return <code>true</code> if the operation was successful
      *
-     * @throws Exception An error occurred
+     * @throws Exception An error occurred, or the trust store was reloaded
      */
     public static native boolean setCARevocation(long ctx, String file, String path) throws Exception;
 
+    /**
+     * Replace the CA certificates and CRLs peer certificates are verified against, without rebuilding the context. A
+     * new certificate store is built from the given locations by the calling thread and then swapped in at once:
+     * connections created afterwards use it, while handshakes in progress finish with the store they started with,
+     * which is freed once the last of them is gone. The CRLs are checked for the whole chain as with
+     * {@link #setCARevocation(long, String, String)}, and the cached OCSP responses are dropped. Once this was called
+     * the trust store of the context is only changed by calling it again. The CA names sent to clients in certificate
+     * requests are not changed.
+     *
+     * @param ctx     Server or Client context to use.
+     * @param caFile  File of concatenated PEM-encoded CA Certificates, or {@code null}
+     * @param caPath  Directory of PEM-encoded CA Certificates, or {@code null}
+     * @param crlFile File of concatenated PEM-encoded CA CRLs, or {@code null}
+     * @param crlPath Directory of PEM-encoded CA CRLs, or {@code null}
+     * @param flags   Additional X509_V_FLAG_* verification flags of the new store
+     *
+     * @return the trust generation of the context, incremented by every reload
+     *
+     * @throws Exception The store could not be built, the context keeps the one it had
+     */
+    public static native long reloadTrust(long ctx, String caFile, String caPath, String crlFile, String crlPath,
+            int flags) throws Exception;
+
+    /**
+     * Write a revocation index: the serial numbers of the certificates revoked by the given CRLs, sorted per issuer
+     * in a file that {@link #setRevocationIndex(long, String)} maps. Each CRL has to be a complete CRL, not a delta or
+     * indirect one, that has not expired and is signed by a certificate of the trust store of the context. The CRLs
+     * of one issuer are merged. An existing file is replaced at once, so contexts that have it mapped are not
+     * disturbed.
+     *
+     * @param ctx     Context whose trust store the CRLs are verified against
+     * @param file    Index file to write
+     * @param crlFile File of concatenated PEM-encoded CRLs, or of one DER-encoded CRL
+     *
+     * @return the number of serial numbers in the index
+     *
+     * @throws Exception A CRL could not be read or verified, or the file not written
+     */
+    public static native int buildRevocationIndex(long ctx, String file, String crlFile) throws Exception;
+
+    /**
+     * Check peer certificates against a revocation index written by
+     * {@link #buildRevocationIndex(long, String, String)}, in addition to any CRLs and OCSP. The file is mapped read
+     * only, so every context and process using it shares the same memory however many entries it has, and a lookup
+     * is a binary search on the issuer and one on the serial number. A certificate listed fails verification as
+     * revoked, and once the nextUpdate of the CRLs of its issuer has passed all certificates of that issuer fail
+     * until a new index is set. Certificates of issuers without CRLs in the index are not affected. Calling this
+     * again replaces the index, handshakes in progress finish with the one they started with.
+     *
+     * @param ctx  Server or Client context to use.
+     * @param file Index file, or {@code null} to stop using one
+     *
+     * @throws Exception The file could not be mapped or is no revocation index
+     */
+    public static native void setRevocationIndex(long ctx, String file) throws Exception;
+
     /**
      * Set File of PEM-encoded Server CA Certificates <br>
      * This directive sets the optional all-in-one file where you can assemble the certificates of Certification
@@ -428,6 +491,105 @@ public final class SSLContext {
      */
     public static native void setVerify(long ctx, int level, int depth);
 
+    /**
+     * Configure dynamic record sizing for connections created from this context. After a handshake, and after the
+     * connection was idle for the given time, application data is sent in records of at most {@code size} bytes, so
+     * that each record fits into a single TCP segment and can be processed by the peer as soon as it arrives. Once
+     * {@code threshold} bytes have been sent, full sized records are used for throughput. A value of 1369 bytes fits
+     * a typical 1460 byte segment. Disabled by default.
+     *
+     * @param ctx       Server or Client context to use.
+     * @param size      Maximum record payload while ramping up, or 0 to disable
+     * @param threshold Number of bytes to send in small records
+     * @param idle      Idle time in milliseconds after which small records are used again
+     */
+    public static native void setDynamicRecordSizing(long ctx, int size, int threshold, long idle);
+
+    /**
+     * Set the maximum number of records OpenSSL processes in parallel, for ciphers that support pipelining. The
+     * fused {@link SSL#wrap} and gathering {@link SSL#writeToSSLv} calls then pass that many records worth of data
+     * to a single SSL_write, which also lets the multi-block AES-CBC-HMAC-SHA ciphers be used with TLS 1.2. Reading
+     * pipelined records additionally requires {@link #setReadAhead(long, boolean)}.
+     * http://www.openssl.org/docs/man3.0/man3/SSL_CTX_set_max_pipelines.html
+     *
+     * @param ctx       Server or Client context to use.
+     * @param pipelines Maximum number of pipelines, 1 to disable
+     *
+     * @return {@code true} if the value was accepted
+     */
+    public static native boolean setMaxPipelines(long ctx, int pipelines);
+
+    /**
+     * Set the size of the records a large write is split into when pipelining.
+     *
+     * @param ctx  Server or Client context to use.
+     * @param size Record payload size, between 512 and 16384
+     *
+     * @return {@code true} if the value was accepted
+     */
+    public static native boolean setSplitSendFragment(long ctx, int size);
+
+    /**
+     * Let OpenSSL read as much data from the network as is available, rather than one record at a time.
+     *
+     * @param ctx Server or Client context to use.
+     * @param on  {@code true} to enable read ahead
+     */
+    public static native void setReadAhead(long ctx, boolean on);
+
+    /**
+     * Set the default size of the read buffer of new connections. A buffer that holds several records is needed to
+     * read pipelined records.
+     *
+     * @param ctx Server or Client context to use.
+     * @param len Read buffer size in bytes
+     */
+    public static native void setDefaultReadBufferLen(long ctx, int len);
+
+    /**
+     * Keep up to {@code size} freed connections of this context for reuse. {@link SSL#freeSSL(long)} then resets the
+     * connection instead of freeing it, and {@link SSL#newSSL(long, boolean)} hands it out again, which saves the
+     * allocation of the SSL structure, its buffers and its memory pool. Options, ciphers and verification settings
+     * changed on a connection are reset to those of the context before it is reused, and the session of a connection
+     * freed without a close_notify is removed from the session cache as {@link SSL#freeSSL(long)} would. The
+     * connections kept are freed with the context. Disabled by default.
+     *
+     * @param ctx  Server or Client context to use.
+     * @param size Maximum number of connections to keep, 0 to stop keeping more
+     *
+     * @return {@code true} if the value was accepted
+     *
+     * @throws Exception if the pool could not be set up
+     */
+    public static native boolean setConnectionRecycling(long ctx, int size) throws Exception;
+
+    /**
+     * Get the statistics of the connection recycling pool.
+     *
+     * @param ctx   Server or Client context to use.
+     * @param stats Array receiving the number of connections reused, newly allocated, returned to the pool, discarded
+     *                  and currently kept, in that order
+     */
+    public static native void getConnectionRecyclingStats(long ctx, long[] stats);
+
+    /**
+     * Get the statistics of the OCSP response cache. Responses are cached per context until their nextUpdate plus the
+     * allowed clock skew, lookups without a definitive answer for {@code OCSP_CACHE_NEGATIVE_TTL} milliseconds. The
+     * cache is sized with the {@code OCSP_CACHE_SIZE} command of {@link SSLConf}, 0 disables it. With
+     * {@code OCSP_REFRESH_AHEAD} set, a thread fetches the responses of the certificates in use again that many
+     * milliseconds before their nextUpdate, and with {@code OCSP_SOFT_FAIL} handshakes no longer wait for a responder.
+     * A lookup sent to the responders fetches the missing responses for the rest of the chain along with it. With
+     * {@code OCSP_STORE_FILE} set, the responses are also written to that file and taken from it after a restart if
+     * they still verify against the trust store and have not expired.
+     *
+     * @param ctx   Server or Client context to use.
+     * @param stats Array receiving the number of lookups answered from the cache, sent to a responder, that waited for
+     *                  a request already in flight, the number of responses evicted, currently cached, fetched by the
+     *                  refresh thread, of lookups left to the refresh thread and of responses taken from the store
+     *                  file, in that order
+     */
+    public static native void getOCSPCacheStats(long ctx, long[] stats);
+
     /**
      * Allow to hook {@link CertificateVerifier} into the handshake processing. This will call
      * {@code SSL_CTX_set_cert_verify_callback} and so replace the default verification callback used by openssl
@@ -437,6 +599,34 @@ public final class SSLContext {
      */
     public static native void setCertVerifyCallback(long ctx, CertificateVerifier verifier);
 
+    /**
+     * Cache the outcome of client certificate verification. A client that presents the same chain again, under the
+     * same verification settings and trust store, is accepted without building and checking the chain again. The
+     * {@link CertificateVerifier} is not called either. Only successful verifications are cached. Each entry is kept
+     * for {@code ttl} seconds, but not past the notAfter of any certificate in its chain. The cache is flushed by
+     * {@link #reloadTrust(long, String, String, String, String, int)}, {@link #setCARevocation(long, String, String)},
+     * {@link #setRevocationIndex(long, String)} and {@link #setCertVerifyCallback(long, CertificateVerifier)}, and
+     * whenever a newer CRL is downloaded from a distribution point or an OCSP responder reports a revocation.
+     * Verifications still in progress at that time are not cached either. Client connections are not cached.
+     * Disabled by default.
+     *
+     * @param ctx  Server context to use.
+     * @param size Maximum number of chains kept, the least recently used go first. 0 disables the cache
+     * @param ttl  Seconds a chain is kept, 0 disables the cache
+     *
+     * @return {@code true} if the value was accepted
+     */
+    public static native boolean setVerifyCache(long ctx, int size, int ttl);
+
+    /**
+     * Get the statistics of the verification cache set up by {@link #setVerifyCache(long, int, int)}.
+     *
+     * @param ctx   Server context to use.
+     * @param stats Array receiving the number of verifications answered from the cache, not found in it, the number
+     *                  of chains evicted and currently cached, in that order
+     */
+    public static native void getVerifyCacheStats(long ctx, long[] stats);
+
     /**
      * Set application layer protocol for application layer protocol negotiation extension
      *
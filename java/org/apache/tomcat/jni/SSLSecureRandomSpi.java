@@ -0,0 +1,136 @@
+/*
+ *  Licensed to the Apache Software Foundation (ASF) under one or more
+ *  contributor license agreements.  See the NOTICE file distributed with
+ *  this work for additional information regarding copyright ownership.
+ *  The ASF licenses this file to You under the Apache License, Version 2.0
+ *  (the "License"); you may not use this file except in compliance with
+ *  the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+package org.apache.tomcat.jni;
+
+import java.security.NoSuchAlgorithmException;
+import java.security.Provider;
+import java.security.ProviderException;
+import java.security.SecureRandom;
+import java.security.SecureRandomSpi;
+import java.util.Map;
+
+/**
+ * {@link SecureRandomSpi} drawing from the OpenSSL DRBGs of the calling thread through
+ * {@link SSL#randomBytesArray(byte[], int, int, boolean)}. Since every thread has its own DRBGs the instances are
+ * thread safe without locking, and {@link #newSecureRandom(boolean)} returns a {@link SecureRandom} that does not
+ * synchronize either. {@link SSL#initialize(String)} must have been called.
+ */
+public final class SSLSecureRandomSpi extends SecureRandomSpi {
+
+    private static final long serialVersionUID = 1L;
+
+    /**
+     * Algorithm name of the instances using the public DRBG.
+     */
+    public static final String ALGORITHM = "OpenSSL";
+
+    /**
+     * Algorithm name of the instances using the private DRBG.
+     */
+    public static final String ALGORITHM_PRIVATE = "OpenSSLPrivate";
+
+    private static final Provider PROVIDER = new RandomProvider();
+
+    private final boolean secret;
+
+    /**
+     * Create an instance using the public DRBG.
+     */
+    public SSLSecureRandomSpi() {
+        this(false);
+    }
+
+    /**
+     * Create an instance.
+     *
+     * @param secret Use the private DRBG, for values that must not be learned by a peer
+     */
+    public SSLSecureRandomSpi(boolean secret) {
+        this.secret = secret;
+    }
+
+    /**
+     * Create a {@link SecureRandom} using this implementation.
+     *
+     * @param secret Use the private DRBG
+     *
+     * @return the new instance
+     */
+    public static SecureRandom newSecureRandom(boolean secret) {
+        try {
+            return SecureRandom.getInstance(secret ? ALGORITHM_PRIVATE : ALGORITHM, PROVIDER);
+        } catch (NoSuchAlgorithmException e) {
+            // Registered by RandomProvider
+            throw new IllegalStateException(e);
+        }
+    }
+
+    /**
+     * OpenSSL seeds itself from the operating system, the seed is ignored.
+     */
+    @Override
+    protected void engineSetSeed(byte[] seed) {
+        // NO-OP
+    }
+
+    @Override
+    protected void engineNextBytes(byte[] bytes) {
+        try {
+            SSL.randomBytesArray(bytes, 0, bytes.length, secret);
+        } catch (Exception e) {
+            throw new ProviderException(e);
+        }
+    }
+
+    @Override
+    protected byte[] engineGenerateSeed(int numBytes) {
+        byte[] seed = new byte[numBytes];
+        try {
+            SSL.randomBytesArray(seed, 0, numBytes, true);
+        } catch (Exception e) {
+            throw new ProviderException(e);
+        }
+        return seed;
+    }
+
+    private static final class RandomProvider extends Provider {
+
+        private static final long serialVersionUID = 1L;
+
+        RandomProvider() {
+            super("TomcatNative", "1.0", "OpenSSL DRBG backed SecureRandom");
+            putService(new RandomService(this, ALGORITHM, false));
+            putService(new RandomService(this, ALGORITHM_PRIVATE, true));
+        }
+    }
+
+    private static final class RandomService extends Provider.Service {
+
+        private final boolean secret;
+
+        RandomService(Provider provider, String algorithm, boolean secret) {
+            super(provider, "SecureRandom", algorithm, SSLSecureRandomSpi.class.getName(), null,
+                    Map.of("ThreadSafe", "true"));
+            this.secret = secret;
+        }
+
+        @Override
+        public Object newInstance(Object constructorParameter) {
+            return new SSLSecureRandomSpi(secret);
+        }
+    }
+}
@@ -112,6 +112,10 @@
 #define SSL_SHUTDOWN_TYPE_UNCLEAN   (2)
 #define SSL_SHUTDOWN_TYPE_ACCURATE  (3)
 
+#define SSL_KTLS_TX                 (0x01)
+#define SSL_KTLS_RX                 (0x02)
+#define SSL_KTLS_REQUESTED          (0x04)
+
 #define SSL_TO_APR_ERROR(X)         (APR_OS_START_USERERR + 1000 + X)
 
 #define SSL_INFO_SESSION_ID                 (0x0001)
@@ -219,6 +223,24 @@
 #define OCSP_MAX_SKEW             900
 /* 15 seconds - aligns with JSSE*/
 #define OCSP_TIMEOUT_DEFAULT 15000000
+/* 0.5 seconds before asking the next responder of a certificate */
+#define OCSP_HEDGE_DELAY_DEFAULT  500000
+/* RFC 5019 GET requests drop the nonce, POST unless asked for */
+#define OCSP_GET_DEFAULT          0
+/* Responses cached per context */
+#define OCSP_CACHE_SIZE_DEFAULT          1024
+/* 5 seconds - lookups without a definitive answer */
+#define OCSP_CACHE_NEGATIVE_TTL_DEFAULT  5000000
+/* Background refresh is off by default */
+#define OCSP_REFRESH_AHEAD_DEFAULT       0
+#define OCSP_CACHE_STATS                 8
+/* CRL distribution points are not followed by default */
+#define CRL_DP_FETCH_DEFAULT             0
+/* Handshakes do not wait for the first download */
+#define CRL_DP_SOFT_FAIL_DEFAULT         1
+/* Verification results are not cached by default */
+#define VERIFY_CACHE_KEY_LEN             32
+#define VERIFY_CACHE_STATS               4
 /* Older versions of OpenSSL have a smaller range of OCSP error codes*/
 #if !defined(X509_V_ERR_OCSP_RESP_INVALID)
 #define X509_V_ERR_OCSP_RESP_INVALID      96
@@ -236,6 +258,11 @@
 
 #endif /* !defined(OPENSSL_NO_TLSEXT) && defined(SSL_set_tlsext_host_name) */
 
+typedef struct tcn_ocsp_cache_t tcn_ocsp_cache_t;
+typedef struct tcn_crl_cache_t tcn_crl_cache_t;
+typedef struct tcn_rev_index_t tcn_rev_index_t;
+typedef struct tcn_verify_cache_t tcn_verify_cache_t;
+
 #define MAX_ALPN_PROTO_SIZE 65535
 #define SSL_SELECTOR_FAILURE_CHOOSE_MY_LAST_PROTOCOL            1
 
@@ -248,6 +275,25 @@ typedef struct {
 
 typedef struct tcn_ssl_ctxt_t tcn_ssl_ctxt_t;
 
+/* Freed connections kept for reuse by newSSL.  The pool of a context is
+ * split into stripes, picked by the calling thread, each with its own
+ * lock.
+ */
+#define SSL_RECYCLE_STRIPES     (8)
+
+/* Per connection settings that ssl_recycle() resets to the context ones */
+#define TCN_SSL_OVERRIDE_VERIFY     0x01
+#define TCN_SSL_OVERRIDE_OPTIONS    0x02
+#define TCN_SSL_OVERRIDE_CIPHERS    0x04
+
+typedef struct {
+    apr_thread_mutex_t *mutex;
+    SSL               **ssl;
+    int                 count;
+    int                 size;
+    int                 capacity;
+} tcn_ssl_recycle_t;
+
 typedef struct {
     char            password[SSL_MAX_PASSWORD_LEN];
     const char     *prompt;
@@ -298,6 +344,11 @@ struct tcn_ssl_ctxt_t {
     /* certificate verifier callback */
     jobject verifier;
     jmethodID verifier_method;
+    /* chains that verified, looked up while verify_cached is set */
+    tcn_verify_cache_t *verify_cache;
+    int             verify_cached;
+    /* moved on by anything that may revoke a cached chain */
+    apr_uint32_t    verify_epoch;
 
     unsigned char   *next_proto_data;
     unsigned int    next_proto_len;
@@ -312,6 +363,36 @@ struct tcn_ssl_ctxt_t {
     int             ocsp_soft_fail;
     int             ocsp_timeout;
     int             ocsp_verify_flags;
+    apr_interval_time_t ocsp_hedge_delay;
+    int             ocsp_get;
+    tcn_ocsp_cache_t *ocsp_cache;
+    /* CRLs downloaded from distribution points, off while NULL */
+    tcn_crl_cache_t *crl_cache;
+    int             crl_dp_soft_fail;
+    /* store swapped in by reloadTrust, NULL before, and the number of
+     * times that happened */
+    apr_thread_mutex_t *trust_mutex;
+    X509_STORE      *trust;
+    apr_uint32_t    trust_generation;
+    /* mapped revocation index, changed under trust_mutex, and whether
+     * there is one
+     */
+    tcn_rev_index_t *rev_index;
+    apr_uint32_t    rev_indexed;
+    /* dynamic record sizing, off while record_small is 0 */
+    int             record_small;
+    apr_size_t      record_threshold;
+    apr_interval_time_t record_idle;
+    /* records handed to OpenSSL by a single write */
+    int             max_pipelines;
+    int             split_send_fragment;
+    /* connection recycling, off while the stripes have no mutex */
+    tcn_ssl_recycle_t recycle[SSL_RECYCLE_STRIPES];
+    int             recycle_closed;
+    apr_uint64_t    recycle_hits;
+    apr_uint64_t    recycle_misses;
+    apr_uint64_t    recycle_returned;
+    apr_uint64_t    recycle_discarded;
 };
 
 #ifdef HAVE_SSL_CONF_CMD
@@ -324,15 +405,41 @@ struct tcn_ssl_conf_ctxt_t {
     int             ocsp_soft_fail;
     int             ocsp_timeout;
     int             ocsp_verify_flags;
+    apr_interval_time_t ocsp_hedge_delay;
+    int             ocsp_get;
+    int             ocsp_cache_size;
+    apr_interval_time_t ocsp_cache_negative_ttl;
+    apr_interval_time_t ocsp_refresh_ahead;
+    char            *ocsp_store_file;
+    int             crl_dp_fetch;
+    int             crl_dp_soft_fail;
 };
 #endif
 
+/* Connection state mirrored into caller supplied (direct) memory, so
+ * that it can be polled without a native call.  The sequence is odd
+ * while an update is in progress.
+ */
+typedef struct {
+    apr_uint32_t    sequence;
+    apr_int32_t     pending_read;
+    apr_int32_t     pending_write;
+    apr_int32_t     shutdown;
+    apr_int32_t     in_init;
+    apr_int32_t     handshake_count;
+    apr_int32_t     reneg_state;
+    apr_int32_t     pha_state;
+} tcn_ssl_state_t;
+
+/* Connection records are handed out by a process wide slab, one cache
+ * line aligned record per SSL *, reached through SSL_get_app_data().
+ * The fields used on every record sit at the front.
+ */
+#define SSL_CONN_ALIGN          (64)
+
 typedef struct {
-    apr_pool_t     *pool;
     tcn_ssl_ctxt_t *ctx;
     SSL            *ssl;
-    X509           *peer;
-    int             shutdown_type;
     /* Track the handshake/renegotiation state for the connection so
      * that all client-initiated renegotiations can be rejected, as a
      * partial fix for CVE-2009-3555.
@@ -354,24 +461,31 @@ typedef struct {
         PHA_STARTED,    /* PHA req sent to client but no response */
         PHA_COMPLETE    /* Client has returned cert */
     } pha_state;
-    apr_socket_t   *sock;
-    apr_pollset_t  *pollset;
+    int             handshake_count;
+    int             shutdown_type;
+    /* dynamic record sizing */
+    apr_size_t      record_bytes;
+    apr_time_t      record_last;
+    int             record_fragment;
+    int             record_retry;
+    /* network side of the BIO pair, referenced so that BIO level calls
+     * can refresh the state block */
+    BIO            *network_bio;
+    tcn_ssl_state_t *state;
+    X509           *peer;
+    /* per connection settings to undo before recycling, TCN_SSL_OVERRIDE_* */
+    int             overrides;
+    /* trust generation of the verify store the SSL was given */
+    apr_uint32_t    trust_generation;
+    /* slab bookkeeping, kept when the record is reset */
+    apr_uint32_t    slab_index;
+    apr_uint32_t    slab_next;
 } tcn_ssl_conn_t;
 
 
 /*
  *  Additional Functions
  */
-void        SSL_init_app_data_idx(void);
-/* The app_data2 is used to store the tcn_ssl_ctxt_t pointer for the SSL instance. */
-void       *SSL_get_app_data2(SSL *);
-void        SSL_set_app_data2(SSL *, void *);
-/* The app_data3 is used to store the handshakeCount pointer for the SSL instance. */
-void       *SSL_get_app_data3(const SSL *);
-void        SSL_set_app_data3(SSL *, void *);
-/* The app_data4 is used to store the destroyCount pointer for the SSL instance. */
-void       *SSL_get_app_data4(const SSL *);
-void        SSL_set_app_data4(SSL *, void *);
 int         SSL_password_prompt(tcn_pass_cb_t *);
 int         SSL_password_callback(char *, int, int, void *);
 void        SSL_BIO_close(BIO *);
@@ -383,9 +497,38 @@ int         SSL_ec_GetParamFromFile(const char *);
 #endif
 DH         *SSL_callback_tmp_DH(SSL *, int, int);
 void        SSL_callback_handshake(const SSL *, int, int);
+void        SSL_update_state(const SSL *);
+void        SSL_recycle_drain(tcn_ssl_ctxt_t *);
 int         SSL_CTX_use_certificate_chain(SSL_CTX *, const char *, int);
 int         SSL_callback_SSL_verify(int, X509_STORE_CTX *);
+apr_status_t SSL_ocsp_cache_create(tcn_ssl_ctxt_t *);
+void        SSL_ocsp_cache_configure(tcn_ssl_ctxt_t *, int, apr_interval_time_t, apr_interval_time_t);
+void        SSL_ocsp_cache_destroy(tcn_ssl_ctxt_t *);
+apr_status_t SSL_ocsp_cache_store(tcn_ssl_ctxt_t *, const char *);
+void        SSL_ocsp_cache_stats(tcn_ssl_ctxt_t *, apr_uint64_t *);
+void        SSL_ocsp_cache_flush(tcn_ssl_ctxt_t *);
+apr_status_t SSL_crl_cache_configure(tcn_ssl_ctxt_t *, int);
+void        SSL_crl_cache_destroy(tcn_ssl_ctxt_t *);
+int         SSL_crl_cache_optional(tcn_ssl_ctxt_t *, X509_STORE_CTX *);
+void        SSL_crl_cache_attach(tcn_ssl_ctxt_t *, X509_STORE *);
+X509_STORE *SSL_trust_store_get(tcn_ssl_ctxt_t *);
+void        SSL_trust_store_apply(tcn_ssl_ctxt_t *, SSL *);
+int         SSL_rev_index_build(tcn_ssl_ctxt_t *, const char *, const char *, char *, apr_size_t);
+apr_status_t SSL_rev_index_set(tcn_ssl_ctxt_t *, const char *);
+void        SSL_rev_index_destroy(tcn_ssl_ctxt_t *);
+int         SSL_rev_index_check(tcn_ssl_ctxt_t *, X509_STORE_CTX *);
+apr_status_t SSL_verify_cache_create(tcn_ssl_ctxt_t *);
+void        SSL_verify_cache_configure(tcn_ssl_ctxt_t *, int, apr_interval_time_t);
+void        SSL_verify_cache_flush(tcn_ssl_ctxt_t *);
+void        SSL_verify_cache_invalidate(tcn_ssl_ctxt_t *);
+void        SSL_verify_cache_stats(tcn_ssl_ctxt_t *, apr_uint64_t *);
+int         SSL_verify_cache_key(tcn_ssl_ctxt_t *, X509_STORE_CTX *, const char *, unsigned char *);
+int         SSL_verify_cache_get(tcn_ssl_ctxt_t *, const unsigned char *, X509_STORE_CTX *);
+void        SSL_verify_cache_put(tcn_ssl_ctxt_t *, const unsigned char *, X509_STORE_CTX *);
+apr_status_t SSL_ocsp_client_init(apr_pool_t *);
+void        SSL_ocsp_client_terminate(void);
 int         SSL_rand_seed(const char *file);
+void        SSL_rand_drawn(apr_size_t);
 int         SSL_callback_alpn_select_proto(SSL *, const unsigned char **, unsigned char *, const unsigned char *, unsigned int, void *);
 void        SSL_callback_add_keylog(SSL_CTX *);
 
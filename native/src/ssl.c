@@ -17,6 +17,8 @@
 #include "tcn.h"
 #include "apr_file_io.h"
 #include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#include "apr_thread_proc.h"
 #include "apr_atomic.h"
 #include "apr_poll.h"
 
@@ -51,6 +53,8 @@ void SSL_callback_add_keylog(SSL_CTX *ctx)
 
 static void init_bio_methods(void);
 static void free_bio_methods(void);
+static apr_status_t ssl_conn_init(apr_pool_t *);
+static void ssl_conn_terminate(void);
 
 TCN_IMPLEMENT_CALL(jint, SSL, version)(TCN_STDARGS)
 {
@@ -76,6 +80,10 @@ static apr_status_t ssl_init_cleanup(void *data)
     ssl_initialized = 0;
 
     free_bio_methods();
+    ssl_conn_terminate();
+#ifdef HAVE_OCSP
+    SSL_ocsp_client_terminate();
+#endif
 
     /* Openssl v1.1+ handles all termination automatically. */
 
@@ -157,15 +165,14 @@ int SSL_rand_seed(const char *file)
             unsigned long i;
             apr_uint32_t  u;
         } _ssl_seed;
-        if (counter == 0) {
+        if (apr_atomic_read32(&counter) == 0) {
             apr_generate_random_bytes(stackdata, 256);
             RAND_seed(stackdata, 128);
         }
         _ssl_seed.t = apr_time_now();
         _ssl_seed.p = getpid();
         _ssl_seed.i = ssl_thread_id();
-        apr_atomic_inc32(&counter);
-        _ssl_seed.u = counter;
+        _ssl_seed.u = apr_atomic_inc32(&counter) + 1;
         RAND_seed((unsigned char *)&_ssl_seed, sizeof(_ssl_seed));
         /*
          * seed in some current state of the run-time stack (128 bytes)
@@ -176,10 +183,116 @@ int SSL_rand_seed(const char *file)
     return RAND_status();
 }
 
+/*
+ * The PRNG is seeded once, at initialization or when a random file is
+ * configured.  Afterwards an optional thread reseeds the primary DRBG
+ * from the operating system on a schedule, or once the given number of
+ * bytes was drawn through tcnative.  The per thread public and private
+ * DRBGs pick the reseed up on their next use.
+ */
+static apr_thread_t        *rand_thread = NULL;
+static apr_thread_mutex_t  *rand_mutex = NULL;
+static apr_thread_cond_t   *rand_cond = NULL;
+static int                  rand_stop = 0;
+/* Set while the thread runs, SSL_rand_drawn only signals it then */
+static apr_uint32_t         rand_running = 0;
+static apr_uint32_t         rand_signalling = 0;
+static apr_interval_time_t  rand_interval = 0;
+static apr_uint64_t         rand_limit = 0;
+static apr_uint64_t         rand_drawn = 0;
+static apr_uint64_t         rand_reseeds = 0;
+static apr_uint64_t         rand_failures = 0;
+
+static void ssl_rand_reseed(void)
+{
+    apr_atomic_set64(&rand_drawn, 0);
+    if (RAND_poll() == 1)
+        apr_atomic_inc64(&rand_reseeds);
+    else
+        apr_atomic_inc64(&rand_failures);
+    ERR_clear_error();
+}
+
+static void *APR_THREAD_FUNC ssl_rand_thread(apr_thread_t *thd, void *data)
+{
+    UNREFERENCED(data);
+
+    apr_thread_mutex_lock(rand_mutex);
+    while (!rand_stop) {
+        apr_uint64_t limit = apr_atomic_read64(&rand_limit);
+        apr_status_t rv = APR_TIMEUP;
+
+        /* Checked under the lock the drawing side signals with */
+        if (limit == 0 || apr_atomic_read64(&rand_drawn) < limit) {
+            if (rand_interval > 0)
+                rv = apr_thread_cond_timedwait(rand_cond, rand_mutex, rand_interval);
+            else
+                rv = apr_thread_cond_wait(rand_cond, rand_mutex);
+            limit = apr_atomic_read64(&rand_limit);
+            if (rand_stop)
+                break;
+        }
+        if (APR_STATUS_IS_TIMEUP(rv) ||
+            (limit > 0 && apr_atomic_read64(&rand_drawn) >= limit)) {
+            apr_thread_mutex_unlock(rand_mutex);
+            ssl_rand_reseed();
+            apr_thread_mutex_lock(rand_mutex);
+        }
+    }
+    apr_thread_mutex_unlock(rand_mutex);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+/* A pre cleanup, the thread pool is a child of the global pool */
+static apr_status_t ssl_rand_thread_cleanup(void *data)
+{
+    apr_status_t rv;
+
+    UNREFERENCED(data);
+    if (!apr_atomic_read32(&rand_running))
+        return APR_SUCCESS;
+    apr_atomic_set32(&rand_running, 0);
+    /* Callers that saw it running may still use the mutex */
+    while (apr_atomic_read32(&rand_signalling) != 0)
+        apr_thread_yield();
+    apr_thread_mutex_lock(rand_mutex);
+    rand_stop = 1;
+    apr_thread_cond_signal(rand_cond);
+    apr_thread_mutex_unlock(rand_mutex);
+    apr_thread_join(&rv, rand_thread);
+    rand_thread = NULL;
+    rand_mutex  = NULL;
+    rand_cond   = NULL;
+    return APR_SUCCESS;
+}
+
+/* Account for random bytes handed out, waking the reseed thread at the limit */
+void SSL_rand_drawn(apr_size_t len)
+{
+    apr_uint64_t limit = apr_atomic_read64(&rand_limit);
+    apr_uint64_t drawn;
+
+    if (limit == 0)
+        return;
+    drawn = apr_atomic_add64(&rand_drawn, len);
+    if (drawn < limit && drawn + len >= limit) {
+        /* Counted before the check, so that the cleanup waits for us */
+        apr_atomic_inc32(&rand_signalling);
+        if (apr_atomic_read32(&rand_running)) {
+            apr_thread_mutex_lock(rand_mutex);
+            apr_thread_cond_signal(rand_cond);
+            apr_thread_mutex_unlock(rand_mutex);
+        }
+        apr_atomic_dec32(&rand_signalling);
+    }
+}
+
 TCN_IMPLEMENT_CALL(jint, SSL, initialize)(TCN_STDARGS, jstring engine)
 {
     jclass clazz;
     jclass sClazz;
+    apr_status_t rv;
 
     TCN_ALLOC_CSTRING(engine);
 
@@ -201,8 +314,23 @@ TCN_IMPLEMENT_CALL(jint, SSL, initialize)(TCN_STDARGS, jstring engine)
      * low entropy seed.
      */
     SSL_rand_seed(NULL);
-    /* For SSL_get_app_data2(), SSL_get_app_data3() and SSL_get_app_data4() at request time */
-    SSL_init_app_data_idx();
+    /* Connection records */
+    if ((rv = ssl_conn_init(tcn_global_pool)) != APR_SUCCESS) {
+        ssl_initialized = 0;
+        TCN_FREE_CSTRING(engine);
+        tcn_ThrowAPRException(e, rv);
+        return (jint)rv;
+    }
+#ifdef HAVE_OCSP
+    /* Keep-alive connections to the OCSP responders */
+    if ((rv = SSL_ocsp_client_init(tcn_global_pool)) != APR_SUCCESS) {
+        ssl_conn_terminate();
+        ssl_initialized = 0;
+        TCN_FREE_CSTRING(engine);
+        tcn_ThrowAPRException(e, rv);
+        return (jint)rv;
+    }
+#endif
 
     init_bio_methods();
 
@@ -245,10 +373,226 @@ TCN_IMPLEMENT_CALL(void, SSL, randSet)(TCN_STDARGS, jstring file)
     UNREFERENCED(o);
     if (J2S(file)) {
         ssl_global_rand_file = apr_pstrdup(tcn_global_pool, J2S(file));
+        /* Otherwise SSL.initialize seeds from it */
+        if (ssl_initialized)
+            SSL_rand_seed(ssl_global_rand_file);
     }
     TCN_FREE_CSTRING(file);
 }
 
+TCN_IMPLEMENT_CALL(jint, SSL, setReseedSchedule)(TCN_STDARGS, jlong interval,
+                                                 jlong bytes)
+{
+    apr_status_t rv = APR_SUCCESS;
+
+    UNREFERENCED(o);
+    if (!ssl_initialized) {
+        tcn_ThrowAPRException(e, APR_EINVAL);
+        return APR_EINVAL;
+    }
+    if (!apr_atomic_read32(&rand_running)) {
+        if (interval <= 0 && bytes <= 0)
+            return APR_SUCCESS;
+        /* Kept until the global pool goes, a failed start reuses them */
+        if (rand_mutex == NULL &&
+            (rv = apr_thread_mutex_create(&rand_mutex, APR_THREAD_MUTEX_DEFAULT,
+                                          tcn_global_pool)) != APR_SUCCESS)
+            goto cleanup;
+        if (rand_cond == NULL &&
+            (rv = apr_thread_cond_create(&rand_cond, tcn_global_pool)) != APR_SUCCESS)
+            goto cleanup;
+        rand_stop     = 0;
+        rand_interval = apr_time_from_msec(TCN_MAX(interval, 0));
+        apr_atomic_set64(&rand_limit, (apr_uint64_t)TCN_MAX(bytes, 0));
+        if ((rv = apr_thread_create(&rand_thread, NULL, ssl_rand_thread, NULL,
+                                    tcn_global_pool)) != APR_SUCCESS)
+            goto cleanup;
+        apr_pool_pre_cleanup_register(tcn_global_pool, NULL,
+                                      ssl_rand_thread_cleanup);
+        apr_atomic_set32(&rand_running, 1);
+        return APR_SUCCESS;
+    }
+    apr_thread_mutex_lock(rand_mutex);
+    rand_interval = apr_time_from_msec(TCN_MAX(interval, 0));
+    apr_atomic_set64(&rand_limit, (apr_uint64_t)TCN_MAX(bytes, 0));
+    /* Start over with the new schedule */
+    apr_thread_cond_signal(rand_cond);
+    apr_thread_mutex_unlock(rand_mutex);
+    return APR_SUCCESS;
+
+cleanup:
+    /* Nothing is started, so that a retry starts the thread anew */
+    rand_thread = NULL;
+    apr_atomic_set64(&rand_limit, 0);
+    tcn_ThrowAPRException(e, rv);
+    return rv;
+}
+
+TCN_IMPLEMENT_CALL(void, SSL, reseed)(TCN_STDARGS)
+{
+    UNREFERENCED_STDARGS;
+    ssl_rand_reseed();
+}
+
+#if !defined(LIBRESSL_VERSION_NUMBER)
+static jlong ssl_drbg_reseed_counter(EVP_RAND_CTX *drbg)
+{
+    unsigned int counter = 0;
+    OSSL_PARAM params[2];
+
+    params[0] = OSSL_PARAM_construct_uint(OSSL_DRBG_PARAM_RESEED_COUNTER, &counter);
+    params[1] = OSSL_PARAM_construct_end();
+    if (drbg == NULL || !EVP_RAND_CTX_get_params(drbg, params))
+        return -1;
+    return (jlong)counter;
+}
+#endif
+
+TCN_IMPLEMENT_CALL(void, SSL, getRandomStats)(TCN_STDARGS, jlongArray stats)
+{
+    jlong s[6];
+
+    UNREFERENCED(o);
+    s[0] = (jlong)apr_atomic_read64(&rand_reseeds);
+    s[1] = (jlong)apr_atomic_read64(&rand_failures);
+    s[2] = (jlong)apr_atomic_read64(&rand_drawn);
+#if !defined(LIBRESSL_VERSION_NUMBER)
+    s[3] = ssl_drbg_reseed_counter(RAND_get0_primary(NULL));
+    s[4] = ssl_drbg_reseed_counter(RAND_get0_public(NULL));
+    s[5] = ssl_drbg_reseed_counter(RAND_get0_private(NULL));
+#else
+    s[3] = s[4] = s[5] = -1;
+#endif
+    (*e)->SetLongArrayRegion(e, stats, 0, TCN_MIN(6, (*e)->GetArrayLength(e, stats)), s);
+}
+
+/*
+ * Random bytes from the DRBGs of the calling thread, the private one for
+ * values that must stay secret.  Small requests are drawn into a stack
+ * buffer, one generate call for many of them.
+ */
+#define TCN_RAND_STAGE  4096
+#define TCN_RAND_BATCH  64
+
+static int ssl_random_bytes(unsigned char *buf, apr_size_t len, int secret)
+{
+    int rc;
+
+#if !defined(LIBRESSL_VERSION_NUMBER)
+    if (secret)
+        rc = RAND_priv_bytes_ex(NULL, buf, len, 0);
+    else
+        rc = RAND_bytes_ex(NULL, buf, len, 0);
+#else
+    UNREFERENCED(secret);
+    rc = RAND_bytes(buf, (int)len);
+#endif
+    if (rc == 1)
+        SSL_rand_drawn(len);
+    return rc;
+}
+
+static void ssl_throw_random(JNIEnv *e)
+{
+    char err[TCN_OPENSSL_ERROR_STRING_LENGTH];
+
+    ERR_error_string_n(SSL_ERR_get(), err, TCN_OPENSSL_ERROR_STRING_LENGTH);
+    ERR_clear_error();
+    tcn_Throw(e, "Unable to generate random bytes (%s)", err);
+}
+
+TCN_IMPLEMENT_CALL(void, SSL, randomBytes)(TCN_STDARGS, jlong address,
+                                           jint len, jboolean secret)
+{
+    UNREFERENCED(o);
+
+    if (len <= 0)
+        return;
+    if (ssl_random_bytes(J2P(address, unsigned char *), len, secret) != 1)
+        ssl_throw_random(e);
+}
+
+TCN_IMPLEMENT_CALL(void, SSL, randomBytesBatch)(TCN_STDARGS,
+                                                jlongArray addresses,
+                                                jintArray lens,
+                                                jint offset,
+                                                jint count,
+                                                jboolean secret)
+{
+    unsigned char stage[TCN_RAND_STAGE];
+    jlong bufs[TCN_RAND_BATCH];
+    jint blen[TCN_RAND_BATCH];
+    int avail = 0;
+    int done = 0;
+
+    UNREFERENCED(o);
+
+    while (done < count) {
+        int n = TCN_MIN(count - done, TCN_RAND_BATCH);
+        int i;
+
+        (*e)->GetLongArrayRegion(e, addresses, offset + done, n, bufs);
+        (*e)->GetIntArrayRegion(e, lens, offset + done, n, blen);
+        if ((*e)->ExceptionCheck(e))
+            return;
+        for (i = 0; i < n; i++) {
+            unsigned char *buf = J2P(bufs[i], unsigned char *);
+            int len = blen[i];
+
+            if (len >= TCN_RAND_STAGE) {
+                if (ssl_random_bytes(buf, len, secret) != 1)
+                    goto fail;
+                continue;
+            }
+            while (len > 0) {
+                int copy;
+
+                if (avail == 0) {
+                    if (ssl_random_bytes(stage, TCN_RAND_STAGE, secret) != 1)
+                        goto fail;
+                    avail = TCN_RAND_STAGE;
+                }
+                copy = TCN_MIN(len, avail);
+                memcpy(buf, stage + TCN_RAND_STAGE - avail, copy);
+                avail -= copy;
+                buf   += copy;
+                len   -= copy;
+            }
+        }
+        done += n;
+    }
+    /* Leave nothing of what was handed out behind */
+    OPENSSL_cleanse(stage, sizeof(stage));
+    return;
+fail:
+    OPENSSL_cleanse(stage, sizeof(stage));
+    ssl_throw_random(e);
+}
+
+TCN_IMPLEMENT_CALL(void, SSL, randomBytesArray)(TCN_STDARGS, jbyteArray buf,
+                                                jint offset, jint len,
+                                                jboolean secret)
+{
+    unsigned char stage[TCN_RAND_STAGE];
+
+    UNREFERENCED(o);
+
+    while (len > 0) {
+        int n = TCN_MIN(len, TCN_RAND_STAGE);
+
+        if (ssl_random_bytes(stage, n, secret) != 1) {
+            ssl_throw_random(e);
+            break;
+        }
+        (*e)->SetByteArrayRegion(e, buf, offset, n, (jbyte *)stage);
+        if ((*e)->ExceptionCheck(e))
+            break;
+        offset += n;
+        len    -= n;
+    }
+    OPENSSL_cleanse(stage, sizeof(stage));
+}
+
 TCN_IMPLEMENT_CALL(jint, SSL, fipsModeGet)(TCN_STDARGS)
 {
 #if defined(LIBRESSL_VERSION_NUMBER)
@@ -478,260 +822,1873 @@ static long jbs_ctrl(BIO *b, int cmd, long num, void *ptr)
     return ret;
 }
 
-static BIO_METHOD *jbs_methods = NULL;
+static BIO_METHOD *jbs_methods = NULL;
+
+/*
+ * Network BIO working on caller supplied buffers instead of the ring
+ * buffers of a BIO pair.  unwrap and wrap install the ciphertext input
+ * and output windows for the duration of the call, so records are read
+ * straight from, and written straight into, the caller's buffers.
+ * Output produced while no window is installed (handshake messages
+ * during unwrap, writeToSSL) or that does not fit is kept in a spill
+ * buffer, which the next wrap hands out first.
+ */
+#define NETWORK_BIO_SPILL_MAX   (64 * 1024)
+
+typedef struct {
+    const char *in;
+    int         in_len;
+    int         in_off;
+    char       *out;
+    int         out_len;
+    int         out_off;
+    char       *spill;
+    int         spill_len;
+    int         spill_off;
+    int         spill_cap;
+} BIO_NETWORK;
+
+static BIO_METHOD *nbs_methods = NULL;
+static int nbs_type = 0;
+
+static int nbs_new(BIO *bi)
+{
+    BIO_NETWORK *n;
+
+    if ((n = OPENSSL_zalloc(sizeof(BIO_NETWORK))) == NULL)
+        return 0;
+    BIO_set_data(bi, n);
+    BIO_set_init(bi, 1);
+    return 1;
+}
+
+static int nbs_free(BIO *bi)
+{
+    BIO_NETWORK *n;
+
+    if (bi == NULL)
+        return 0;
+    if ((n = (BIO_NETWORK *)BIO_get_data(bi)) != NULL) {
+        OPENSSL_free(n->spill);
+        OPENSSL_free(n);
+    }
+    BIO_set_data(bi, NULL);
+    return 1;
+}
+
+static int nbs_spill(BIO_NETWORK *n, const char *in, int inl)
+{
+    int len = n->spill_len - n->spill_off;
+
+    if (n->spill_off > 0) {
+        memmove(n->spill, n->spill + n->spill_off, len);
+        n->spill_off = 0;
+        n->spill_len = len;
+    }
+    inl = TCN_MIN(inl, NETWORK_BIO_SPILL_MAX - len);
+    if (inl <= 0)
+        return 0;
+    if (len + inl > n->spill_cap) {
+        int cap = TCN_MAX(n->spill_cap * 2, SSL3_RT_MAX_PACKET_SIZE);
+        char *p;
+
+        cap = TCN_MIN(TCN_MAX(cap, len + inl), NETWORK_BIO_SPILL_MAX);
+        if ((p = OPENSSL_realloc(n->spill, cap)) == NULL)
+            return 0;
+        n->spill = p;
+        n->spill_cap = cap;
+    }
+    memcpy(n->spill + len, in, inl);
+    n->spill_len = len + inl;
+    return inl;
+}
+
+/* Move spilled output into the output window */
+static void nbs_drain(BIO_NETWORK *n)
+{
+    int len = TCN_MIN(n->spill_len - n->spill_off, n->out_len - n->out_off);
+
+    if (len > 0) {
+        memcpy(n->out + n->out_off, n->spill + n->spill_off, len);
+        n->out_off   += len;
+        n->spill_off += len;
+    }
+    if (n->spill_off == n->spill_len)
+        n->spill_off = n->spill_len = 0;
+}
+
+static int nbs_write(BIO *b, const char *in, int inl)
+{
+    BIO_NETWORK *n = (BIO_NETWORK *)BIO_get_data(b);
+    int done = 0;
+
+    BIO_clear_retry_flags(b);
+    /* Keep the order, nothing goes to the window while output is spilled */
+    if (n->out != NULL && n->spill_len == n->spill_off) {
+        done = TCN_MIN(inl, n->out_len - n->out_off);
+        memcpy(n->out + n->out_off, in, done);
+        n->out_off += done;
+    }
+    if (done < inl)
+        done += nbs_spill(n, in + done, inl - done);
+    if (done == 0) {
+        BIO_set_retry_write(b);
+        return -1;
+    }
+    return done;
+}
+
+static int nbs_read(BIO *b, char *out, int outl)
+{
+    BIO_NETWORK *n = (BIO_NETWORK *)BIO_get_data(b);
+    int len = TCN_MIN(n->in_len - n->in_off, outl);
+
+    BIO_clear_retry_flags(b);
+    if (len <= 0) {
+        BIO_set_retry_read(b);
+        return -1;
+    }
+    memcpy(out, n->in + n->in_off, len);
+    n->in_off += len;
+    return len;
+}
+
+static long nbs_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+    BIO_NETWORK *n = (BIO_NETWORK *)BIO_get_data(b);
+    long ret = 0;
+
+    switch (cmd) {
+        case BIO_CTRL_PENDING:
+        case BIO_CTRL_WPENDING:
+            /* Ciphertext not yet handed to the caller */
+            ret = n->spill_len - n->spill_off;
+            break;
+        case BIO_CTRL_FLUSH:
+            ret = 1;
+            break;
+        default:
+            ret = 0;
+            break;
+    }
+    return ret;
+}
+
+static void init_bio_methods(void)
+{
+    jbs_methods = BIO_meth_new(BIO_TYPE_FILE, "Java Callback");
+    BIO_meth_set_write(jbs_methods, &jbs_write);
+    BIO_meth_set_read(jbs_methods, &jbs_read);
+    BIO_meth_set_puts(jbs_methods, &jbs_puts);
+    BIO_meth_set_gets(jbs_methods, &jbs_gets);
+    BIO_meth_set_ctrl(jbs_methods, &jbs_ctrl);
+    BIO_meth_set_create(jbs_methods, &jbs_new);
+    BIO_meth_set_destroy(jbs_methods, &jbs_free);
+
+    nbs_type = BIO_get_new_index() | BIO_TYPE_SOURCE_SINK;
+    nbs_methods = BIO_meth_new(nbs_type, "Network Buffer");
+    BIO_meth_set_write(nbs_methods, &nbs_write);
+    BIO_meth_set_read(nbs_methods, &nbs_read);
+    BIO_meth_set_ctrl(nbs_methods, &nbs_ctrl);
+    BIO_meth_set_create(nbs_methods, &nbs_new);
+    BIO_meth_set_destroy(nbs_methods, &nbs_free);
+}
+
+static void free_bio_methods(void)
+{
+    BIO_meth_free(jbs_methods);
+    BIO_meth_free(nbs_methods);
+}
+
+static BIO_NETWORK *network_bio_data(BIO *bio)
+{
+    if (BIO_method_type(bio) != nbs_type)
+        return NULL;
+    return (BIO_NETWORK *)BIO_get_data(bio);
+}
+
+/*** Begin Twitter 1:1 API addition ***/
+TCN_IMPLEMENT_CALL(jint, SSL, getLastErrorNumber)(TCN_STDARGS) {
+    UNREFERENCED_STDARGS;
+    return SSL_ERR_get();
+}
+
+/* Refresh the state block bound with SSL.bindState, if any */
+void SSL_update_state(const SSL *ssl)
+{
+    tcn_ssl_conn_t *con = (tcn_ssl_conn_t *)SSL_get_app_data(ssl);
+    tcn_ssl_state_t *st;
+    BIO *wbio;
+
+    if (con == NULL || (st = con->state) == NULL)
+        return;
+
+    apr_atomic_inc32(&st->sequence);
+    wbio = SSL_get_wbio(ssl);
+    st->pending_read    = SSL_pending(ssl);
+    st->pending_write   = wbio != NULL ? (apr_int32_t)BIO_ctrl_wpending(wbio) : 0;
+    st->shutdown        = SSL_get_shutdown(ssl);
+    st->in_init         = SSL_in_init(ssl);
+    st->handshake_count = con->handshake_count;
+    st->reneg_state     = con->reneg_state;
+    st->pha_state       = con->pha_state;
+    apr_atomic_inc32(&st->sequence);
+}
+
+/*
+ * Connection records live in chunks that are never returned to the
+ * system before the library is unloaded, so a stale record read while
+ * racing for the free list is harmless.  The head of the free list
+ * carries a tag in its upper half against ABA, and the record index
+ * plus one in its lower half.
+ */
+#define SSL_CONN_CHUNK          (256)
+#define SSL_CONN_CHUNKS_MAX     (16384)
+
+static char                *conn_chunk[SSL_CONN_CHUNKS_MAX];
+static void                *conn_chunk_mem[SSL_CONN_CHUNKS_MAX];
+static apr_uint32_t         conn_chunks = 0;
+static apr_size_t           conn_stride = 0;
+static apr_uint64_t         conn_free = 0;
+static apr_thread_mutex_t  *conn_mutex = NULL;
+
+#define SSL_CONN_AT(i)  \
+    ((tcn_ssl_conn_t *)(conn_chunk[(i) / SSL_CONN_CHUNK] + \
+                        ((i) % SSL_CONN_CHUNK) * conn_stride))
+
+static void ssl_conn_push(tcn_ssl_conn_t *first, tcn_ssl_conn_t *last)
+{
+    apr_uint64_t head, next;
+
+    do {
+        head = apr_atomic_read64(&conn_free);
+        last->slab_next = (apr_uint32_t)head;
+        next = (((head >> 32) + 1) << 32) | (first->slab_index + 1);
+    } while (apr_atomic_cas64(&conn_free, next, head) != head);
+}
+
+/* Add a chunk, one record of it goes to the caller */
+static tcn_ssl_conn_t *ssl_conn_grow(void)
+{
+    tcn_ssl_conn_t *con = NULL;
+    apr_uint32_t n, i;
+    void *mem;
+
+    apr_thread_mutex_lock(conn_mutex);
+    /* Someone else did it meanwhile */
+    if ((apr_uint32_t)apr_atomic_read64(&conn_free) != 0)
+        goto cleanup;
+    n = conn_chunks;
+    if (n == SSL_CONN_CHUNKS_MAX)
+        goto cleanup;
+    if ((mem = malloc(conn_stride * SSL_CONN_CHUNK + SSL_CONN_ALIGN)) == NULL)
+        goto cleanup;
+    conn_chunk_mem[n] = mem;
+    conn_chunk[n] = (char *)APR_ALIGN((apr_uintptr_t)mem, SSL_CONN_ALIGN);
+    for (i = 0; i < SSL_CONN_CHUNK; i++) {
+        tcn_ssl_conn_t *r = SSL_CONN_AT(n * SSL_CONN_CHUNK + i);
+
+        memset(r, 0, sizeof(tcn_ssl_conn_t));
+        r->slab_index = n * SSL_CONN_CHUNK + i;
+        r->slab_next  = r->slab_index + 2;
+    }
+    conn_chunks = n + 1;
+    con = SSL_CONN_AT(n * SSL_CONN_CHUNK);
+    ssl_conn_push(SSL_CONN_AT(n * SSL_CONN_CHUNK + 1),
+                  SSL_CONN_AT(n * SSL_CONN_CHUNK + SSL_CONN_CHUNK - 1));
+cleanup:
+    apr_thread_mutex_unlock(conn_mutex);
+    return con;
+}
+
+static tcn_ssl_conn_t *ssl_conn_alloc(void)
+{
+    apr_uint64_t head, next;
+    tcn_ssl_conn_t *con;
+
+    for (;;) {
+        head = apr_atomic_read64(&conn_free);
+        if ((apr_uint32_t)head == 0) {
+            if ((con = ssl_conn_grow()) != NULL)
+                break;
+            if ((apr_uint32_t)apr_atomic_read64(&conn_free) == 0)
+                return NULL;
+            continue;
+        }
+        con  = SSL_CONN_AT((apr_uint32_t)head - 1);
+        next = (((head >> 32) + 1) << 32) | con->slab_next;
+        if (apr_atomic_cas64(&conn_free, next, head) == head)
+            break;
+    }
+    /* A racing pop may still read slab_next */
+    memset(con, 0, APR_OFFSETOF(tcn_ssl_conn_t, slab_index));
+    return con;
+}
+
+static void ssl_conn_free(tcn_ssl_conn_t *con)
+{
+    ssl_conn_push(con, con);
+}
+
+static apr_status_t ssl_conn_init(apr_pool_t *p)
+{
+    conn_stride = APR_ALIGN(sizeof(tcn_ssl_conn_t), SSL_CONN_ALIGN);
+    return apr_thread_mutex_create(&conn_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+}
+
+static void ssl_conn_terminate(void)
+{
+    apr_uint32_t i;
+
+    for (i = 0; i < conn_chunks; i++) {
+        free(conn_chunk_mem[i]);
+        conn_chunk_mem[i] = NULL;
+        conn_chunk[i] = NULL;
+    }
+    conn_chunks = 0;
+    conn_free = 0;
+    conn_mutex = NULL;
+}
+
+/* Set up a fresh or reset connection record */
+static void ssl_init_connection(tcn_ssl_conn_t *con, SSL *ssl,
+                                tcn_ssl_ctxt_t *c)
+{
+    con->ctx  = c;
+    con->ssl  = ssl;
+    con->shutdown_type = c->shutdown_type;
+    SSL_set_app_data(ssl, con);
+}
+
+/* Stripe of the recycling pool used by the calling thread */
+static int ssl_recycle_stripe(void)
+{
+    apr_uint64_t h = (apr_uint64_t)(apr_uintptr_t)apr_os_thread_current();
+
+    h ^= h >> 33;
+    h *= APR_UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    return (int)(h % SSL_RECYCLE_STRIPES);
+}
+
+static SSL *ssl_recycle_get(tcn_ssl_ctxt_t *c)
+{
+    int first = ssl_recycle_stripe();
+    int i;
+
+    for (i = 0; i < SSL_RECYCLE_STRIPES; i++) {
+        tcn_ssl_recycle_t *r = &c->recycle[(first + i) % SSL_RECYCLE_STRIPES];
+        SSL *ssl = NULL;
+
+        if (r->count == 0)
+            continue;
+        apr_thread_mutex_lock(r->mutex);
+        if (r->count > 0)
+            ssl = r->ssl[--r->count];
+        apr_thread_mutex_unlock(r->mutex);
+        if (ssl != NULL)
+            return ssl;
+    }
+    return NULL;
+}
+
+static int ssl_recycle_put(tcn_ssl_ctxt_t *c, SSL *ssl)
+{
+    int first = ssl_recycle_stripe();
+    int i;
+
+    for (i = 0; i < SSL_RECYCLE_STRIPES; i++) {
+        tcn_ssl_recycle_t *r = &c->recycle[(first + i) % SSL_RECYCLE_STRIPES];
+        int done = 0;
+
+        if (r->count >= r->size)
+            continue;
+        apr_thread_mutex_lock(r->mutex);
+        if (r->count < r->size) {
+            r->ssl[r->count++] = ssl;
+            done = 1;
+        }
+        apr_thread_mutex_unlock(r->mutex);
+        if (done)
+            return 1;
+    }
+    return 0;
+}
+
+static apr_status_t ssl_new_connection(tcn_ssl_ctxt_t *c, jboolean server,
+                                       SSL **ssl_)
+{
+    tcn_ssl_conn_t *con;
+    SSL *ssl;
+
+    if (c->recycle[0].mutex != NULL) {
+        if ((ssl = ssl_recycle_get(c)) != NULL) {
+            apr_atomic_inc64(&c->recycle_hits);
+            goto setup;
+        }
+        apr_atomic_inc64(&c->recycle_misses);
+    }
+
+    if ((con = ssl_conn_alloc()) == NULL)
+        return APR_ENOMEM;
+    ssl = SSL_new(c->ctx);
+    if (ssl == NULL) {
+        ssl_conn_free(con);
+        return APR_EGENERAL;
+    }
+    ssl_init_connection(con, ssl, c);
+
+setup:
+    con = (tcn_ssl_conn_t *)SSL_get_app_data(ssl);
+    if (con->trust_generation != apr_atomic_read32(&c->trust_generation))
+        SSL_trust_store_apply(c, ssl);
+    if (server) {
+        SSL_set_accept_state(ssl);
+    } else {
+        SSL_set_connect_state(ssl);
+    }
+
+    /* Setup verify */
+    SSL_set_verify_result(ssl, X509_V_OK);
+
+    *ssl_ = ssl;
+    return APR_SUCCESS;
+}
+
+TCN_IMPLEMENT_CALL(jlong /* SSL * */, SSL, newSSL)(TCN_STDARGS,
+                                                   jlong ctx /* tcn_ssl_ctxt_t * */,
+                                                   jboolean server) {
+    tcn_ssl_ctxt_t *c = J2P(ctx, tcn_ssl_ctxt_t *);
+    SSL *ssl = NULL;
+    apr_status_t rv;
+
+    UNREFERENCED(o);
+
+    TCN_ASSERT(ctx != 0);
+
+    if ((rv = ssl_new_connection(c, server, &ssl)) == APR_ENOMEM) {
+        tcn_ThrowAPRException(e, rv);
+        return 0;
+    }
+    if (rv != APR_SUCCESS) {
+        tcn_ThrowException(e, "cannot create new ssl");
+        return 0;
+    }
+    return P2J(ssl);
+}
+
+/* Mirror the connection state into sizeof(tcn_ssl_state_t) bytes at address */
+TCN_IMPLEMENT_CALL(void, SSL, bindState)(TCN_STDARGS,
+                                         jlong ssl /* SSL * */,
+                                         jlong address /* tcn_ssl_state_t * */) {
+    SSL *ssl_ = J2P(ssl, SSL *);
+    tcn_ssl_conn_t *con;
+
+    UNREFERENCED(o);
+
+    if (ssl_ == NULL) {
+        tcn_ThrowException(e, "ssl is null");
+        return;
+    }
+    con = (tcn_ssl_conn_t *)SSL_get_app_data(ssl_);
+    con->state = J2P(address, tcn_ssl_state_t *);
+    if (con->state != NULL) {
+        memset(con->state, 0, sizeof(tcn_ssl_state_t));
+        SSL_update_state(ssl_);
+    }
+}
+
+/* How much did SSL write into this BIO? */
+TCN_IMPLEMENT_CALL(jint /* nbytes */, SSL, pendingWrittenBytesInBIO)(TCN_STDARGS,
+                                                                     jlong bio /* BIO * */) {
+    UNREFERENCED_STDARGS;
+
+    return BIO_ctrl_pending(J2P(bio, BIO *));
+}
+
+/* How much is available for reading in the given SSL struct? */
+TCN_IMPLEMENT_CALL(jint, SSL, pendingReadableBytesInSSL)(TCN_STDARGS, jlong ssl /* SSL * */) {
+    UNREFERENCED_STDARGS;
+
+    return SSL_pending(J2P(ssl, SSL *));
+}
+
+/* Write wlen bytes from wbuf into bio */
+TCN_IMPLEMENT_CALL(jint /* status */, SSL, writeToBIO)(TCN_STDARGS,
+                                                       jlong bio /* BIO * */,
+                                                       jlong wbuf /* char* */,
+                                                       jint wlen /* sizeof(wbuf) */) {
+    BIO *bio_ = J2P(bio, BIO *);
+    tcn_ssl_conn_t *con;
+    int rv;
+
+    UNREFERENCED_STDARGS;
+
+    rv = BIO_write(bio_, J2P(wbuf, void *), wlen);
+    if ((con = BIO_get_app_data(bio_)) != NULL)
+        SSL_update_state(con->ssl);
+    return rv;
+}
+
+/* Read up to rlen bytes from bio into rbuf */
+TCN_IMPLEMENT_CALL(jint /* status */, SSL, readFromBIO)(TCN_STDARGS,
+                                                        jlong bio /* BIO * */,
+                                                        jlong rbuf /* char * */,
+                                                        jint rlen /* sizeof(rbuf) - 1 */) {
+    BIO *bio_ = J2P(bio, BIO *);
+    tcn_ssl_conn_t *con;
+    int rv;
+
+    UNREFERENCED_STDARGS;
+
+    rv = BIO_read(bio_, J2P(rbuf, void *), rlen);
+    if ((con = BIO_get_app_data(bio_)) != NULL)
+        SSL_update_state(con->ssl);
+    return rv;
+}
+
+/*
+ * Dynamic record sizing.  Right after a handshake and after an idle
+ * period, records are limited to record_small bytes so that each fits
+ * into a single TCP segment and can be decrypted as soon as it arrives.
+ * Once record_threshold bytes went out, full size records are used.
+ * A write is cut at the threshold, so callers must accept short writes.
+ */
+static int ssl_write_sized(SSL *ssl, const void *buf, int len)
+{
+    tcn_ssl_conn_t *con = (tcn_ssl_conn_t *)SSL_get_app_data(ssl);
+    tcn_ssl_ctxt_t *c;
+    int n;
+
+    if (con == NULL || (c = con->ctx) == NULL || c->record_small == 0)
+        return SSL_write(ssl, buf, len);
+
+    if (con->record_retry > 0) {
+        /* A failed write must be retried with the same length */
+        len = TCN_MIN(len, con->record_retry);
+    }
+    else {
+        apr_time_t now = apr_time_now();
+        int fragment;
+
+        if (now - con->record_last > c->record_idle)
+            con->record_bytes = 0;
+        con->record_last = now;
+        if (con->record_bytes < c->record_threshold) {
+            fragment = c->record_small;
+            len = (int)TCN_MIN((apr_size_t)len,
+                               c->record_threshold - con->record_bytes);
+        }
+        else {
+            fragment = SSL3_RT_MAX_PLAIN_LENGTH;
+        }
+        if (fragment != con->record_fragment) {
+            SSL_set_max_send_fragment(ssl, fragment);
+#ifdef SSL_set_split_send_fragment
+            /* Lowering the maximum lowers the split size, but not back */
+            if (fragment == SSL3_RT_MAX_PLAIN_LENGTH && c->split_send_fragment > 0)
+                SSL_set_split_send_fragment(ssl, c->split_send_fragment);
+            else
+                SSL_set_split_send_fragment(ssl, fragment);
+#endif
+            con->record_fragment = fragment;
+        }
+    }
+    n = SSL_write(ssl, buf, len);
+    if (n > 0) {
+        con->record_bytes += n;
+        con->record_retry  = 0;
+    }
+    else {
+        /* Only a write that would block is repeated by the caller,
+         * SSL_get_error leaves the error queue for it as it is */
+        switch (SSL_get_error(ssl, n)) {
+            case SSL_ERROR_WANT_WRITE:
+            case SSL_ERROR_WANT_READ:
+                con->record_retry = len;
+                break;
+            default:
+                con->record_retry = 0;
+                break;
+        }
+    }
+    return n;
+}
+
+/* Write up to wlen bytes of application data to the ssl BIO (encrypt) */
+TCN_IMPLEMENT_CALL(jint /* status */, SSL, writeToSSL)(TCN_STDARGS,
+                                                       jlong ssl /* SSL * */,
+                                                       jlong wbuf /* char * */,
+                                                       jint wlen /* sizeof(wbuf) */) {
+    SSL *ssl_ = J2P(ssl, SSL *);
+    int rv;
+
+    UNREFERENCED_STDARGS;
+
+    rv = ssl_write_sized(ssl_, J2P(wbuf, void *), wlen);
+    SSL_update_state(ssl_);
+    return rv;
+}
+
+/* Largest number of buffers handled by a single gather write */
+#define TCN_SSL_MAX_GATHER  64
+
+/*
+ * Largest plaintext handed to a single SSL_write.  With pipelining
+ * OpenSSL encrypts that many records at once, the multi-block
+ * AES-CBC-HMAC-SHA ciphers need at least four.
+ */
+static int ssl_write_chunk(SSL *ssl)
+{
+    tcn_ssl_conn_t *con = (tcn_ssl_conn_t *)SSL_get_app_data(ssl);
+
+    if (con != NULL && con->ctx != NULL && con->ctx->max_pipelines > 1)
+        return SSL3_RT_MAX_PLAIN_LENGTH * con->ctx->max_pipelines;
+    return SSL3_RT_MAX_PLAIN_LENGTH;
+}
+
+/*
+ * Write application data gathered from count buffers, starting at
+ * offset, packing it into full size records.  Small buffers are staged
+ * until a record is full; a buffer holding at least a full record is
+ * encrypted in place.  Since the staging only depends on the data
+ * offered, a call repeated after SSL_ERROR_WANT_WRITE with the
+ * unconsumed buffers retries exactly the same record.
+ */
+TCN_IMPLEMENT_CALL(jint /* status */, SSL, writeToSSLv)(TCN_STDARGS,
+                                                        jlong ssl /* SSL * */,
+                                                        jlongArray wbufs /* char *[] */,
+                                                        jintArray wlens,
+                                                        jint offset,
+                                                        jint count) {
+    SSL *ssl_ = J2P(ssl, SSL *);
+    jlong bufs[TCN_SSL_MAX_GATHER];
+    jint lens[TCN_SSL_MAX_GATHER];
+    char stage[SSL3_RT_MAX_PLAIN_LENGTH];
+    int chunk;
+    int staged = 0;
+    int total = 0;
+    int i = 0;
+    int off = 0;
+    int n;
+
+    UNREFERENCED(o);
+
+    if (ssl_ == NULL) {
+        tcn_ThrowException(e, "ssl is null");
+        return 0;
+    }
+    count = TCN_MIN(count, TCN_SSL_MAX_GATHER);
+    if (count <= 0)
+        return 0;
+    (*e)->GetLongArrayRegion(e, wbufs, offset, count, bufs);
+    (*e)->GetIntArrayRegion(e, wlens, offset, count, lens);
+    if ((*e)->ExceptionCheck(e))
+        return 0;
+
+    chunk = ssl_write_chunk(ssl_);
+    while (i < count || staged > 0) {
+        int direct = 0;
+
+        if (i < count && lens[i] - off <= 0) {
+            i++;
+            off = 0;
+            continue;
+        }
+        if (i < count && staged == 0 &&
+            lens[i] - off >= SSL3_RT_MAX_PLAIN_LENGTH) {
+            /* Whole records only, the tail is staged with what follows */
+            int len = TCN_MIN(lens[i] - off, chunk);
+
+            n = ssl_write_sized(ssl_, J2P(bufs[i], const char *) + off,
+                                len - len % SSL3_RT_MAX_PLAIN_LENGTH);
+            direct = 1;
+        }
+        else {
+            if (i < count) {
+                int copy = TCN_MIN(lens[i] - off,
+                                   SSL3_RT_MAX_PLAIN_LENGTH - staged);
+
+                memcpy(stage + staged, J2P(bufs[i], const char *) + off, copy);
+                staged += copy;
+                off    += copy;
+                /* Keep filling the record from the next buffer */
+                if (staged < SSL3_RT_MAX_PLAIN_LENGTH)
+                    continue;
+            }
+            n = ssl_write_sized(ssl_, stage, staged);
+        }
+        if (n <= 0) {
+            /* Report what made it, the caller will hit the error again */
+            if (total == 0)
+                total = n;
+            break;
+        }
+        total += n;
+        if (direct) {
+            off += n;
+        }
+        else if (n < staged) {
+            /* Short write, the caller offers the rest again */
+            break;
+        }
+        staged = 0;
+    }
+    SSL_update_state(ssl_);
+    return total;
+}
+
+static apr_ssize_t ssl_pread(jlong fd, char *buf, apr_size_t len,
+                             apr_off_t off)
+{
+#ifdef WIN32
+    OVERLAPPED ov;
+    DWORD n;
+
+    memset(&ov, 0, sizeof(OVERLAPPED));
+    ov.Offset     = (DWORD)off;
+    ov.OffsetHigh = (DWORD)(off >> 32);
+    if (!ReadFile((HANDLE)(apr_intptr_t)fd, buf, (DWORD)len, &n, &ov))
+        return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+    return n;
+#else
+    ssize_t n;
+
+    do {
+        n = pread((int)fd, buf, len, (off_t)off);
+    } while (n < 0 && errno == EINTR);
+    return n;
+#endif
+}
+
+/*
+ * Encrypt len bytes of the file fd, starting at offset, without passing
+ * the data through Java.  With kernel TLS the kernel sends the file,
+ * otherwise it is read in full record chunks.  The chunks only depend
+ * on offset and len, so a call repeated after SSL_ERROR_WANT_WRITE
+ * with the offset advanced by the returned progress retries exactly
+ * the same record.
+ */
+TCN_IMPLEMENT_CALL(jlong /* status */, SSL, sendfile)(TCN_STDARGS,
+                                                      jlong ssl /* SSL * */,
+                                                      jlong fd /* file */,
+                                                      jlong offset,
+                                                      jlong len) {
+    SSL *ssl_ = J2P(ssl, SSL *);
+    char buf[SSL3_RT_MAX_PLAIN_LENGTH];
+    jlong total = 0;
+    int n = 0;
+
+    UNREFERENCED(o);
+
+    if (ssl_ == NULL) {
+        tcn_ThrowException(e, "ssl is null");
+        return 0;
+    }
+
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    if (SSL_get_wbio(ssl_) != NULL && BIO_get_ktls_send(SSL_get_wbio(ssl_))) {
+        while (total < len) {
+            ossl_ssize_t sent = SSL_sendfile(ssl_, (int)fd, (off_t)(offset + total),
+                                             (size_t)(len - total), 0);
+            if (sent <= 0) {
+                n = (int)sent;
+                break;
+            }
+            total += sent;
+        }
+        goto done;
+    }
+#endif
+    while (total < len) {
+        apr_ssize_t rd = ssl_pread(fd, buf,
+                                   (apr_size_t)TCN_MIN(len - total, (jlong)sizeof(buf)),
+                                   (apr_off_t)(offset + total));
+        if (rd <= 0) {
+            /* Short file or read error, report what was sent */
+            if (total == 0)
+                tcn_ThrowAPRException(e, rd == 0 ? APR_EOF : apr_get_os_error());
+            break;
+        }
+        n = ssl_write_sized(ssl_, buf, (int)rd);
+        if (n <= 0)
+            break;
+        total += n;
+    }
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+done:
+#endif
+    SSL_update_state(ssl_);
+    /* As with writeToSSLv, the caller will hit the error again */
+    return total > 0 ? total : n;
+}
+
+/* Read up to rlen bytes of application data from the given SSL BIO (decrypt) */
+TCN_IMPLEMENT_CALL(jint /* status */, SSL, readFromSSL)(TCN_STDARGS,
+                                                        jlong ssl /* SSL * */,
+                                                        jlong rbuf /* char * */,
+                                                        jint rlen /* sizeof(rbuf) - 1 */) {
+    SSL *ssl_ = J2P(ssl, SSL *);
+    int rv;
+
+    UNREFERENCED_STDARGS;
+
+    rv = SSL_read(ssl_, J2P(rbuf, void *), rlen);
+    SSL_update_state(ssl_);
+    return rv;
+}
+
+/*
+ * Scattering SSL_read, filling count buffers, starting at offset, with
+ * application data.  With read ahead and pipelining enabled OpenSSL
+ * decrypts several records for each read from the network.  Once some
+ * data was read it only goes on while more is buffered in the SSL.
+ */
+TCN_IMPLEMENT_CALL(jint /* status */, SSL, readFromSSLv)(TCN_STDARGS,
+                                                         jlong ssl /* SSL * */,
+                                                         jlongArray rbufs /* char *[] */,
+                                                         jintArray rlens,
+                                                         jint offset,
+                                                         jint count) {
+    SSL *ssl_ = J2P(ssl, SSL *);
+    jlong bufs[TCN_SSL_MAX_GATHER];
+    jint lens[TCN_SSL_MAX_GATHER];
+    int total = 0;
+    int i;
+    int n = 0;
+
+    UNREFERENCED(o);
+
+    if (ssl_ == NULL) {
+        tcn_ThrowException(e, "ssl is null");
+        return 0;
+    }
+    count = TCN_MIN(count, TCN_SSL_MAX_GATHER);
+    if (count <= 0)
+        return 0;
+    (*e)->GetLongArrayRegion(e, rbufs, offset, count, bufs);
+    (*e)->GetIntArrayRegion(e, rlens, offset, count, lens);
+    if ((*e)->ExceptionCheck(e))
+        return 0;
+
+    for (i = 0; i < count; i++) {
+        int off = 0;
+
+        while (off < lens[i]) {
+            if (total > 0 && SSL_pending(ssl_) <= 0
+#if !defined(LIBRESSL_VERSION_NUMBER)
+                && !SSL_has_pending(ssl_)
+#endif
+                )
+                goto done;
+            n = SSL_read(ssl_, J2P(bufs[i], char *) + off, lens[i] - off);
+            if (n <= 0)
+                goto done;
+            off   += n;
+            total += n;
+        }
+    }
+done:
+    SSL_update_state(ssl_);
+    return total > 0 ? total : n;
+}
+
+/*
+ * Result of the fused unwrap and wrap calls, packed into a single jlong:
+ *   bits  0-26  bytes produced
+ *   bits 27-53  bytes consumed
+ *   bits 54-57  SSL_get_error() of the last SSL operation
+ *   bits 58-63  TCN_SSL_STATUS_* flags
+ * Both lengths are capped at TCN_SSL_PACKED_MAX for a single call.
+ */
+#define TCN_SSL_PACKED_MAX  ((1 << 27) - 1)
+#define TCN_SSL_PACK(consumed, produced, err, flags)                    \
+    ((jlong)(((apr_uint64_t)(produced))                               | \
+             ((apr_uint64_t)(consumed) << 27)                         | \
+             ((apr_uint64_t)((err) & 0x0F) << 54)                     | \
+             ((apr_uint64_t)((flags) & 0x3F) << 58)))
+
+/*
+ * Result of the *Ex data-path calls, packed into a single jlong:
+ *   bits  0-31  return value of the SSL call
+ *   bits 32-53  library (8 bits) and reason (14 bits) of ERR_peek_error()
+ *   bits 54-57  SSL_get_error() for the return value
+ *   bits 58-63  TCN_SSL_STATUS_* flags
+ */
+#define TCN_SSL_PACK_RESULT(ret, code, err, flags)                      \
+    ((jlong)(((apr_uint64_t)(apr_uint32_t)(ret))                      | \
+             ((apr_uint64_t)((code) & 0x3FFFFF) << 32)                | \
+             ((apr_uint64_t)((err) & 0x0F) << 54)                     | \
+             ((apr_uint64_t)((flags) & 0x3F) << 58)))
+
+#define TCN_SSL_STATUS_NETWORK_PENDING      0x01
+#define TCN_SSL_STATUS_SSL_PENDING          0x02
+#define TCN_SSL_STATUS_IN_INIT              0x04
+#define TCN_SSL_STATUS_HANDSHAKE_DONE       0x08
+#define TCN_SSL_STATUS_RECEIVED_SHUTDOWN    0x10
+#define TCN_SSL_STATUS_RECORD_PENDING       0x20
+
+static int ssl_status_flags(SSL *ssl, int was_init)
+{
+    BIO *wbio = SSL_get_wbio(ssl);
+    int flags = 0;
+
+    /* Ciphertext written by the SSL that the network side has yet to take */
+    if (wbio != NULL && BIO_ctrl_wpending(wbio) > 0)
+        flags |= TCN_SSL_STATUS_NETWORK_PENDING;
+    if (SSL_pending(ssl) > 0)
+        flags |= TCN_SSL_STATUS_SSL_PENDING;
+#if !defined(LIBRESSL_VERSION_NUMBER)
+    /* Records read ahead, but not decrypted yet.  They may be incomplete,
+     * so this does not mean a read succeeds without more network data.
+     */
+    else if (SSL_has_pending(ssl))
+        flags |= TCN_SSL_STATUS_RECORD_PENDING;
+#endif
+    if (SSL_in_init(ssl))
+        flags |= TCN_SSL_STATUS_IN_INIT;
+    else if (was_init)
+        flags |= TCN_SSL_STATUS_HANDSHAKE_DONE;
+    if (SSL_get_shutdown(ssl) & SSL_RECEIVED_SHUTDOWN)
+        flags |= TCN_SSL_STATUS_RECEIVED_SHUTDOWN;
+    return flags;
+}
+
+static jlong ssl_pack_result(SSL *ssl, int ret, int was_init)
+{
+    int err = SSL_ERROR_NONE;
+    int code = 0;
+
+    if (ret <= 0) {
+        unsigned long l;
+
+        err = SSL_get_error(ssl, ret);
+        if ((l = ERR_peek_error()) != 0)
+            code = ((ERR_GET_LIB(l) & 0xFF) << 14) | (ERR_GET_REASON(l) & 0x3FFF);
+    }
+    SSL_update_state(ssl);
+    return TCN_SSL_PACK_RESULT(ret, code, err, ssl_status_flags(ssl, was_init));
+}
+
+/*
+ * Feed up to rlen bytes of ciphertext from rbuf into the network bio,
+ * drive the handshake if it is not finished yet and decrypt as much
+ * application data as fits into wbuf.
+ */
+TCN_IMPLEMENT_CALL(jlong /* status */, SSL, unwrap)(TCN_STDARGS,
+                                                    jlong bio /* BIO * */,
+                                                    jlong ssl /* SSL * */,
+                                                    jlong rbuf /* char * */,
+                                                    jint rlen /* sizeof(rbuf) */,
+                                                    jlong wbuf /* char * */,
+                                                    jint wlen /* sizeof(wbuf) */) {
+    BIO *bio_ = J2P(bio, BIO *);
+    SSL *ssl_ = J2P(ssl, SSL *);
+    const char *in = J2P(rbuf, const char *);
+    char *out = J2P(wbuf, char *);
+    BIO_NETWORK *nb;
+    int consumed = 0;
+    int produced = 0;
+    int was_init;
+    int err;
+    int n;
+
+    UNREFERENCED(o);
+
+    if (ssl_ == NULL) {
+        tcn_ThrowException(e, "ssl is null");
+        return 0;
+    }
+    if (bio_ == NULL) {
+        tcn_ThrowException(e, "bio is null");
+        return 0;
+    }
+    rlen = TCN_MAX(0, TCN_MIN(rlen, TCN_SSL_PACKED_MAX));
+    wlen = TCN_MAX(0, TCN_MIN(wlen, TCN_SSL_PACKED_MAX));
+
+    was_init = SSL_in_init(ssl_);
+    /* Don't let stale errors from another connection leak into this one */
+    SSL_ERR_clear();
+    if ((nb = network_bio_data(bio_)) != NULL) {
+        /* The SSL reads the records straight from rbuf */
+        nb->in     = in;
+        nb->in_len = rlen;
+        nb->in_off = 0;
+    }
+    for (;;) {
+        int fed = 0;
+
+        err = SSL_ERROR_NONE;
+        if (nb == NULL && consumed < rlen) {
+            n = BIO_write(bio_, in + consumed, rlen - consumed);
+            if (n > 0) {
+                consumed += n;
+                fed = 1;
+            }
+        }
+        /* SSL_read() drives the handshake (and renegotiation) on its own */
+        while (produced < wlen) {
+            n = SSL_read(ssl_, out + produced, wlen - produced);
+            if (n <= 0) {
+                err = SSL_get_error(ssl_, n);
+                break;
+            }
+            produced += n;
+        }
+        if (wlen == 0 && SSL_in_init(ssl_)) {
+            n = SSL_do_handshake(ssl_);
+            if (n <= 0)
+                err = SSL_get_error(ssl_, n);
+        }
+        /*
+         * Only go round again if the bio pair was full and the SSL
+         * has since drained it, so that more ciphertext fits.
+         */
+        if (err != SSL_ERROR_WANT_READ || !fed || consumed >= rlen)
+            break;
+    }
+    if (nb != NULL) {
+        consumed   = nb->in_off;
+        nb->in     = NULL;
+        nb->in_len = 0;
+        nb->in_off = 0;
+    }
+
+    SSL_update_state(ssl_);
+    return TCN_SSL_PACK(consumed, produced, err,
+                        ssl_status_flags(ssl_, was_init));
+}
+
+/* Move queued ciphertext from the network bio into out */
+static void ssl_drain_bio(BIO *bio, char *out, int *produced, int len)
+{
+    int n;
+
+    while (*produced < len) {
+        n = BIO_read(bio, out + *produced, len - *produced);
+        if (n <= 0)
+            break;
+        *produced += n;
+    }
+}
+
+/*
+ * Encrypt up to rlen bytes of application data from rbuf and copy the
+ * resulting records from the network bio into wbuf.  The result is
+ * packed the same way as for unwrap.
+ */
+TCN_IMPLEMENT_CALL(jlong /* status */, SSL, wrap)(TCN_STDARGS,
+                                                  jlong bio /* BIO * */,
+                                                  jlong ssl /* SSL * */,
+                                                  jlong rbuf /* char * */,
+                                                  jint rlen /* sizeof(rbuf) */,
+                                                  jlong wbuf /* char * */,
+                                                  jint wlen /* sizeof(wbuf) */) {
+    BIO *bio_ = J2P(bio, BIO *);
+    SSL *ssl_ = J2P(ssl, SSL *);
+    const char *in = J2P(rbuf, const char *);
+    char *out = J2P(wbuf, char *);
+    BIO_NETWORK *nb;
+    int consumed = 0;
+    int produced = 0;
+    int was_init;
+    int chunk;
+    int err = SSL_ERROR_NONE;
+    int n;
+
+    UNREFERENCED(o);
+
+    if (ssl_ == NULL) {
+        tcn_ThrowException(e, "ssl is null");
+        return 0;
+    }
+    if (bio_ == NULL) {
+        tcn_ThrowException(e, "bio is null");
+        return 0;
+    }
+    rlen = TCN_MAX(0, TCN_MIN(rlen, TCN_SSL_PACKED_MAX));
+    wlen = TCN_MAX(0, TCN_MIN(wlen, TCN_SSL_PACKED_MAX));
+
+    was_init = SSL_in_init(ssl_);
+    chunk = ssl_write_chunk(ssl_);
+    SSL_ERR_clear();
+    if ((nb = network_bio_data(bio_)) != NULL) {
+        /* The SSL writes the records straight into wbuf */
+        nb->out     = out;
+        nb->out_len = wlen;
+        nb->out_off = 0;
+    }
+    for (;;) {
+        /* Whatever is queued (handshake, alerts, last record) goes first */
+        if (nb != NULL) {
+            nbs_drain(nb);
+            produced = nb->out_off;
+        }
+        else
+            ssl_drain_bio(bio_, out, &produced, wlen);
+        if (produced >= wlen)
+            break;
+        if (consumed < rlen) {
+            /*
+             * One record (or one batch of pipelined records) at a time,
+             * so that a full destination stops us before more ciphertext
+             * piles up in the bio pair.
+             */
+            n = ssl_write_sized(ssl_, in + consumed,
+                                TCN_MIN(rlen - consumed, chunk));
+            if (n > 0) {
+                consumed += n;
+                err = SSL_ERROR_NONE;
+                continue;
+            }
+        }
+        else if (SSL_in_init(ssl_)) {
+            n = SSL_do_handshake(ssl_);
+            if (n > 0) {
+                err = SSL_ERROR_NONE;
+                continue;
+            }
+        }
+        else {
+            break;
+        }
+        err = SSL_get_error(ssl_, n);
+        /* The bio pair is full, make room and try again */
+        if (err != SSL_ERROR_WANT_WRITE || BIO_ctrl_pending(bio_) == 0)
+            break;
+    }
+    if (nb != NULL) {
+        nbs_drain(nb);
+        produced    = nb->out_off;
+        nb->out     = NULL;
+        nb->out_len = 0;
+        nb->out_off = 0;
+    }
+    else
+        ssl_drain_bio(bio_, out, &produced, wlen);
+
+    SSL_update_state(ssl_);
+    return TCN_SSL_PACK(consumed, produced, err,
+                        ssl_status_flags(ssl_, was_init));
+}
+
+/*
+ * Variants of writeToSSL, readFromSSL and doHandshake that return the
+ * SSL_get_error() state, the pending error and the connection status
+ * together with the result, see TCN_SSL_PACK_RESULT.
+ */
+TCN_IMPLEMENT_CALL(jlong /* status */, SSL, writeToSSLEx)(TCN_STDARGS,
+                                                          jlong ssl /* SSL * */,
+                                                          jlong wbuf /* char * */,
+                                                          jint wlen /* sizeof(wbuf) */) {
+    SSL *ssl_ = J2P(ssl, SSL *);
+    int was_init;
+
+    UNREFERENCED(o);
+
+    if (ssl_ == NULL) {
+        tcn_ThrowException(e, "ssl is null");
+        return 0;
+    }
+    was_init = SSL_in_init(ssl_);
+    SSL_ERR_clear();
+    return ssl_pack_result(ssl_, ssl_write_sized(ssl_, J2P(wbuf, void *), wlen),
+                           was_init);
+}
+
+TCN_IMPLEMENT_CALL(jlong /* status */, SSL, readFromSSLEx)(TCN_STDARGS,
+                                                           jlong ssl /* SSL * */,
+                                                           jlong rbuf /* char * */,
+                                                           jint rlen /* sizeof(rbuf) - 1 */) {
+    SSL *ssl_ = J2P(ssl, SSL *);
+    int was_init;
+
+    UNREFERENCED(o);
+
+    if (ssl_ == NULL) {
+        tcn_ThrowException(e, "ssl is null");
+        return 0;
+    }
+    was_init = SSL_in_init(ssl_);
+    SSL_ERR_clear();
+    return ssl_pack_result(ssl_, SSL_read(ssl_, J2P(rbuf, void *), rlen),
+                           was_init);
+}
+
+TCN_IMPLEMENT_CALL(jlong /* status */, SSL, doHandshakeEx)(TCN_STDARGS,
+                                                           jlong ssl /* SSL * */) {
+    SSL *ssl_ = J2P(ssl, SSL *);
+    int was_init;
+
+    UNREFERENCED(o);
+
+    if (ssl_ == NULL) {
+        tcn_ThrowException(e, "ssl is null");
+        return 0;
+    }
+    was_init = SSL_in_init(ssl_);
+    SSL_ERR_clear();
+    return ssl_pack_result(ssl_, SSL_do_handshake(ssl_), was_init);
+}
+
+/* Get the shutdown status of the engine */
+TCN_IMPLEMENT_CALL(jint /* status */, SSL, getShutdown)(TCN_STDARGS,
+                                                        jlong ssl /* SSL * */) {
+    UNREFERENCED_STDARGS;
+
+    return SSL_get_shutdown(J2P(ssl, SSL *));
+}
+
+/* The network BIO may outlive the connection, drop the back reference */
+static void ssl_release_network_bio(tcn_ssl_conn_t *con)
+{
+    if (con->network_bio != NULL) {
+        BIO_set_app_data(con->network_bio, NULL);
+        BIO_free(con->network_bio);
+        con->network_bio = NULL;
+    }
+}
+
+/*
+ * Per connection settings survive SSL_clear(), remember which ones were
+ * changed so that ssl_recycle() can restore those of the context.
+ */
+static void ssl_mark_override(SSL *ssl, int what)
+{
+    tcn_ssl_conn_t *con = (tcn_ssl_conn_t *)SSL_get_app_data(ssl);
+
+    if (con != NULL)
+        con->overrides |= what;
+}
+
+/*
+ * Give the SSL the cipher lists of its context again.  There is no call
+ * that drops the per SSL lists, so set them from the names the context
+ * resolved to.
+ */
+static int ssl_reset_ciphers(SSL *ssl, SSL_CTX *ctx)
+{
+    STACK_OF(SSL_CIPHER) *sk = SSL_CTX_get_ciphers(ctx);
+    char *tls12 = NULL;
+    char *tls13 = NULL;
+    apr_size_t l12 = 0;
+    apr_size_t l13 = 0;
+    apr_size_t len = 1;
+    int rv = 0;
+    int i;
+
+    for (i = 0; i < sk_SSL_CIPHER_num(sk); i++)
+        len += strlen(SSL_CIPHER_get_name(sk_SSL_CIPHER_value(sk, i))) + 1;
+    if ((tls12 = malloc(len)) == NULL || (tls13 = malloc(len)) == NULL)
+        goto cleanup;
+    for (i = 0; i < sk_SSL_CIPHER_num(sk); i++) {
+        const SSL_CIPHER *cipher = sk_SSL_CIPHER_value(sk, i);
+        const char *name = SSL_CIPHER_get_name(cipher);
+        apr_size_t n = strlen(name);
+
+        if (strcmp(SSL_CIPHER_get_version(cipher), "TLSv1.3") == 0) {
+            if (l13 > 0)
+                tls13[l13++] = ':';
+            memcpy(tls13 + l13, name, n);
+            l13 += n;
+        }
+        else {
+            if (l12 > 0)
+                tls12[l12++] = ':';
+            memcpy(tls12 + l12, name, n);
+            l12 += n;
+        }
+    }
+    tls12[l12] = '\0';
+    tls13[l13] = '\0';
+#if !defined(LIBRESSL_VERSION_NUMBER)
+    if (!SSL_set_ciphersuites(ssl, tls13))
+        goto cleanup;
+#endif
+    /* A context without TLSv1.2 ciphers cannot be expressed, do not recycle */
+    if (l12 == 0 || !SSL_set_cipher_list(ssl, tls12))
+        goto cleanup;
+    rv = 1;
+cleanup:
+    free(tls12);
+    free(tls13);
+    return rv;
+}
+
+/* Undo the per connection settings, 0 if the SSL cannot be reused */
+static int ssl_reset_overrides(tcn_ssl_conn_t *con)
+{
+    SSL *ssl = con->ssl;
+    SSL_CTX *ctx = con->ctx->ctx;
+
+    if (con->overrides & TCN_SSL_OVERRIDE_VERIFY)
+        SSL_set_verify(ssl, SSL_CTX_get_verify_mode(ctx),
+                       SSL_CTX_get_verify_callback(ctx));
+    if (con->overrides & TCN_SSL_OVERRIDE_OPTIONS) {
+        SSL_clear_options(ssl, SSL_get_options(ssl) & ~SSL_CTX_get_options(ctx));
+        SSL_set_options(ssl, SSL_CTX_get_options(ctx));
+    }
+    if (con->overrides & TCN_SSL_OVERRIDE_CIPHERS)
+        return ssl_reset_ciphers(ssl, ctx);
+    return 1;
+}
+
+/* Free the SSL * and its associated internal BIO */
+static void ssl_free_connection(SSL *ssl)
+{
+    tcn_ssl_conn_t *con = SSL_get_app_data(ssl);
+
+    if (con != NULL) {
+        ssl_release_network_bio(con);
+        if (con->peer != NULL)
+            X509_free(con->peer);
+    }
+    SSL_free(ssl);
+    if (con != NULL)
+        ssl_conn_free(con);
+}
+
+/*
+ * Reset a freed connection for reuse by newSSL.  SSL_clear() keeps the
+ * SSL_CTX derived configuration and the ex_data, the connection record
+ * is set up again in place.
+ */
+static int ssl_recycle(tcn_ssl_conn_t *con)
+{
+    tcn_ssl_ctxt_t *c = con->ctx;
+    SSL *ssl = con->ssl;
+    apr_uint32_t generation;
+
+    if (c->recycle_closed)
+        return 0;
+    if (con->overrides != 0 && !ssl_reset_overrides(con)) {
+        ERR_clear_error();
+        return 0;
+    }
+    ssl_release_network_bio(con);
+    SSL_set_bio(ssl, NULL, NULL);
+    /*
+     * As SSL_free() does, do not let a session that was not closed with
+     * close_notify be resumed: the connection may have been truncated.
+     * OpenSSL 3 does this in SSL_set_session() too, older releases and
+     * LibreSSL only in SSL_free() and SSL_clear().
+     */
+    if (SSL_get_session(ssl) != NULL &&
+        !(SSL_get_shutdown(ssl) & SSL_SENT_SHUTDOWN) &&
+        !SSL_in_init(ssl) && !SSL_in_before(ssl))
+        SSL_CTX_remove_session(c->ctx, SSL_get_session(ssl));
+    SSL_set_session(ssl, NULL);
+    if (!SSL_clear(ssl))
+        return 0;
+    if (con->record_fragment != 0) {
+        SSL_set_max_send_fragment(ssl, SSL3_RT_MAX_PLAIN_LENGTH);
+#ifdef SSL_set_split_send_fragment
+        SSL_set_split_send_fragment(ssl, c->split_send_fragment > 0 ?
+                                    c->split_send_fragment :
+                                    SSL3_RT_MAX_PLAIN_LENGTH);
+#endif
+    }
+    if (con->peer != NULL)
+        X509_free(con->peer);
+    ERR_clear_error();
+
+    /* The SSL keeps its verify store */
+    generation = con->trust_generation;
+    memset(con, 0, APR_OFFSETOF(tcn_ssl_conn_t, slab_index));
+    con->trust_generation = generation;
+    ssl_init_connection(con, ssl, c);
+    return ssl_recycle_put(c, ssl);
+}
+
+/* Free the connections kept for reuse, no more are taken afterwards */
+void SSL_recycle_drain(tcn_ssl_ctxt_t *c)
+{
+    int i;
+
+    if (c->recycle[0].mutex == NULL || c->recycle_closed)
+        return;
+    c->recycle_closed = 1;
+    for (i = 0; i < SSL_RECYCLE_STRIPES; i++) {
+        tcn_ssl_recycle_t *r = &c->recycle[i];
 
-static void init_bio_methods(void)
-{
-    jbs_methods = BIO_meth_new(BIO_TYPE_FILE, "Java Callback");
-    BIO_meth_set_write(jbs_methods, &jbs_write);
-    BIO_meth_set_read(jbs_methods, &jbs_read);
-    BIO_meth_set_puts(jbs_methods, &jbs_puts);
-    BIO_meth_set_gets(jbs_methods, &jbs_gets);
-    BIO_meth_set_ctrl(jbs_methods, &jbs_ctrl);
-    BIO_meth_set_create(jbs_methods, &jbs_new);
-    BIO_meth_set_destroy(jbs_methods, &jbs_free);
+        apr_thread_mutex_lock(r->mutex);
+        while (r->count > 0)
+            ssl_free_connection(r->ssl[--r->count]);
+        r->size = 0;
+        apr_thread_mutex_unlock(r->mutex);
+    }
 }
 
-static void free_bio_methods(void)
+static void ssl_free(SSL *ssl_)
 {
-    BIO_meth_free(jbs_methods);
+    tcn_ssl_conn_t *con = SSL_get_app_data(ssl_);
+
+    /*
+     * Recycle unless the context is gone.  Its SSL_CTX lives on as long
+     * as we reference it, and loses its application data on cleanup.
+     */
+    if (con != NULL &&
+        SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl_)) == (char *)con->ctx &&
+        con->ctx->recycle[0].mutex != NULL) {
+        /* The connection record is reset by ssl_recycle() */
+        tcn_ssl_ctxt_t *c = con->ctx;
+
+        if (ssl_recycle(con)) {
+            apr_atomic_inc64(&c->recycle_returned);
+            return;
+        }
+        apr_atomic_inc64(&c->recycle_discarded);
+    }
+    ssl_free_connection(ssl_);
 }
 
-/*** Begin Twitter 1:1 API addition ***/
-TCN_IMPLEMENT_CALL(jint, SSL, getLastErrorNumber)(TCN_STDARGS) {
+TCN_IMPLEMENT_CALL(void, SSL, freeSSL)(TCN_STDARGS,
+                                       jlong ssl /* SSL * */) {
     UNREFERENCED_STDARGS;
-    return SSL_ERR_get();
+
+    ssl_free(J2P(ssl, SSL *));
 }
 
-static void ssl_info_callback(const SSL *ssl, int where, int ret) {
-    int *handshakeCount = NULL;
-    if (0 != (where & SSL_CB_HANDSHAKE_DONE)) {
-        handshakeCount = (int*) SSL_get_app_data3(ssl);
-        if (handshakeCount != NULL) {
-            ++(*handshakeCount);
-        }
+static BIO *ssl_make_network_bio(SSL *ssl_)
+{
+    tcn_ssl_conn_t *con;
+    BIO *internal_bio;
+    BIO *network_bio;
+
+    if (BIO_new_bio_pair(&internal_bio, 0, &network_bio, 0) != 1)
+        return NULL;
+
+    SSL_set_bio(ssl_, internal_bio, internal_bio);
+
+    if ((con = (tcn_ssl_conn_t *)SSL_get_app_data(ssl_)) != NULL) {
+        /* Let BIO level calls find the connection */
+        ssl_release_network_bio(con);
+        BIO_up_ref(network_bio);
+        BIO_set_app_data(network_bio, con);
+        con->network_bio = network_bio;
+        SSL_update_state(ssl_);
     }
+    return network_bio;
 }
 
-static apr_status_t ssl_con_pool_cleanup(void *data)
-{
-    SSL *ssl = (SSL*) data;
-    int *destroyCount;
+/* Make a BIO pair (network and internal) for the provided SSL * and return the network BIO */
+TCN_IMPLEMENT_CALL(jlong, SSL, makeNetworkBIO)(TCN_STDARGS,
+                                               jlong ssl /* SSL * */) {
+    SSL *ssl_ = J2P(ssl, SSL *);
+    BIO *network_bio;
 
-    TCN_ASSERT(ssl != 0);
+    UNREFERENCED(o);
 
-    destroyCount = SSL_get_app_data4(ssl);
-    if (destroyCount != NULL) {
-        ++(*destroyCount);
+    if (ssl_ == NULL) {
+        tcn_ThrowException(e, "ssl is null");
+        goto fail;
     }
 
-    return APR_SUCCESS;
+    if ((network_bio = ssl_make_network_bio(ssl_)) == NULL) {
+        tcn_ThrowException(e, "BIO_new_bio_pair failed");
+        goto fail;
+    }
+
+    return P2J(network_bio);
+ fail:
+    return 0;
 }
 
-TCN_IMPLEMENT_CALL(jlong /* SSL * */, SSL, newSSL)(TCN_STDARGS,
-                                                   jlong ctx /* tcn_ssl_ctxt_t * */,
-                                                   jboolean server) {
-    tcn_ssl_ctxt_t *c = J2P(ctx, tcn_ssl_ctxt_t *);
-    int *handshakeCount = malloc(sizeof(int));
-    int *destroyCount = malloc(sizeof(int));
-    SSL *ssl;
-    apr_pool_t *p = NULL;
+/*
+ * Make a network BIO for the provided SSL * that works on the buffers
+ * passed to unwrap and wrap, saving the copy through a BIO pair.  Use
+ * it with unwrap and wrap only.
+ */
+TCN_IMPLEMENT_CALL(jlong, SSL, makeBufferNetworkBIO)(TCN_STDARGS,
+                                                     jlong ssl /* SSL * */) {
+    SSL *ssl_ = J2P(ssl, SSL *);
     tcn_ssl_conn_t *con;
+    BIO *network_bio;
 
-    UNREFERENCED_STDARGS;
-
-    TCN_ASSERT(ctx != 0);
+    UNREFERENCED(o);
 
-    ssl = SSL_new(c->ctx);
-    if (ssl == NULL) {
-        free(handshakeCount);
-        free(destroyCount);
-        tcn_ThrowException(e, "cannot create new ssl");
-        return 0;
+    if (ssl_ == NULL) {
+        tcn_ThrowException(e, "ssl is null");
+        goto fail;
     }
 
-    apr_pool_create(&p, c->pool);
-    if (p == NULL) {
-        free(handshakeCount);
-        free(destroyCount);
-        SSL_free(ssl);
-        tcn_ThrowAPRException(e, apr_get_os_error());
-        return 0;
+    if ((network_bio = BIO_new(nbs_methods)) == NULL) {
+        tcn_ThrowException(e, "Create BIO failed");
+        goto fail;
     }
 
-    if ((con = apr_pcalloc(p, sizeof(tcn_ssl_conn_t))) == NULL) {
-        free(handshakeCount);
-        free(destroyCount);
-        SSL_free(ssl);
-        apr_pool_destroy(p);
-        tcn_ThrowAPRException(e, apr_get_os_error());
-        return 0;
+    /* One reference for the SSL, one for the caller's freeBIO */
+    BIO_up_ref(network_bio);
+    SSL_set_bio(ssl_, network_bio, network_bio);
+
+    if ((con = (tcn_ssl_conn_t *)SSL_get_app_data(ssl_)) != NULL) {
+        ssl_release_network_bio(con);
+        SSL_update_state(ssl_);
     }
-    con->pool = p;
-    con->ctx  = c;
-    con->ssl  = ssl;
-    con->shutdown_type = c->shutdown_type;
 
-    /* Store the handshakeCount in the SSL instance. */
-    *handshakeCount = 0;
-    SSL_set_app_data3(ssl, handshakeCount);
+    return P2J(network_bio);
+ fail:
+    return 0;
+}
 
-    /* Store the destroyCount in the SSL instance. */
-    *destroyCount = 0;
-    SSL_set_app_data4(ssl, destroyCount);
+/*
+ * Bind the SSL * to a connected socket instead of a BIO pair, so that
+ * readFromSSL, writeToSSL and the handshake do the network I/O
+ * themselves.  The socket remains owned by the caller.
+ */
+TCN_IMPLEMENT_CALL(jint, SSL, attachSocket)(TCN_STDARGS,
+                                            jlong ssl /* SSL * */,
+                                            jlong fd /* socket */) {
+    SSL *ssl_ = J2P(ssl, SSL *);
+    apr_os_sock_t osock = (apr_os_sock_t)fd;
+    tcn_ssl_conn_t *con;
+    BIO *bio;
 
-    /* Add callback to keep track of handshakes. */
-    SSL_CTX_set_info_callback(c->ctx, ssl_info_callback);
+    UNREFERENCED(o);
 
-    if (server) {
-        SSL_set_accept_state(ssl);
-    } else {
-        SSL_set_connect_state(ssl);
+    if (ssl_ == NULL) {
+        tcn_ThrowException(e, "ssl is null");
+        return APR_EINVAL;
     }
 
-    /* Setup verify and seed */
-    SSL_set_verify_result(ssl, X509_V_OK);
-    SSL_rand_seed(c->rand_file);
-
-    /* Store for later usage in SSL_callback_SSL_verify */
-    SSL_set_app_data2(ssl, c);
-    SSL_set_app_data(ssl, con);
-    /* Register cleanup that prevent double destruction */
-    apr_pool_cleanup_register(con->pool, (const void *)ssl,
-                              ssl_con_pool_cleanup,
-                              apr_pool_cleanup_null);
+    if ((bio = BIO_new_socket((int)osock, BIO_NOCLOSE)) == NULL) {
+        tcn_ThrowException(e, "Create BIO failed");
+        return APR_ENOMEM;
+    }
+    SSL_set_bio(ssl_, bio, bio);
 
-    return P2J(ssl);
+    if ((con = (tcn_ssl_conn_t *)SSL_get_app_data(ssl_)) != NULL) {
+        ssl_release_network_bio(con);
+        SSL_update_state(ssl_);
+    }
+    return APR_SUCCESS;
 }
 
-/* How much did SSL write into this BIO? */
-TCN_IMPLEMENT_CALL(jint /* nbytes */, SSL, pendingWrittenBytesInBIO)(TCN_STDARGS,
-                                                                     jlong bio /* BIO * */) {
-    UNREFERENCED_STDARGS;
-
-    return BIO_ctrl_pending(J2P(bio, BIO *));
-}
+/*
+ * Ask OpenSSL to hand the record encryption over to the kernel once the
+ * keys are known.  Takes effect only on an SSL bound to a socket with
+ * attachSocket, before the handshake completes, and only for ciphers
+ * the kernel supports; getKTLSStatus reports what was actually enabled.
+ */
+TCN_IMPLEMENT_CALL(jboolean, SSL, enableKTLS)(TCN_STDARGS,
+                                              jlong ssl /* SSL * */) {
+    SSL *ssl_ = J2P(ssl, SSL *);
 
-/* How much is available for reading in the given SSL struct? */
-TCN_IMPLEMENT_CALL(jint, SSL, pendingReadableBytesInSSL)(TCN_STDARGS, jlong ssl /* SSL * */) {
-    UNREFERENCED_STDARGS;
+    UNREFERENCED(o);
 
-    return SSL_pending(J2P(ssl, SSL *));
+    if (ssl_ == NULL) {
+        tcn_ThrowException(e, "ssl is null");
+        return JNI_FALSE;
+    }
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    ssl_mark_override(ssl_, TCN_SSL_OVERRIDE_OPTIONS);
+    SSL_set_options(ssl_, SSL_OP_ENABLE_KTLS);
+    return JNI_TRUE;
+#else
+    return JNI_FALSE;
+#endif
 }
 
-/* Write wlen bytes from wbuf into bio */
-TCN_IMPLEMENT_CALL(jint /* status */, SSL, writeToBIO)(TCN_STDARGS,
-                                                       jlong bio /* BIO * */,
-                                                       jlong wbuf /* char* */,
-                                                       jint wlen /* sizeof(wbuf) */) {
-    UNREFERENCED_STDARGS;
+TCN_IMPLEMENT_CALL(jint, SSL, getKTLSStatus)(TCN_STDARGS,
+                                             jlong ssl /* SSL * */) {
+    SSL *ssl_ = J2P(ssl, SSL *);
+    int status = 0;
 
-    return BIO_write(J2P(bio, BIO *), J2P(wbuf, void *), wlen);
+    UNREFERENCED(o);
 
+    if (ssl_ == NULL) {
+        tcn_ThrowException(e, "ssl is null");
+        return 0;
+    }
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    if (SSL_get_options(ssl_) & SSL_OP_ENABLE_KTLS)
+        status |= SSL_KTLS_REQUESTED;
+    if (SSL_get_wbio(ssl_) != NULL && BIO_get_ktls_send(SSL_get_wbio(ssl_)))
+        status |= SSL_KTLS_TX;
+    if (SSL_get_rbio(ssl_) != NULL && BIO_get_ktls_recv(SSL_get_rbio(ssl_)))
+        status |= SSL_KTLS_RX;
+#endif
+    return status;
 }
 
-/* Read up to rlen bytes from bio into rbuf */
-TCN_IMPLEMENT_CALL(jint /* status */, SSL, readFromBIO)(TCN_STDARGS,
-                                                        jlong bio /* BIO * */,
-                                                        jlong rbuf /* char * */,
-                                                        jint rlen /* sizeof(rbuf) - 1 */) {
+/* Free a BIO * (typically, the network BIO) */
+TCN_IMPLEMENT_CALL(void, SSL, freeBIO)(TCN_STDARGS,
+                                       jlong bio /* BIO * */) {
+    BIO *bio_;
     UNREFERENCED_STDARGS;
 
-    return BIO_read(J2P(bio, BIO *), J2P(rbuf, void *), rlen);
+    bio_ = J2P(bio, BIO *);
+    BIO_free(bio_);
 }
 
-/* Write up to wlen bytes of application data to the ssl BIO (encrypt) */
-TCN_IMPLEMENT_CALL(jint /* status */, SSL, writeToSSL)(TCN_STDARGS,
-                                                       jlong ssl /* SSL * */,
-                                                       jlong wbuf /* char * */,
-                                                       jint wlen /* sizeof(wbuf) */) {
+/* Send CLOSE_NOTIFY to peer */
+TCN_IMPLEMENT_CALL(jint /* status */, SSL, shutdownSSL)(TCN_STDARGS,
+                                                        jlong ssl /* SSL * */) {
+    SSL *ssl_ = J2P(ssl, SSL *);
+    int rv;
+
     UNREFERENCED_STDARGS;
 
-    return SSL_write(J2P(ssl, SSL *), J2P(wbuf, void *), wlen);
+    rv = SSL_shutdown(ssl_);
+    SSL_update_state(ssl_);
+    return rv;
 }
 
-/* Read up to rlen bytes of application data from the given SSL BIO (decrypt) */
-TCN_IMPLEMENT_CALL(jint /* status */, SSL, readFromSSL)(TCN_STDARGS,
-                                                        jlong ssl /* SSL * */,
-                                                        jlong rbuf /* char * */,
-                                                        jint rlen /* sizeof(rbuf) - 1 */) {
-    UNREFERENCED_STDARGS;
+/*
+ * Batched variants of the connection life cycle calls, for accept bursts
+ * and shutdown.  The handles are moved TCN_SSL_MAX_BATCH at a time
+ * between the Java arrays and the stack.
+ */
+#define TCN_SSL_MAX_BATCH   256
 
-    return SSL_read(J2P(ssl, SSL *), J2P(rbuf, void *), rlen);
+/* Check that [offset, offset + count) lies within the array */
+static int ssl_batch_range(JNIEnv *e, jarray array, jint offset, jint count)
+{
+    if (offset < 0 || count < 0 ||
+        offset > (*e)->GetArrayLength(e, array) - count) {
+        tcn_ThrowAPRException(e, APR_EINVAL);
+        return 0;
+    }
+    return 1;
 }
 
-/* Get the shutdown status of the engine */
-TCN_IMPLEMENT_CALL(jint /* status */, SSL, getShutdown)(TCN_STDARGS,
-                                                        jlong ssl /* SSL * */) {
-    UNREFERENCED_STDARGS;
+TCN_IMPLEMENT_CALL(jint, SSL, newSSLBatch)(TCN_STDARGS,
+                                           jlong ctx /* tcn_ssl_ctxt_t * */,
+                                           jboolean server,
+                                           jlongArray ssls /* SSL *[] */,
+                                           jlongArray bios /* BIO *[] */,
+                                           jint offset,
+                                           jint count) {
+    tcn_ssl_ctxt_t *c = J2P(ctx, tcn_ssl_ctxt_t *);
+    jlong hs[TCN_SSL_MAX_BATCH];
+    jlong hb[TCN_SSL_MAX_BATCH];
+    apr_status_t rv = APR_SUCCESS;
+    int done = 0;
 
-    return SSL_get_shutdown(J2P(ssl, SSL *));
-}
+    UNREFERENCED(o);
 
-/* Free the SSL * and its associated internal BIO */
-TCN_IMPLEMENT_CALL(void, SSL, freeSSL)(TCN_STDARGS,
-                                       jlong ssl /* SSL * */) {
-    SSL *ssl_ = J2P(ssl, SSL *);
-    int *handshakeCount = SSL_get_app_data3(ssl_);
-    int *destroyCount = SSL_get_app_data4(ssl_);
-    tcn_ssl_conn_t *con = SSL_get_app_data(ssl_);
+    TCN_ASSERT(ctx != 0);
 
-    UNREFERENCED_STDARGS;
+    /* Validate up front, a failed store would leak the new handles */
+    if (!ssl_batch_range(e, ssls, offset, count))
+        return 0;
+    if (bios != NULL && !ssl_batch_range(e, bios, offset, count))
+        return 0;
+
+    while (done < count && rv == APR_SUCCESS) {
+        int n = TCN_MIN(count - done, TCN_SSL_MAX_BATCH);
+        int i;
 
-    if (destroyCount != NULL) {
-        if (*destroyCount == 0) {
-            apr_pool_destroy(con->pool);
+        for (i = 0; i < n; i++) {
+            SSL *ssl = NULL;
+            BIO *bio = NULL;
+
+            if ((rv = ssl_new_connection(c, server, &ssl)) != APR_SUCCESS)
+                break;
+            if (bios != NULL && (bio = ssl_make_network_bio(ssl)) == NULL) {
+                ssl_free(ssl);
+                rv = APR_ENOMEM;
+                break;
+            }
+            hs[i] = P2J(ssl);
+            hb[i] = P2J(bio);
         }
-        free(destroyCount);
-    }
-    if (handshakeCount != NULL) {
-        free(handshakeCount);
+        if (i > 0) {
+            (*e)->SetLongArrayRegion(e, ssls, offset + done, i, hs);
+            if (bios != NULL && !(*e)->ExceptionCheck(e))
+                (*e)->SetLongArrayRegion(e, bios, offset + done, i, hb);
+            if ((*e)->ExceptionCheck(e)) {
+                /* The caller cannot see this chunk, so nobody would free it */
+                for (n = 0; n < i; n++) {
+                    if (hb[n] != 0)
+                        BIO_free(J2P(hb[n], BIO *));
+                    ssl_free(J2P(hs[n], SSL *));
+                }
+                break;
+            }
+        }
+        done += i;
     }
-    SSL_free(ssl_);
+    /* Keep what was made, the caller sees the shortfall */
+    ERR_clear_error();
+    if (done == 0 && count > 0)
+        tcn_ThrowException(e, "cannot create new ssl");
+    return done;
 }
 
-/* Make a BIO pair (network and internal) for the provided SSL * and return the network BIO */
-TCN_IMPLEMENT_CALL(jlong, SSL, makeNetworkBIO)(TCN_STDARGS,
-                                               jlong ssl /* SSL * */) {
-    SSL *ssl_ = J2P(ssl, SSL *);
-    BIO *internal_bio;
-    BIO *network_bio;
+TCN_IMPLEMENT_CALL(void, SSL, freeSSLBatch)(TCN_STDARGS,
+                                            jlongArray ssls /* SSL *[] */,
+                                            jlongArray bios /* BIO *[] */,
+                                            jlongArray bufs /* char *[] */,
+                                            jintArray lens,
+                                            jint offset,
+                                            jint count,
+                                            jboolean shutdown) {
+    jlong hs[TCN_SSL_MAX_BATCH];
+    jlong hb[TCN_SSL_MAX_BATCH];
+    jlong hd[TCN_SSL_MAX_BATCH];
+    jint ls[TCN_SSL_MAX_BATCH];
+    int done = 0;
 
     UNREFERENCED(o);
 
-    if (ssl_ == NULL) {
-        tcn_ThrowException(e, "ssl is null");
-        goto fail;
+    if (bufs != NULL && (bios == NULL || lens == NULL)) {
+        tcn_ThrowAPRException(e, APR_EINVAL);
+        return;
     }
+    if (!ssl_batch_range(e, ssls, offset, count) ||
+        (bios != NULL && !ssl_batch_range(e, bios, offset, count)) ||
+        (bufs != NULL && (!ssl_batch_range(e, bufs, offset, count) ||
+                          !ssl_batch_range(e, lens, offset, count))))
+        return;
 
-    if (BIO_new_bio_pair(&internal_bio, 0, &network_bio, 0) != 1) {
-        tcn_ThrowException(e, "BIO_new_bio_pair failed");
-        goto fail;
+    while (done < count) {
+        int n = TCN_MIN(count - done, TCN_SSL_MAX_BATCH);
+        int i;
+
+        (*e)->GetLongArrayRegion(e, ssls, offset + done, n, hs);
+        if (bios != NULL)
+            (*e)->GetLongArrayRegion(e, bios, offset + done, n, hb);
+        if (bufs != NULL) {
+            (*e)->GetLongArrayRegion(e, bufs, offset + done, n, hd);
+            (*e)->GetIntArrayRegion(e, lens, offset + done, n, ls);
+        }
+        if ((*e)->ExceptionCheck(e))
+            return;
+        for (i = 0; i < n; i++) {
+            SSL *ssl = J2P(hs[i], SSL *);
+            BIO *bio = bios != NULL ? J2P(hb[i], BIO *) : NULL;
+
+            if (ssl != NULL && shutdown && !SSL_in_init(ssl))
+                SSL_shutdown(ssl);
+            /* Hand the close_notify, and whatever else was not sent yet,
+             * to the caller before the BIO pair goes away.
+             */
+            if (bufs != NULL) {
+                int r = 0;
+
+                if (bio != NULL && hd[i] != 0 && ls[i] > 0)
+                    r = BIO_read(bio, J2P(hd[i], char *), ls[i]);
+                ls[i] = TCN_MAX(r, 0);
+            }
+            if (bio != NULL)
+                BIO_free(bio);
+            if (ssl != NULL)
+                ssl_free(ssl);
+        }
+        if (bufs != NULL)
+            (*e)->SetIntArrayRegion(e, lens, offset + done, n, ls);
+        done += n;
+        /* Everything so far is freed, the lengths are lost */
+        if ((*e)->ExceptionCheck(e))
+            break;
     }
+    /* Nobody is left to report the shutdown errors to */
+    ERR_clear_error();
+}
 
-    SSL_set_bio(ssl_, internal_bio, internal_bio);
+TCN_IMPLEMENT_CALL(jint, SSL, shutdownSSLBatch)(TCN_STDARGS,
+                                                jlongArray ssls /* SSL *[] */,
+                                                jintArray results,
+                                                jint offset,
+                                                jint count) {
+    jlong hs[TCN_SSL_MAX_BATCH];
+    jint rs[TCN_SSL_MAX_BATCH];
+    int complete = 0;
+    int done = 0;
 
-    return P2J(network_bio);
- fail:
-    return 0;
+    UNREFERENCED(o);
+
+    while (done < count) {
+        int n = TCN_MIN(count - done, TCN_SSL_MAX_BATCH);
+        int i;
+
+        (*e)->GetLongArrayRegion(e, ssls, offset + done, n, hs);
+        if ((*e)->ExceptionCheck(e))
+            return complete;
+        for (i = 0; i < n; i++) {
+            SSL *ssl = J2P(hs[i], SSL *);
+
+            rs[i] = 0;
+            if (ssl == NULL)
+                continue;
+            rs[i] = SSL_shutdown(ssl);
+            SSL_update_state(ssl);
+            if (rs[i] == 1)
+                complete++;
+        }
+        if (results != NULL) {
+            (*e)->SetIntArrayRegion(e, results, offset + done, n, rs);
+            if ((*e)->ExceptionCheck(e))
+                break;
+        }
+        done += n;
+    }
+    return complete;
 }
 
-/* Free a BIO * (typically, the network BIO) */
-TCN_IMPLEMENT_CALL(void, SSL, freeBIO)(TCN_STDARGS,
-                                       jlong bio /* BIO * */) {
-    BIO *bio_;
-    UNREFERENCED_STDARGS;
+TCN_IMPLEMENT_CALL(jint, SSL, pendingWrittenBytesInBIOBatch)(TCN_STDARGS,
+                                                             jlongArray bios /* BIO *[] */,
+                                                             jintArray pending,
+                                                             jint offset,
+                                                             jint count) {
+    jlong hb[TCN_SSL_MAX_BATCH];
+    jint ps[TCN_SSL_MAX_BATCH];
+    int nonempty = 0;
+    int done = 0;
 
-    bio_ = J2P(bio, BIO *);
-    BIO_free(bio_);
+    UNREFERENCED(o);
+
+    while (done < count) {
+        int n = TCN_MIN(count - done, TCN_SSL_MAX_BATCH);
+        int i;
+
+        (*e)->GetLongArrayRegion(e, bios, offset + done, n, hb);
+        if ((*e)->ExceptionCheck(e))
+            return nonempty;
+        for (i = 0; i < n; i++) {
+            ps[i] = hb[i] != 0 ? (jint)BIO_ctrl_pending(J2P(hb[i], BIO *)) : 0;
+            if (ps[i] > 0)
+                nonempty++;
+        }
+        (*e)->SetIntArrayRegion(e, pending, offset + done, n, ps);
+        if ((*e)->ExceptionCheck(e))
+            break;
+        done += n;
+    }
+    return nonempty;
 }
 
-/* Send CLOSE_NOTIFY to peer */
-TCN_IMPLEMENT_CALL(jint /* status */, SSL, shutdownSSL)(TCN_STDARGS,
-                                                        jlong ssl /* SSL * */) {
-    UNREFERENCED_STDARGS;
+TCN_IMPLEMENT_CALL(jint, SSL, pendingReadableBytesInSSLBatch)(TCN_STDARGS,
+                                                              jlongArray ssls /* SSL *[] */,
+                                                              jintArray pending,
+                                                              jint offset,
+                                                              jint count) {
+    jlong hs[TCN_SSL_MAX_BATCH];
+    jint ps[TCN_SSL_MAX_BATCH];
+    int nonempty = 0;
+    int done = 0;
 
-    return SSL_shutdown(J2P(ssl, SSL *));
+    UNREFERENCED(o);
+
+    while (done < count) {
+        int n = TCN_MIN(count - done, TCN_SSL_MAX_BATCH);
+        int i;
+
+        (*e)->GetLongArrayRegion(e, ssls, offset + done, n, hs);
+        if ((*e)->ExceptionCheck(e))
+            return nonempty;
+        for (i = 0; i < n; i++) {
+            ps[i] = hs[i] != 0 ? SSL_pending(J2P(hs[i], SSL *)) : 0;
+            if (ps[i] > 0)
+                nonempty++;
+        }
+        (*e)->SetIntArrayRegion(e, pending, offset + done, n, ps);
+        if ((*e)->ExceptionCheck(e))
+            break;
+        done += n;
+    }
+    return nonempty;
 }
 
 /* Read which cipher was negotiated for the given SSL *. */
@@ -770,6 +2727,8 @@ TCN_IMPLEMENT_CALL(jint, SSL, isInInit)(TCN_STDARGS,
 TCN_IMPLEMENT_CALL(jint, SSL, doHandshake)(TCN_STDARGS,
                                            jlong ssl /* SSL * */) {
     SSL *ssl_ = J2P(ssl, SSL *);
+    int rv;
+
     if (ssl_ == NULL) {
         tcn_ThrowException(e, "ssl is null");
         return 0;
@@ -777,7 +2736,9 @@ TCN_IMPLEMENT_CALL(jint, SSL, doHandshake)(TCN_STDARGS,
 
     UNREFERENCED(o);
 
-    return SSL_do_handshake(ssl_);
+    rv = SSL_do_handshake(ssl_);
+    SSL_update_state(ssl_);
+    return rv;
 }
 
 TCN_IMPLEMENT_CALL(jint, SSL, renegotiate)(TCN_STDARGS,
@@ -811,6 +2772,7 @@ TCN_IMPLEMENT_CALL(jint, SSL, verifyClientPostHandshake)(TCN_STDARGS,
 #if defined(SSL_OP_NO_TLSv1_3)
     SSL *ssl_ = J2P(ssl, SSL *);
     tcn_ssl_conn_t *con;
+    int rv;
 
     if (ssl_ == NULL) {
         tcn_ThrowException(e, "ssl is null");
@@ -822,7 +2784,9 @@ TCN_IMPLEMENT_CALL(jint, SSL, verifyClientPostHandshake)(TCN_STDARGS,
     con = (tcn_ssl_conn_t *)SSL_get_app_data(ssl_);
     con->pha_state = PHA_STARTED;
 
-    return SSL_verify_client_post_handshake(ssl_);
+    rv = SSL_verify_client_post_handshake(ssl_);
+    SSL_update_state(ssl_);
+    return rv;
 #else
     return 0;
 #endif
@@ -867,6 +2831,7 @@ TCN_IMPLEMENT_CALL(void, SSL, markPostHandshakeAuthComplete)(TCN_STDARGS,
     con = (tcn_ssl_conn_t *)SSL_get_app_data(ssl_);
 
     con->pha_state = PHA_COMPLETE;
+    SSL_update_state(ssl_);
 #endif
 }
 
@@ -1024,6 +2989,7 @@ TCN_IMPLEMENT_CALL(void, SSL, setVerify)(TCN_STDARGS, jlong ssl,
                                                 jint level, jint depth)
 {
     tcn_ssl_ctxt_t *c;
+    tcn_ssl_conn_t *con;
     int verify;
     SSL *ssl_ = J2P(ssl, SSL *);
 
@@ -1032,7 +2998,8 @@ TCN_IMPLEMENT_CALL(void, SSL, setVerify)(TCN_STDARGS, jlong ssl,
         return;
     }
 
-    c = SSL_get_app_data2(ssl_);
+    con = (tcn_ssl_conn_t *)SSL_get_app_data(ssl_);
+    c = con != NULL ? con->ctx : NULL;
 
     verify = SSL_VERIFY_NONE;
 
@@ -1059,6 +3026,7 @@ TCN_IMPLEMENT_CALL(void, SSL, setVerify)(TCN_STDARGS, jlong ssl,
     if (!c->store)
         c->store = SSL_CTX_get_cert_store(c->ctx);
 
+    ssl_mark_override(ssl_, TCN_SSL_OVERRIDE_VERIFY);
     SSL_set_verify(ssl_, verify, SSL_callback_SSL_verify);
 }
 
@@ -1080,6 +3048,7 @@ TCN_IMPLEMENT_CALL(void, SSL, setOptions)(TCN_STDARGS, jlong ssl,
         opt &= ~0x00040000;
     }
 #endif
+    ssl_mark_override(ssl_, TCN_SSL_OVERRIDE_OPTIONS);
     SSL_set_options(ssl_, opt);
 }
 
@@ -1164,6 +3133,7 @@ TCN_IMPLEMENT_CALL(jboolean, SSL, setCipherSuites)(TCN_STDARGS, jlong ssl,
         rv = JNI_FALSE;
         goto free_cipherList;
     }
+    ssl_mark_override(ssl_, TCN_SSL_OVERRIDE_CIPHERS);
 
 #ifndef HAVE_EXPORT_CIPHERS
     /*
@@ -1214,6 +3184,7 @@ TCN_IMPLEMENT_CALL(jboolean, SSL, setCipherSuitesEx)(TCN_STDARGS, jlong ssl,
         rv = JNI_FALSE;
         goto free_cipherSuites;
     }
+    ssl_mark_override(ssl_, TCN_SSL_OVERRIDE_CIPHERS);
 
     if (!SSL_set_ciphersuites(ssl_, J2S(cipherSuites))) {
         char err[TCN_OPENSSL_ERROR_STRING_LENGTH];
@@ -1258,7 +3229,7 @@ TCN_IMPLEMENT_CALL(jbyteArray, SSL, getSessionId)(TCN_STDARGS, jlong ssl)
 
 TCN_IMPLEMENT_CALL(jint, SSL, getHandshakeCount)(TCN_STDARGS, jlong ssl)
 {
-    int *handshakeCount = NULL;
+    tcn_ssl_conn_t *con;
     SSL *ssl_ = J2P(ssl, SSL *);
     if (ssl_ == NULL) {
         tcn_ThrowException(e, "ssl is null");
@@ -1266,9 +3237,9 @@ TCN_IMPLEMENT_CALL(jint, SSL, getHandshakeCount)(TCN_STDARGS, jlong ssl)
     }
     UNREFERENCED(o);
 
-    handshakeCount = SSL_get_app_data3(ssl_);
-    if (handshakeCount != NULL) {
-        return *handshakeCount;
+    con = (tcn_ssl_conn_t *)SSL_get_app_data(ssl_);
+    if (con != NULL) {
+        return con->handshake_count;
     }
     return 0;
 }
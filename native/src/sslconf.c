@@ -135,6 +135,13 @@ TCN_IMPLEMENT_CALL(jlong, SSLConf, make)(TCN_STDARGS, jlong pool,
     c->ocsp_soft_fail    = OCSP_SOFT_FAIL_DEFAULT;
     c->ocsp_timeout      = OCSP_TIMEOUT_DEFAULT;
     c->ocsp_verify_flags = OCSP_VERIFY_FLAGS_DEFAULT;
+    c->ocsp_hedge_delay  = OCSP_HEDGE_DELAY_DEFAULT;
+    c->ocsp_get          = OCSP_GET_DEFAULT;
+    c->ocsp_cache_size   = OCSP_CACHE_SIZE_DEFAULT;
+    c->ocsp_cache_negative_ttl = OCSP_CACHE_NEGATIVE_TTL_DEFAULT;
+    c->ocsp_refresh_ahead = OCSP_REFRESH_AHEAD_DEFAULT;
+    c->crl_dp_fetch      = CRL_DP_FETCH_DEFAULT;
+    c->crl_dp_soft_fail  = CRL_DP_SOFT_FAIL_DEFAULT;
     
     /*
      * Let us cleanup the SSL_CONF context when the pool is destroyed
@@ -218,6 +225,88 @@ TCN_IMPLEMENT_CALL(jint, SSLConf, check)(TCN_STDARGS, jlong cctx,
         goto cleanup;
     }
 
+    if (!strcmp(J2S(cmd), "OCSP_GET")) {
+        if (!strcasecmp(J2S(value), "true"))
+            c->ocsp_get = 1;
+        else
+            c->ocsp_get = 0;
+        rc = 1;
+        goto cleanup;
+    }
+
+    if (!strcmp(J2S(cmd), "OCSP_HEDGE_DELAY")) {
+        int i;
+        errno = 0;
+        i = (int) strtol(J2S(value), NULL, 10);
+        if (!errno) {
+            // Milliseconds, zero asks all the responders of a certificate at once
+            c->ocsp_hedge_delay = apr_time_from_msec(i);
+        }
+        rc = 1;
+        goto cleanup;
+    }
+
+    if (!strcmp(J2S(cmd), "OCSP_CACHE_SIZE")) {
+        int i;
+        errno = 0;
+        i = (int) strtol(J2S(value), NULL, 10);
+        if (!errno) {
+            // Zero disables the cache
+            c->ocsp_cache_size = i;
+        }
+        rc = 1;
+        goto cleanup;
+    }
+
+    if (!strcmp(J2S(cmd), "OCSP_CACHE_NEGATIVE_TTL")) {
+        int i;
+        errno = 0;
+        i = (int) strtol(J2S(value), NULL, 10);
+        if (!errno) {
+            // Configured in milliseconds like OCSP_TIMEOUT
+            c->ocsp_cache_negative_ttl = apr_time_from_msec(i);
+        }
+        rc = 1;
+        goto cleanup;
+    }
+
+    if (!strcmp(J2S(cmd), "CRL_DP_FETCH")) {
+        if (!strcasecmp(J2S(value), "true"))
+            c->crl_dp_fetch = 1;
+        else
+            c->crl_dp_fetch = 0;
+        rc = 1;
+        goto cleanup;
+    }
+
+    if (!strcmp(J2S(cmd), "CRL_DP_SOFT_FAIL")) {
+        if (!strcasecmp(J2S(value), "true"))
+            c->crl_dp_soft_fail = 1;
+        else
+            c->crl_dp_soft_fail = 0;
+        rc = 1;
+        goto cleanup;
+    }
+
+    if (!strcmp(J2S(cmd), "OCSP_STORE_FILE")) {
+        // Kept across restarts, nothing is stored unless set
+        c->ocsp_store_file = apr_pstrdup(c->pool, J2S(value));
+        rc = 1;
+        goto cleanup;
+    }
+
+    if (!strcmp(J2S(cmd), "OCSP_REFRESH_AHEAD")) {
+        int i;
+        errno = 0;
+        i = (int) strtol(J2S(value), NULL, 10);
+        if (!errno) {
+            // Milliseconds before nextUpdate, zero disables the refresh thread
+            c->ocsp_refresh_ahead = apr_time_from_msec(i);
+        }
+        rc = 1;
+        goto cleanup;
+    }
+
     SSL_ERR_clear();
     value_type = SSL_CONF_cmd_value_type(c->cctx, J2S(cmd));
     ec = SSL_ERR_get();
@@ -272,7 +361,8 @@ TCN_IMPLEMENT_CALL(void, SSLConf, assign)(TCN_STDARGS, jlong cctx,
 {
     tcn_ssl_conf_ctxt_t *c = J2P(cctx, tcn_ssl_conf_ctxt_t *);
     tcn_ssl_ctxt_t *sc = J2P(ctx, tcn_ssl_ctxt_t *);
-    UNREFERENCED_STDARGS;
+    apr_status_t rv;
+    UNREFERENCED(o);
     TCN_ASSERT(c != 0);
     TCN_ASSERT(c->cctx != 0);
     TCN_ASSERT(sc != 0);
@@ -282,6 +372,16 @@ TCN_IMPLEMENT_CALL(void, SSLConf, assign)(TCN_STDARGS, jlong cctx,
     sc->ocsp_soft_fail = c->ocsp_soft_fail;
     sc->ocsp_timeout = c->ocsp_timeout;
     sc->ocsp_verify_flags = c->ocsp_verify_flags;
+    sc->ocsp_hedge_delay = c->ocsp_hedge_delay;
+    sc->ocsp_get = c->ocsp_get;
+    SSL_ocsp_cache_configure(sc, c->ocsp_cache_size, c->ocsp_cache_negative_ttl,
+                             c->ocsp_refresh_ahead);
+    if (c->ocsp_store_file != NULL)
+        SSL_ocsp_cache_store(sc, c->ocsp_store_file);
+    sc->crl_dp_soft_fail = c->crl_dp_soft_fail;
+    /* Do not leave revocation checking off while it is configured */
+    if ((rv = SSL_crl_cache_configure(sc, c->crl_dp_fetch)) != APR_SUCCESS)
+        tcn_ThrowAPRException(e, rv);
 }
 
 /* Apply a command to an SSL_CONF context */
@@ -355,6 +455,62 @@ TCN_IMPLEMENT_CALL(jint, SSLConf, apply)(TCN_STDARGS, jlong cctx,
         rc = 1;
         goto cleanup;
     }
+    if (!strcmp(J2S(cmd), "OCSP_CACHE_SIZE")) {
+        /*
+         * Skip as this is a Tomcat specific setting that will have been set
+         * when check() was called.
+         */
+        rc = 1;
+        goto cleanup;
+    }
+    if (!strcmp(J2S(cmd), "OCSP_GET")) {
+        /*
+         * Skip as this is a Tomcat specific setting that will have been set
+         * when check() was called.
+         */
+        rc = 1;
+        goto cleanup;
+    }
+    if (!strcmp(J2S(cmd), "OCSP_HEDGE_DELAY")) {
+        /*
+         * Skip as this is a Tomcat specific setting that will have been set
+         * when check() was called.
+         */
+        rc = 1;
+        goto cleanup;
+    }
+    if (!strcmp(J2S(cmd), "OCSP_CACHE_NEGATIVE_TTL")) {
+        /*
+         * Skip as this is a Tomcat specific setting that will have been set
+         * when check() was called.
+         */
+        rc = 1;
+        goto cleanup;
+    }
+    if (!strcmp(J2S(cmd), "CRL_DP_FETCH") || !strcmp(J2S(cmd), "CRL_DP_SOFT_FAIL")) {
+        /*
+         * Skip as these are Tomcat specific settings that will have been
+         * set when check() was called.
+         */
+        rc = 1;
+        goto cleanup;
+    }
+    if (!strcmp(J2S(cmd), "OCSP_STORE_FILE")) {
+        /*
+         * Skip as this is a Tomcat specific setting that will have been set
+         * when check() was called.
+         */
+        rc = 1;
+        goto cleanup;
+    }
+    if (!strcmp(J2S(cmd), "OCSP_REFRESH_AHEAD")) {
+        /*
+         * Skip as this is a Tomcat specific setting that will have been set
+         * when check() was called.
+         */
+        rc = 1;
+        goto cleanup;
+    }
     SSL_ERR_clear();
     rc = SSL_CONF_cmd(c->cctx, J2S(cmd), buf != NULL ? buf : J2S(value));
     ec = SSL_ERR_get();
@@ -34,10 +34,23 @@ static apr_status_t ssl_context_cleanup(void *data)
     tcn_ssl_ctxt_t *c = (tcn_ssl_ctxt_t *)data;
     if (c) {
         int i;
+        SSL_recycle_drain(c);
+        /* Stops the refresh thread before the SSL_CTX goes */
+        SSL_ocsp_cache_destroy(c);
+        SSL_crl_cache_destroy(c);
         c->crl = NULL;
         c->store = NULL;
-        if (c->ctx)
+        if (c->trust) {
+            X509_STORE_free(c->trust);
+            c->trust = NULL;
+        }
+        SSL_rev_index_destroy(c);
+        SSL_verify_cache_flush(c);
+        if (c->ctx) {
+            /* Outliving connections tell from this the context is gone */
+            SSL_CTX_set_app_data(c->ctx, NULL);
             SSL_CTX_free(c->ctx);
+        }
         c->ctx = NULL;
         for (i = 0; i < SSL_AIDX_MAX; i++) {
             if (c->certs[i]) {
@@ -195,6 +208,8 @@ TCN_IMPLEMENT_CALL(jlong, SSLContext, make)(TCN_STDARGS, jlong pool,
     /* Release idle buffers to the SSL_CTX free list */
     SSL_CTX_set_mode(c->ctx, SSL_MODE_RELEASE_BUFFERS);
 #endif
+    /* A retried gather write re-stages the same data at another address */
+    SSL_CTX_set_mode(c->ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
     /* Default session context id and cache size */
     SSL_CTX_sess_set_cache_size(c->ctx, SSL_DEFAULT_CACHE_SIZE);
     /* Session cache is disabled by default */
@@ -238,6 +253,16 @@ TCN_IMPLEMENT_CALL(jlong, SSLContext, make)(TCN_STDARGS, jlong pool,
     c->ocsp_soft_fail    = OCSP_SOFT_FAIL_DEFAULT;
     c->ocsp_timeout      = OCSP_TIMEOUT_DEFAULT;
     c->ocsp_verify_flags = OCSP_VERIFY_FLAGS_DEFAULT;
+    c->ocsp_hedge_delay  = OCSP_HEDGE_DELAY_DEFAULT;
+    c->ocsp_get          = OCSP_GET_DEFAULT;
+    c->crl_dp_soft_fail  = CRL_DP_SOFT_FAIL_DEFAULT;
+    /* OCSP lookups go straight to the responders if this fails */
+    SSL_ocsp_cache_create(c);
+    /* Without it the trust store cannot be reloaded */
+    if (apr_thread_mutex_create(&c->trust_mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS)
+        c->trust_mutex = NULL;
+    /* setVerifyCache fails without it */
+    SSL_verify_cache_create(c);
 
     return P2J(c);
 init_failed:
@@ -460,6 +485,21 @@ TCN_IMPLEMENT_CALL(jobjectArray, SSLContext, getCiphers)(TCN_STDARGS, jlong ctx)
 }
 
 
+/* Publishes the store CRLs were loaded into, or NULL.  Once reloadTrust
+ * was called c->crl belongs to it.
+ */
+static void ssl_set_crl(tcn_ssl_ctxt_t *c, X509_STORE *store)
+{
+    if (c->trust_mutex == NULL) {
+        c->crl = store;
+        return;
+    }
+    apr_thread_mutex_lock(c->trust_mutex);
+    if (c->trust == NULL)
+        c->crl = store;
+    apr_thread_mutex_unlock(c->trust_mutex);
+}
+
 TCN_IMPLEMENT_CALL(jboolean, SSLContext, setCARevocation)(TCN_STDARGS, jlong ctx,
                                                           jstring file,
                                                           jstring path)
@@ -468,8 +508,10 @@ TCN_IMPLEMENT_CALL(jboolean, SSLContext, setCARevocation)(TCN_STDARGS, jlong ctx
     TCN_ALLOC_CSTRING(file);
     TCN_ALLOC_CSTRING(path);
     jboolean rv = JNI_FALSE;
+    X509_STORE *store;
     X509_LOOKUP *lookup;
     char err[TCN_OPENSSL_ERROR_STRING_LENGTH];
+    int reloaded = 0;
 
     UNREFERENCED(o);
     TCN_ASSERT(ctx != 0);
@@ -477,40 +519,51 @@ TCN_IMPLEMENT_CALL(jboolean, SSLContext, setCARevocation)(TCN_STDARGS, jlong ctx
         return JNI_FALSE;
     }
 
-    if (!c->crl)
-        c->crl = SSL_CTX_get_cert_store(c->ctx);
+    /* Connections no longer use the store of the SSL_CTX */
+    if (c->trust_mutex != NULL) {
+        apr_thread_mutex_lock(c->trust_mutex);
+        reloaded = c->trust != NULL;
+        apr_thread_mutex_unlock(c->trust_mutex);
+    }
+    if (reloaded) {
+        tcn_Throw(e, "The trust store was reloaded, use reloadTrust to change its CRLs");
+        goto cleanup;
+    }
+    store = SSL_CTX_get_cert_store(c->ctx);
 
     if (J2S(file)) {
-        lookup = X509_STORE_add_lookup(c->crl, X509_LOOKUP_file());
+        lookup = X509_STORE_add_lookup(store, X509_LOOKUP_file());
         if (lookup == NULL) {
             ERR_error_string_n(SSL_ERR_get(), err, TCN_OPENSSL_ERROR_STRING_LENGTH);
-            c->crl = NULL;
+            ssl_set_crl(c, NULL);
             tcn_Throw(e, "Lookup failed for file %s (%s)", J2S(file), err);
             goto cleanup;
         }
         if (!X509_LOOKUP_load_file(lookup, J2S(file), X509_FILETYPE_PEM)) {
             ERR_error_string_n(SSL_ERR_get(), err, TCN_OPENSSL_ERROR_STRING_LENGTH);
-            c->crl = NULL;
+            ssl_set_crl(c, NULL);
             tcn_Throw(e, "Load failed for file %s (%s)", J2S(file), err);
             goto cleanup;
         }
     }
     if (J2S(path)) {
-        lookup = X509_STORE_add_lookup(c->crl, X509_LOOKUP_hash_dir());
+        lookup = X509_STORE_add_lookup(store, X509_LOOKUP_hash_dir());
         if (lookup == NULL) {
             ERR_error_string_n(SSL_ERR_get(), err, TCN_OPENSSL_ERROR_STRING_LENGTH);
-            c->crl = NULL;
+            ssl_set_crl(c, NULL);
             tcn_Throw(e, "Lookup failed for path %s (%s)", J2S(file), err);
             goto cleanup;
         }
         if (!X509_LOOKUP_add_dir(lookup, J2S(path), X509_FILETYPE_PEM)) {
             ERR_error_string_n(SSL_ERR_get(), err, TCN_OPENSSL_ERROR_STRING_LENGTH);
-            c->crl = NULL;
+            ssl_set_crl(c, NULL);
             tcn_Throw(e, "Load failed for path %s (%s)", J2S(file), err);
             goto cleanup;
         }
     }
-    X509_STORE_set_flags(c->crl, X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
+    X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
+    ssl_set_crl(c, store);
+    SSL_verify_cache_flush(c);
     rv = JNI_TRUE;
 cleanup:
     TCN_FREE_CSTRING(file);
@@ -518,6 +571,167 @@ cleanup:
     return rv;
 }
 
+/* The store peer certificates are verified with, referenced */
+X509_STORE *SSL_trust_store_get(tcn_ssl_ctxt_t *c)
+{
+    X509_STORE *store;
+
+    if (c->trust_mutex == NULL) {
+        store = SSL_CTX_get_cert_store(c->ctx);
+        X509_STORE_up_ref(store);
+        return store;
+    }
+    apr_thread_mutex_lock(c->trust_mutex);
+    store = c->trust != NULL ? c->trust : SSL_CTX_get_cert_store(c->ctx);
+    X509_STORE_up_ref(store);
+    apr_thread_mutex_unlock(c->trust_mutex);
+    return store;
+}
+
+/* Gives a connection the store of the last reloadTrust.  The one it had
+ * goes once no handshake uses it any more.
+ */
+void SSL_trust_store_apply(tcn_ssl_ctxt_t *c, SSL *ssl)
+{
+    tcn_ssl_conn_t *con = (tcn_ssl_conn_t *)SSL_get_app_data(ssl);
+    X509_STORE *store;
+
+    apr_thread_mutex_lock(c->trust_mutex);
+    store = c->trust;
+    X509_STORE_up_ref(store);
+    con->trust_generation = c->trust_generation;
+    apr_thread_mutex_unlock(c->trust_mutex);
+    SSL_set0_verify_cert_store(ssl, store);
+}
+
+TCN_IMPLEMENT_CALL(jlong, SSLContext, reloadTrust)(TCN_STDARGS, jlong ctx,
+                                                   jstring cafile,
+                                                   jstring capath,
+                                                   jstring crlfile,
+                                                   jstring crlpath,
+                                                   jint flags)
+{
+    tcn_ssl_ctxt_t *c = J2P(ctx, tcn_ssl_ctxt_t *);
+    TCN_ALLOC_CSTRING(cafile);
+    TCN_ALLOC_CSTRING(capath);
+    TCN_ALLOC_CSTRING(crlfile);
+    TCN_ALLOC_CSTRING(crlpath);
+    X509_STORE *store, *old;
+    X509_LOOKUP *lookup;
+    char err[TCN_OPENSSL_ERROR_STRING_LENGTH];
+    jlong rv = 0;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(ctx != 0);
+    if (c->trust_mutex == NULL) {
+        tcn_ThrowAPRException(e, APR_ENOTIMPL);
+        goto cleanup;
+    }
+    /* Built while the old one is still in use */
+    if ((store = X509_STORE_new()) == NULL) {
+        tcn_ThrowAPRException(e, APR_ENOMEM);
+        goto cleanup;
+    }
+    if ((J2S(cafile) || J2S(capath)) &&
+        !X509_STORE_load_locations(store, J2S(cafile), J2S(capath))) {
+        ERR_error_string_n(SSL_ERR_get(), err, TCN_OPENSSL_ERROR_STRING_LENGTH);
+        tcn_Throw(e, "Unable to load CA certificates (%s)", err);
+        goto failed;
+    }
+    if (J2S(crlfile)) {
+        if ((lookup = X509_STORE_add_lookup(store, X509_LOOKUP_file())) == NULL ||
+            !X509_LOOKUP_load_file(lookup, J2S(crlfile), X509_FILETYPE_PEM)) {
+            ERR_error_string_n(SSL_ERR_get(), err, TCN_OPENSSL_ERROR_STRING_LENGTH);
+            tcn_Throw(e, "Load failed for file %s (%s)", J2S(crlfile), err);
+            goto failed;
+        }
+    }
+    if (J2S(crlpath)) {
+        if ((lookup = X509_STORE_add_lookup(store, X509_LOOKUP_hash_dir())) == NULL ||
+            !X509_LOOKUP_add_dir(lookup, J2S(crlpath), X509_FILETYPE_PEM)) {
+            ERR_error_string_n(SSL_ERR_get(), err, TCN_OPENSSL_ERROR_STRING_LENGTH);
+            tcn_Throw(e, "Load failed for path %s (%s)", J2S(crlpath), err);
+            goto failed;
+        }
+    }
+    if (J2S(crlfile) || J2S(crlpath))
+        flags |= X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL;
+    X509_STORE_set_flags(store, (unsigned long)flags);
+
+    apr_thread_mutex_lock(c->trust_mutex);
+    SSL_crl_cache_attach(c, store);
+    old = c->trust;
+    c->trust = store;
+    c->crl = J2S(crlfile) || J2S(crlpath) ? store : NULL;
+    rv = (jlong)apr_atomic_inc32(&c->trust_generation) + 1;
+    apr_thread_mutex_unlock(c->trust_mutex);
+    if (old != NULL)
+        X509_STORE_free(old);
+    /* The answers were verified against the old trust anchors */
+    SSL_ocsp_cache_flush(c);
+    SSL_verify_cache_flush(c);
+    goto cleanup;
+
+failed:
+    X509_STORE_free(store);
+cleanup:
+    TCN_FREE_CSTRING(cafile);
+    TCN_FREE_CSTRING(capath);
+    TCN_FREE_CSTRING(crlfile);
+    TCN_FREE_CSTRING(crlpath);
+    return rv;
+}
+
+TCN_IMPLEMENT_CALL(jint, SSLContext, buildRevocationIndex)(TCN_STDARGS, jlong ctx,
+                                                          jstring file,
+                                                          jstring crlfile)
+{
+    tcn_ssl_ctxt_t *c = J2P(ctx, tcn_ssl_ctxt_t *);
+    TCN_ALLOC_CSTRING(file);
+    TCN_ALLOC_CSTRING(crlfile);
+    char err[TCN_OPENSSL_ERROR_STRING_LENGTH + 256];
+    jint rv = 0;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(ctx != 0);
+    if (J2S(file) == NULL || J2S(crlfile) == NULL) {
+        tcn_ThrowAPRException(e, APR_EINVAL);
+        goto cleanup;
+    }
+    if ((rv = SSL_rev_index_build(c, J2S(file), J2S(crlfile), err, sizeof(err))) < 0) {
+        tcn_Throw(e, "Unable to build revocation index %s (%s)", J2S(file), err);
+        rv = 0;
+    }
+cleanup:
+    TCN_FREE_CSTRING(file);
+    TCN_FREE_CSTRING(crlfile);
+    return rv;
+}
+
+TCN_IMPLEMENT_CALL(void, SSLContext, setRevocationIndex)(TCN_STDARGS, jlong ctx,
+                                                        jstring file)
+{
+    tcn_ssl_ctxt_t *c = J2P(ctx, tcn_ssl_ctxt_t *);
+    TCN_ALLOC_CSTRING(file);
+    apr_status_t rv;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(ctx != 0);
+    if (c->trust_mutex == NULL) {
+        tcn_ThrowAPRException(e, APR_ENOTIMPL);
+    }
+    else if ((rv = SSL_rev_index_set(c, J2S(file))) == APR_EINVAL) {
+        tcn_Throw(e, "Invalid revocation index %s", J2S(file));
+    }
+    else if (rv != APR_SUCCESS) {
+        tcn_ThrowAPRException(e, rv);
+    }
+    else {
+        SSL_verify_cache_flush(c);
+    }
+    TCN_FREE_CSTRING(file);
+}
+
 TCN_IMPLEMENT_CALL(jboolean, SSLContext, setCertificateChainFile)(TCN_STDARGS, jlong ctx,
                                                                   jstring file,
                                                                   jboolean skipfirst)
@@ -613,6 +827,172 @@ TCN_IMPLEMENT_CALL(void, SSLContext, setShutdownType)(TCN_STDARGS, jlong ctx,
     c->shutdown_type = type;
 }
 
+TCN_IMPLEMENT_CALL(void, SSLContext, setDynamicRecordSizing)(TCN_STDARGS, jlong ctx,
+                                                             jint size, jint threshold,
+                                                             jlong idle)
+{
+    tcn_ssl_ctxt_t *c = J2P(ctx, tcn_ssl_ctxt_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(ctx != 0);
+    if (size <= 0 || threshold <= 0) {
+        c->record_small = 0;
+        return;
+    }
+    /* OpenSSL does not go below 512 byte fragments */
+    c->record_small     = TCN_MAX(512, TCN_MIN(size, SSL3_RT_MAX_PLAIN_LENGTH));
+    c->record_threshold = threshold;
+    c->record_idle      = apr_time_from_msec(TCN_MAX(idle, 0));
+}
+
+TCN_IMPLEMENT_CALL(jboolean, SSLContext, setMaxPipelines)(TCN_STDARGS, jlong ctx,
+                                                          jint pipelines)
+{
+    tcn_ssl_ctxt_t *c = J2P(ctx, tcn_ssl_ctxt_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(ctx != 0);
+#if defined(LIBRESSL_VERSION_NUMBER)
+    return JNI_FALSE;
+#else
+    if (SSL_CTX_set_max_pipelines(c->ctx, pipelines) != 1)
+        return JNI_FALSE;
+    c->max_pipelines = TCN_MAX(pipelines, 1);
+    return JNI_TRUE;
+#endif
+}
+
+TCN_IMPLEMENT_CALL(jboolean, SSLContext, setSplitSendFragment)(TCN_STDARGS, jlong ctx,
+                                                               jint size)
+{
+    tcn_ssl_ctxt_t *c = J2P(ctx, tcn_ssl_ctxt_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(ctx != 0);
+#if defined(LIBRESSL_VERSION_NUMBER)
+    return JNI_FALSE;
+#else
+    if (SSL_CTX_set_split_send_fragment(c->ctx, size) != 1)
+        return JNI_FALSE;
+    c->split_send_fragment = size;
+    return JNI_TRUE;
+#endif
+}
+
+TCN_IMPLEMENT_CALL(void, SSLContext, setReadAhead)(TCN_STDARGS, jlong ctx,
+                                                   jboolean on)
+{
+    tcn_ssl_ctxt_t *c = J2P(ctx, tcn_ssl_ctxt_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(ctx != 0);
+    SSL_CTX_set_read_ahead(c->ctx, on ? 1 : 0);
+}
+
+TCN_IMPLEMENT_CALL(void, SSLContext, setDefaultReadBufferLen)(TCN_STDARGS, jlong ctx,
+                                                              jint len)
+{
+    tcn_ssl_ctxt_t *c = J2P(ctx, tcn_ssl_ctxt_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(ctx != 0);
+#if !defined(LIBRESSL_VERSION_NUMBER)
+    SSL_CTX_set_default_read_buffer_len(c->ctx, (size_t)TCN_MAX(len, 0));
+#endif
+}
+
+/* Registered after the stripe mutexes, so it runs before they are gone */
+static apr_status_t ssl_recycle_cleanup(void *data)
+{
+    SSL_recycle_drain((tcn_ssl_ctxt_t *)data);
+    return APR_SUCCESS;
+}
+
+TCN_IMPLEMENT_CALL(jboolean, SSLContext, setConnectionRecycling)(TCN_STDARGS, jlong ctx,
+                                                                 jint size)
+{
+    tcn_ssl_ctxt_t *c = J2P(ctx, tcn_ssl_ctxt_t *);
+    int stripe = (TCN_MAX(size, 0) + SSL_RECYCLE_STRIPES - 1) / SSL_RECYCLE_STRIPES;
+    int i;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(ctx != 0);
+    if (c->recycle_closed)
+        return JNI_FALSE;
+    if (c->recycle[0].mutex == NULL) {
+        if (size <= 0)
+            return JNI_TRUE;
+        for (i = 0; i < SSL_RECYCLE_STRIPES; i++) {
+            apr_status_t rv = apr_thread_mutex_create(&c->recycle[i].mutex,
+                                                      APR_THREAD_MUTEX_DEFAULT,
+                                                      c->pool);
+            if (rv != APR_SUCCESS) {
+                tcn_ThrowAPRException(e, rv);
+                while (i-- > 0) {
+                    apr_thread_mutex_destroy(c->recycle[i].mutex);
+                    c->recycle[i].mutex = NULL;
+                }
+                return JNI_FALSE;
+            }
+        }
+        apr_pool_cleanup_register(c->pool, (const void *)c,
+                                  ssl_recycle_cleanup,
+                                  apr_pool_cleanup_null);
+    }
+    for (i = 0; i < SSL_RECYCLE_STRIPES; i++) {
+        tcn_ssl_recycle_t *r = &c->recycle[i];
+
+        apr_thread_mutex_lock(r->mutex);
+        if (stripe > r->capacity) {
+            SSL **ssl = apr_pcalloc(c->pool, stripe * sizeof(SSL *));
+
+            if (r->count > 0)
+                memcpy(ssl, r->ssl, r->count * sizeof(SSL *));
+            r->ssl = ssl;
+            r->capacity = stripe;
+        }
+        /* Connections beyond the new size are handed out, not refilled */
+        r->size = stripe;
+        apr_thread_mutex_unlock(r->mutex);
+    }
+    return JNI_TRUE;
+}
+
+TCN_IMPLEMENT_CALL(void, SSLContext, getConnectionRecyclingStats)(TCN_STDARGS, jlong ctx,
+                                                                  jlongArray stats)
+{
+    tcn_ssl_ctxt_t *c = J2P(ctx, tcn_ssl_ctxt_t *);
+    jlong s[5];
+    int i;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(ctx != 0);
+    s[0] = (jlong)apr_atomic_read64(&c->recycle_hits);
+    s[1] = (jlong)apr_atomic_read64(&c->recycle_misses);
+    s[2] = (jlong)apr_atomic_read64(&c->recycle_returned);
+    s[3] = (jlong)apr_atomic_read64(&c->recycle_discarded);
+    s[4] = 0;
+    for (i = 0; i < SSL_RECYCLE_STRIPES; i++)
+        s[4] += c->recycle[i].count;
+    (*e)->SetLongArrayRegion(e, stats, 0, TCN_MIN(5, (*e)->GetArrayLength(e, stats)), s);
+}
+
+TCN_IMPLEMENT_CALL(void, SSLContext, getOCSPCacheStats)(TCN_STDARGS, jlong ctx,
+                                                        jlongArray stats)
+{
+    tcn_ssl_ctxt_t *c = J2P(ctx, tcn_ssl_ctxt_t *);
+    apr_uint64_t v[OCSP_CACHE_STATS];
+    jlong s[OCSP_CACHE_STATS];
+    int i;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(ctx != 0);
+    SSL_ocsp_cache_stats(c, v);
+    for (i = 0; i < OCSP_CACHE_STATS; i++)
+        s[i] = (jlong)v[i];
+    (*e)->SetLongArrayRegion(e, stats, 0, TCN_MIN(OCSP_CACHE_STATS, (*e)->GetArrayLength(e, stats)), s);
+}
+
 TCN_IMPLEMENT_CALL(void, SSLContext, setVerify)(TCN_STDARGS, jlong ctx,
                                                 jint level, jint depth)
 {
@@ -753,8 +1133,11 @@ TCN_IMPLEMENT_CALL(void, SSLContext, setRandom)(TCN_STDARGS, jlong ctx,
 
     TCN_ASSERT(ctx != 0);
     UNREFERENCED(o);
-    if (J2S(file))
+    if (J2S(file)) {
         c->rand_file = apr_pstrdup(c->pool, J2S(file));
+        /* Connections no longer seed, so mix it in right away */
+        SSL_rand_seed(c->rand_file);
+    }
     TCN_FREE_CSTRING(file);
 }
 
@@ -1110,10 +1493,11 @@ int cb_server_alpn(SSL *ssl,
                    const unsigned char *in, unsigned int inlen, void *arg)
 {
     tcn_ssl_ctxt_t *tcsslctx = (tcn_ssl_ctxt_t *)arg;
-    tcn_ssl_conn_t *con = (tcn_ssl_conn_t *)SSL_get_app_data(ssl);
+    apr_pool_t *p;
     apr_array_header_t *client_protos;
     apr_array_header_t *proposed_protos;
-    int i;
+    const char *selected;
+    int i, n, rv = SSL_TLSEXT_ERR_ALERT_FATAL;
     size_t len;
 
     if (inlen == 0) {
@@ -1121,66 +1505,81 @@ int cb_server_alpn(SSL *ssl,
         return SSL_TLSEXT_ERR_ALERT_FATAL;
     }
 
-    client_protos = apr_array_make(con->pool , 0, sizeof(char *));
+    /* Connections have no pool, the copies only live for this call */
+    if (apr_pool_create(&p, NULL) != APR_SUCCESS) {
+        return SSL_TLSEXT_ERR_ALERT_FATAL;
+    }
+
+    client_protos = apr_array_make(p, 0, sizeof(char *));
     for (i = 0; i < inlen; /**/) {
         /* Grab length of next item from leading length byte */
         unsigned int plen = in[i++];
         if (plen + i > inlen) {
             // The protocol name extends beyond the declared length
             // of the protocol list.
-            return SSL_TLSEXT_ERR_ALERT_FATAL;
+            goto cleanup;
         }
-        APR_ARRAY_PUSH(client_protos, char*) = apr_pstrndup(con->pool, (const char *)in+i, plen);
+        APR_ARRAY_PUSH(client_protos, char*) = apr_pstrndup(p, (const char *)in+i, plen);
         i += plen;
     }
 
     if (tcsslctx->alpn == NULL) {
         // Server supported protocol names not set.
-        return SSL_TLSEXT_ERR_ALERT_FATAL;
+        goto cleanup;
     }
 
     if (tcsslctx->alpnlen == 0) {
         // Server supported protocols is an empty list
-        return SSL_TLSEXT_ERR_ALERT_FATAL;
+        goto cleanup;
     }
 
-    proposed_protos = apr_array_make(con->pool, 0, sizeof(char *));
+    proposed_protos = apr_array_make(p, 0, sizeof(char *));
     for (i = 0; i < tcsslctx->alpnlen; /**/) {
         /* Grab length of next item from leading length byte */
         unsigned int plen = tcsslctx->alpn[i++];
         if (plen + i > tcsslctx->alpnlen) {
             // The protocol name extends beyond the declared length
             // of the protocol list.
-            return SSL_TLSEXT_ERR_ALERT_FATAL;
+            goto cleanup;
         }
-        APR_ARRAY_PUSH(proposed_protos, char*) = apr_pstrndup(con->pool, (const char *)tcsslctx->alpn+i, plen);
+        APR_ARRAY_PUSH(proposed_protos, char*) = apr_pstrndup(p, (const char *)tcsslctx->alpn+i, plen);
         i += plen;
     }
 
     if (proposed_protos->nelts <= 0) {
         // Should never happen. The server did not specify any protocols.
-        return SSL_TLSEXT_ERR_ALERT_FATAL;
+        goto cleanup;
     }
 
     /* Now select the most preferred protocol from the proposals. */
-    *out = APR_ARRAY_IDX(proposed_protos, 0, const unsigned char *);
+    n = 0;
+    selected = APR_ARRAY_IDX(proposed_protos, 0, const char *);
     for (i = 1; i < proposed_protos->nelts; ++i) {
         const char *proto = APR_ARRAY_IDX(proposed_protos, i, const char*);
         /* Do we prefer it over existing candidate? */
-        if (ssl_cmp_alpn_protos(client_protos, (const char *)*out, proto) < 0) {
-            *out = (const unsigned char*)proto;
+        if (ssl_cmp_alpn_protos(client_protos, selected, proto) < 0) {
+            selected = proto;
+            n = i;
         }
     }
 
-    len = strlen((const char*)*out);
+    len = strlen(selected);
     if (len > 255) {
         // Agreed protocol name too long
-        return SSL_TLSEXT_ERR_ALERT_FATAL;
+        goto cleanup;
     }
 
+    /* Point at the entry of the context list, the copy goes with the pool */
+    for (i = 0; n > 0; n--) {
+        i += tcsslctx->alpn[i] + 1;
+    }
+    *out = (const unsigned char *)tcsslctx->alpn + i + 1;
     *outlen = (unsigned char)len;
+    rv = SSL_TLSEXT_ERR_OK;
 
-    return SSL_TLSEXT_ERR_OK;
+cleanup:
+    apr_pool_destroy(p);
+    return rv;
 }
 
 TCN_IMPLEMENT_CALL(jint, SSLContext, setALPN)(TCN_STDARGS, jlong ctx,
@@ -1556,7 +1955,8 @@ static const char* SSL_authentication_method(const SSL* ssl) {
 static int SSL_cert_verify(X509_STORE_CTX *ctx, void *arg) {
     /* Get Apache context back through OpenSSL context */
     SSL *ssl = X509_STORE_CTX_get_ex_data(ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
-    tcn_ssl_ctxt_t *c = SSL_get_app_data2(ssl);
+    tcn_ssl_conn_t *con = (tcn_ssl_conn_t *)SSL_get_app_data(ssl);
+    tcn_ssl_ctxt_t *c = con->ctx;
 
 
     // Get a stack of all certs in the chain
@@ -1615,6 +2015,45 @@ static int SSL_cert_verify(X509_STORE_CTX *ctx, void *arg) {
     return r;
 }
 
+/* Verifies the chain of a client unless it verified before, with the
+ * CertificateVerifier if there is one.
+ */
+static int SSL_cert_verify_cached(X509_STORE_CTX *ctx, void *arg)
+{
+    SSL *ssl = X509_STORE_CTX_get_ex_data(ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+    tcn_ssl_conn_t *con = (tcn_ssl_conn_t *)SSL_get_app_data(ssl);
+    tcn_ssl_ctxt_t *c = con->ctx;
+    unsigned char key[VERIFY_CACHE_KEY_LEN];
+    int cached, r;
+
+    /* The key takes the verify epoch before anything is checked */
+    cached = c->verify_cached && SSL_is_server(ssl) &&
+             SSL_verify_cache_key(c, ctx, SSL_authentication_method(ssl), key);
+    if (cached && SSL_verify_cache_get(c, key, ctx)) {
+#if defined(SSL_OP_NO_TLSv1_3)
+        con->pha_state = PHA_COMPLETE;
+#endif
+        return 1;
+    }
+    if (c->verifier != NULL)
+        r = SSL_cert_verify(ctx, arg);
+    else
+        r = X509_verify_cert(ctx) > 0;
+    if (cached && r == 1 && X509_STORE_CTX_get_error(ctx) == X509_V_OK)
+        SSL_verify_cache_put(c, key, ctx);
+    return r;
+}
+
+static void ssl_set_cert_verify(tcn_ssl_ctxt_t *c)
+{
+    if (c->verify_cached)
+        SSL_CTX_set_cert_verify_callback(c->ctx, SSL_cert_verify_cached, NULL);
+    else if (c->verifier != NULL)
+        SSL_CTX_set_cert_verify_callback(c->ctx, SSL_cert_verify, NULL);
+    else
+        SSL_CTX_set_cert_verify_callback(c->ctx, NULL, NULL);
+}
+
 
 TCN_IMPLEMENT_CALL(void, SSLContext, setCertVerifyCallback)(TCN_STDARGS, jlong ctx, jobject verifier)
 {
@@ -1624,7 +2063,10 @@ TCN_IMPLEMENT_CALL(void, SSLContext, setCertVerifyCallback)(TCN_STDARGS, jlong c
     TCN_ASSERT(ctx != 0);
 
     if (verifier == NULL) {
-        SSL_CTX_set_cert_verify_callback(c->ctx, NULL, NULL);
+        if (c->verifier != NULL) {
+            (*e)->DeleteGlobalRef(e, c->verifier);
+            c->verifier = NULL;
+        }
     } else {
         jclass verifier_class = (*e)->GetObjectClass(e, verifier);
         jmethodID method = (*e)->GetMethodID(e, verifier_class, "verify", "(J[[BLjava/lang/String;)Z");
@@ -1638,9 +2080,40 @@ TCN_IMPLEMENT_CALL(void, SSLContext, setCertVerifyCallback)(TCN_STDARGS, jlong c
         }
         c->verifier = (*e)->NewGlobalRef(e, verifier);
         c->verifier_method = method;
-
-        SSL_CTX_set_cert_verify_callback(c->ctx, SSL_cert_verify, NULL);
     }
+    /* The results were those of the previous verifier */
+    SSL_verify_cache_flush(c);
+    ssl_set_cert_verify(c);
+}
+
+TCN_IMPLEMENT_CALL(jboolean, SSLContext, setVerifyCache)(TCN_STDARGS, jlong ctx,
+                                                         jint size, jint ttl)
+{
+    tcn_ssl_ctxt_t *c = J2P(ctx, tcn_ssl_ctxt_t *);
+
+    UNREFERENCED_STDARGS;
+    TCN_ASSERT(ctx != 0);
+    if (c->verify_cache == NULL)
+        return JNI_FALSE;
+    SSL_verify_cache_configure(c, size, apr_time_from_sec(TCN_MAX(ttl, 0)));
+    ssl_set_cert_verify(c);
+    return JNI_TRUE;
+}
+
+TCN_IMPLEMENT_CALL(void, SSLContext, getVerifyCacheStats)(TCN_STDARGS, jlong ctx,
+                                                          jlongArray stats)
+{
+    tcn_ssl_ctxt_t *c = J2P(ctx, tcn_ssl_ctxt_t *);
+    apr_uint64_t v[VERIFY_CACHE_STATS];
+    jlong s[VERIFY_CACHE_STATS];
+    int i;
+
+    UNREFERENCED(o);
+    TCN_ASSERT(ctx != 0);
+    SSL_verify_cache_stats(c, v);
+    for (i = 0; i < VERIFY_CACHE_STATS; i++)
+        s[i] = (jlong)v[i];
+    (*e)->SetLongArrayRegion(e, stats, 0, TCN_MIN(VERIFY_CACHE_STATS, (*e)->GetArrayLength(e, stats)), s);
 }
 
 TCN_IMPLEMENT_CALL(jboolean, SSLContext, setSessionIdContext)(TCN_STDARGS, jlong ctx, jbyteArray sidCtx)
@@ -19,6 +19,8 @@
 
 #include "tcn.h"
 
+#include "apr_file_io.h"
+#include "apr_mmap.h"
 #include "apr_poll.h"
 #include "ssl_private.h"
 
@@ -33,8 +35,47 @@ extern int WIN32_SSL_password_prompt(tcn_pass_cb_t *data);
 #define ASN1_SEQUENCE 0x30
 #define ASN1_OID      0x06
 #define ASN1_STRING   0x86
-static int ssl_verify_OCSP(X509_STORE_CTX *ctx, int timeout, int verifyFlags);
-static int ssl_ocsp_request(X509 *cert, X509 *issuer, X509_STORE_CTX *ctx, int timeout, int verifyFlags);
+#define OCSP_FETCH_CONNECTING 0
+#define OCSP_FETCH_SENDING    1
+#define OCSP_FETCH_RECEIVING  2
+#define OCSP_FETCH_DONE       3
+/* Status lookup of one certificate, asking its responders in turn */
+typedef struct {
+    X509           *cert;
+    X509           *issuer;
+    OCSP_REQUEST   *req;
+    /* path of a RFC 5019 GET request, NULL to POST req */
+    char           *get;
+    char          **urls;
+    int             nurls;
+    /* next URL to ask and the requests in flight */
+    int             next;
+    int             active;
+    /* when the next URL is asked if none has answered */
+    apr_time_t      hedge;
+    int             done;
+    int             status;
+    /* X509_STORE_CTX error the lookup ended with */
+    int             error;
+    apr_time_t      expires;
+    /* keep the DER response of a definitive answer */
+    int             keep;
+    unsigned char  *der;
+    int             derlen;
+    /* download of the CRL of issuer from a distribution point instead,
+     * which ends up in crl */
+    int             dp;
+    X509_CRL       *crl;
+} tcn_ocsp_lookup_t;
+static int ssl_verify_OCSP(X509_STORE_CTX *ctx, tcn_ssl_ctxt_t *c);
+static int ssl_ocsp_request(X509 *cert, X509 *issuer, X509_STORE_CTX *ctx, tcn_ssl_ctxt_t *c);
+static void ssl_ocsp_lookup_init(tcn_ocsp_lookup_t *l, X509 *cert, X509 *issuer, int get,
+                                 apr_pool_t *p);
+static void ssl_ocsp_lookup(tcn_ocsp_lookup_t *lookups, int n, X509_STORE *store,
+                            int timeout, int verifyFlags, apr_interval_time_t hedge);
+static int process_ocsp_response(OCSP_REQUEST *ocsp_req, OCSP_RESPONSE *ocsp_resp, X509 *cert, X509 *issuer,
+        X509_STORE *store, int verifyFlags, int *error, apr_time_t *expires);
+static int process_crl(tcn_ocsp_lookup_t *l, const unsigned char *der, long len);
 #endif
 
 /*  _________________________________________________________________
@@ -43,84 +84,6 @@ static int ssl_ocsp_request(X509 *cert, X509 *issuer, X509_STORE_CTX *ctx, int t
 **  _________________________________________________________________
 */
 
-/* we initialize this index at startup time
- * and never write to it at request time,
- * so this static is thread safe.
- * also note that OpenSSL increments at static variable when
- * SSL_get_ex_new_index() is called, so we _must_ do this at startup.
- */
-static int SSL_app_data2_idx = -1;
-static int SSL_app_data3_idx = -1;
-static int SSL_app_data4_idx = -1;
-
-void SSL_init_app_data_idx(void)
-{
-    int i;
-
-    if (SSL_app_data2_idx > -1) {
-        return;
-    }
-
-    /* we _do_ need to call this twice */
-    for (i = 0; i <= 1; i++) {
-        SSL_app_data2_idx =
-            SSL_get_ex_new_index(0,
-                                 "Second Application Data for SSL",
-                                 NULL, NULL, NULL);
-    }
-
-    if (SSL_app_data3_idx > -1) {
-        return;
-    }
-
-    SSL_app_data3_idx =
-            SSL_get_ex_new_index(0,
-                                 "Third Application Data for SSL",
-                                  NULL, NULL, NULL);
-
-    if (SSL_app_data4_idx > -1) {
-        return;
-    }
-
-    SSL_app_data4_idx =
-            SSL_get_ex_new_index(0,
-                                 "Fourth Application Data for SSL",
-                                  NULL, NULL, NULL);
-
-}
-
-void *SSL_get_app_data2(SSL *ssl)
-{
-    return (void *)SSL_get_ex_data(ssl, SSL_app_data2_idx);
-}
-
-void SSL_set_app_data2(SSL *ssl, void *arg)
-{
-    SSL_set_ex_data(ssl, SSL_app_data2_idx, (char *)arg);
-    return;
-}
-
-
-void *SSL_get_app_data3(const SSL *ssl)
-{
-    return SSL_get_ex_data(ssl, SSL_app_data3_idx);
-}
-
-void SSL_set_app_data3(SSL *ssl, void *arg)
-{
-    SSL_set_ex_data(ssl, SSL_app_data3_idx, arg);
-}
-
-void *SSL_get_app_data4(const SSL *ssl)
-{
-    return SSL_get_ex_data(ssl, SSL_app_data4_idx);
-}
-
-void SSL_set_app_data4(SSL *ssl, void *arg)
-{
-    SSL_set_ex_data(ssl, SSL_app_data4_idx, arg);
-}
-
 /* Simple echo password prompting */
 int SSL_password_prompt(tcn_pass_cb_t *data)
 {
@@ -308,8 +271,6 @@ int SSL_callback_SSL_verify(int ok, X509_STORE_CTX *ctx)
     int depth             = con->ctx->verify_depth;
     int ocsp_check_type   = con->ctx->no_ocsp_check;
     int ocsp_soft_fail    = con->ctx->ocsp_soft_fail;
-    int ocsp_timeout      = con->ctx->ocsp_timeout;
-    int ocsp_verify_flags = con->ctx->ocsp_verify_flags;
 
 #if defined(SSL_OP_NO_TLSv1_3)
     con->pha_state = PHA_COMPLETE;
@@ -325,6 +286,16 @@ int SSL_callback_SSL_verify(int ok, X509_STORE_CTX *ctx)
         return 1;
     }
 
+    /* Serial numbers listed in the revocation index */
+    if (ok) {
+        int revoked = SSL_rev_index_check(con->ctx, ctx);
+        if (revoked != X509_V_OK) {
+            X509_STORE_CTX_set_error(ctx, revoked);
+            errnum = revoked;
+            ok = 0;
+        }
+    }
+
     /*
      * Expired certificates vs. "expired" CRLs: by default, OpenSSL
      * turns X509_V_ERR_CRL_HAS_EXPIRED into a "certificate_expired(45)"
@@ -341,6 +312,13 @@ int SSL_callback_SSL_verify(int ok, X509_STORE_CTX *ctx)
         X509_STORE_CTX_set_error(ctx, -1);
     }
 
+    /* No CRL from a distribution point (yet) */
+    if (!ok && errnum == X509_V_ERR_UNABLE_TO_GET_CRL &&
+        SSL_crl_cache_optional(con->ctx, ctx)) {
+        X509_STORE_CTX_set_error(ctx, X509_V_OK);
+        return 1;
+    }
+
 #ifdef HAVE_OCSP
     /* First perform OCSP validation if possible */
     if (ocsp_check_type == 0) {
@@ -355,7 +333,7 @@ int SSL_callback_SSL_verify(int ok, X509_STORE_CTX *ctx)
                 ok = 0;
             }
             else {
-                int ocsp_response = ssl_verify_OCSP(ctx, ocsp_timeout, ocsp_verify_flags);
+                int ocsp_response = ssl_verify_OCSP(ctx, con->ctx);
                 if (ocsp_response == OCSP_STATUS_REVOKED) {
                     ok = 0 ;
                     errnum = X509_STORE_CTX_get_error(ctx);
@@ -393,8 +371,8 @@ int SSL_callback_SSL_verify(int ok, X509_STORE_CTX *ctx)
 /*
  * This callback function is executed while OpenSSL processes the SSL
  * handshake and does SSL record layer stuff.  It's used to trap
- * client-initiated renegotiations, and for dumping everything to the
- * log.
+ * client-initiated renegotiations, to count the handshakes, and for
+ * dumping everything to the log.
  */
 void SSL_callback_handshake(const SSL *ssl, int where, int rc)
 {
@@ -408,11 +386,19 @@ void SSL_callback_handshake(const SSL *ssl, int where, int rc)
         return;
     }
 
+    if (where & SSL_CB_HANDSHAKE_DONE) {
+        con->handshake_count++;
+        /* Start over with small records */
+        con->record_bytes = 0;
+        SSL_update_state(ssl);
+    }
+
 #ifdef HAVE_TLSV1_3
     /* TLS 1.3 does not use renegotiation so do not update the renegotiation
      * state once we know we are using TLS 1.3. */
     if (session != NULL) {
         if (SSL_SESSION_get_protocol_version(session) == TLS1_3_VERSION) {
+            SSL_update_state(ssl);
             return;
         }
     }
@@ -430,6 +416,7 @@ void SSL_callback_handshake(const SSL *ssl, int where, int rc)
     else if ((where & SSL_CB_HANDSHAKE_DONE) && con->reneg_state == RENEG_INIT) {
         con->reneg_state = RENEG_REJECT;
     }
+    SSL_update_state(ssl);
 }
 
 /* The code here is inspired by nghttp2
@@ -497,8 +484,804 @@ int SSL_callback_alpn_select_proto(SSL* ssl, const unsigned char **out, unsigned
 }
 #ifdef HAVE_OCSP
 
+/*
+ * OCSP response cache
+ *
+ * Each context keeps the answers of its responders keyed by the DER
+ * encoded CERTID, in LRU order.  A definitive answer is kept for as long
+ * as process_ocsp_response() would still accept the response it came
+ * from, anything else for negative_ttl.  Lookups for a certificate that
+ * is being fetched wait for that fetch instead of starting their own.
+ *
+ * With refresh_ahead set a thread per context fetches the answers again
+ * before they expire, for the certificates seen since their last fetch.
+ * Under soft fail a lookup then never contacts a responder itself, it
+ * queues the certificate for the thread and is answered as if the
+ * responder could not be reached.
+ *
+ * With a store file the definitive answers also survive restarts.  The
+ * file is mapped when it is configured and looked up by CERTID hash the
+ * first time a certificate is seen, a response found there is only taken
+ * if it still verifies against the trust store and has not expired.  It
+ * is written again at most every OCSP_STORE_INTERVAL and when the context
+ * is freed, by replacing it.
+ */
+typedef struct tcn_ocsp_entry_t tcn_ocsp_entry_t;
+
+struct tcn_ocsp_entry_t {
+    /* LRU list, most recently used at the head */
+    tcn_ocsp_entry_t *prev;
+    tcn_ocsp_entry_t *next;
+    X509           *cert;
+    X509           *issuer;
+    apr_time_t      expires;
+    /* when the refresh thread fetches the answer again */
+    apr_time_t      refresh;
+    int             status;
+    /* X509_STORE_CTX error the lookup ended with */
+    int             error;
+    /* looked up since the last fetch */
+    int             used;
+    /* a fetch is in flight, entries are not evicted while busy */
+    int             pending;
+    int             waiters;
+    /* looked up in the store file */
+    int             stored;
+    /* DER response of a definitive answer, kept for the store file */
+    unsigned char  *resp;
+    int             resplen;
+    int             idlen;
+    unsigned char  *id;
+};
+
+/* Store file layout, in native byte order: the header, the records sorted
+ * by hash and the CERTIDs and responses they point to.
+ */
+typedef struct {
+    char            magic[8];
+    apr_uint32_t    count;
+    apr_uint32_t    size;
+} tcn_ocsp_store_hdr_t;
+
+typedef struct {
+    apr_uint64_t    hash;
+    apr_int64_t     expires;
+    apr_uint32_t    id;
+    apr_uint32_t    idlen;
+    apr_uint32_t    resp;
+    apr_uint32_t    resplen;
+} tcn_ocsp_store_rec_t;
+
+struct tcn_ocsp_cache_t {
+    tcn_ssl_ctxt_t     *ctx;
+    apr_thread_mutex_t *mutex;
+    /* signals finished fetches and wakes the refresh thread */
+    apr_thread_cond_t  *cond;
+    apr_hash_t         *entries;
+    tcn_ocsp_entry_t   *head;
+    tcn_ocsp_entry_t   *tail;
+    int                 count;
+    /* caching is off while size is 0 */
+    int                 size;
+    apr_interval_time_t negative_ttl;
+    apr_interval_time_t refresh_ahead;
+    apr_thread_t       *thread;
+    int                 stop;
+    apr_uint64_t        hits;
+    apr_uint64_t        misses;
+    apr_uint64_t        coalesced;
+    apr_uint64_t        evictions;
+    apr_uint64_t        refreshes;
+    apr_uint64_t        deferred;
+    apr_uint64_t        restored;
+    /* store file, mapped read-only until the context is freed */
+    apr_pool_t         *store_pool;
+    char               *store_file;
+    const char         *store;
+    apr_size_t          store_size;
+    int                 store_dirty;
+    int                 store_writing;
+    apr_time_t          store_next;
+};
+
+#define OCSP_ENTRY_BUSY(ent) ((ent)->pending || (ent)->waiters)
+/* Longest sleep of an idle refresh thread */
+#define OCSP_REFRESH_WAIT    apr_time_from_sec(60)
+/* Shortest time between two fetches of an answer by the refresh thread */
+#define OCSP_REFRESH_MIN     apr_time_from_sec(1)
+/* Most entries asked about in one round of requests */
+#define OCSP_FETCH_MAX       16
+#define OCSP_STORE_INTERVAL  apr_time_from_sec(60)
+#define OCSP_STORE_MAGIC     "TCNOCSP1"
+
+static void ssl_ocsp_unlink(tcn_ocsp_cache_t *cache, tcn_ocsp_entry_t *ent)
+{
+    if (ent->prev)
+        ent->prev->next = ent->next;
+    else
+        cache->head = ent->next;
+    if (ent->next)
+        ent->next->prev = ent->prev;
+    else
+        cache->tail = ent->prev;
+    ent->prev = ent->next = NULL;
+}
+
+static void ssl_ocsp_link(tcn_ocsp_cache_t *cache, tcn_ocsp_entry_t *ent)
+{
+    ent->prev = NULL;
+    ent->next = cache->head;
+    if (cache->head)
+        cache->head->prev = ent;
+    else
+        cache->tail = ent;
+    cache->head = ent;
+}
+
+static void ssl_ocsp_touch(tcn_ocsp_cache_t *cache, tcn_ocsp_entry_t *ent)
+{
+    if (cache->head != ent) {
+        ssl_ocsp_unlink(cache, ent);
+        ssl_ocsp_link(cache, ent);
+    }
+}
+
+/* Drop idle entries from the tail until no more than limit are left.
+ * Must be called with the mutex held.
+ */
+static void ssl_ocsp_evict(tcn_ocsp_cache_t *cache, int limit)
+{
+    tcn_ocsp_entry_t *ent = cache->tail;
+
+    while (ent != NULL && cache->count > limit) {
+        tcn_ocsp_entry_t *prev = ent->prev;
+        if (!OCSP_ENTRY_BUSY(ent)) {
+            ssl_ocsp_unlink(cache, ent);
+            apr_hash_set(cache->entries, ent->id, ent->idlen, NULL);
+            X509_free(ent->cert);
+            X509_free(ent->issuer);
+            free(ent->resp);
+            free(ent);
+            cache->count--;
+            cache->evictions++;
+        }
+        ent = prev;
+    }
+}
+
+/* Takes a definitive answer.  Must be called with the mutex held. */
+static void ssl_ocsp_entry_answer(tcn_ocsp_cache_t *cache, tcn_ocsp_entry_t *ent, int status,
+                                  int error, apr_time_t expires, apr_time_t now)
+{
+    ent->status  = status;
+    ent->error   = error;
+    ent->expires = expires;
+    /* Chains verified before may contain the certificate */
+    if (status == OCSP_STATUS_REVOKED)
+        SSL_verify_cache_invalidate(cache->ctx);
+    ent->refresh = expires - apr_time_from_sec(OCSP_MAX_SKEW) - cache->refresh_ahead;
+    if (ent->refresh < now + OCSP_REFRESH_MIN)
+        ent->refresh = now + OCSP_REFRESH_MIN;
+}
+
+static apr_uint64_t ssl_ocsp_store_hash(const unsigned char *id, int idlen)
+{
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdlen;
+    apr_uint64_t h = 0;
+    int i;
+
+    if (!EVP_Digest(id, idlen, md, &mdlen, EVP_sha256(), NULL))
+        return 0;
+    for (i = 0; i < 8; i++)
+        h = (h << 8) | md[i];
+    return h;
+}
+
+/* Checks the layout of a mapped store file */
+static int ssl_ocsp_store_valid(const char *store, apr_size_t size)
+{
+    const tcn_ocsp_store_hdr_t *hdr = (const tcn_ocsp_store_hdr_t *)store;
+    const tcn_ocsp_store_rec_t *recs = (const tcn_ocsp_store_rec_t *)(hdr + 1);
+    apr_uint32_t i;
+
+    if (size < sizeof(tcn_ocsp_store_hdr_t) || memcmp(hdr->magic, OCSP_STORE_MAGIC, 8) ||
+        hdr->size != size ||
+        hdr->count > (size - sizeof(tcn_ocsp_store_hdr_t)) / sizeof(tcn_ocsp_store_rec_t))
+        return 0;
+    for (i = 0; i < hdr->count; i++) {
+        if (recs[i].id > size || recs[i].idlen > size - recs[i].id ||
+            recs[i].resp > size || recs[i].resplen > size - recs[i].resp ||
+            (i > 0 && recs[i].hash < recs[i - 1].hash))
+            return 0;
+    }
+    return 1;
+}
+
+static const tcn_ocsp_store_rec_t *ssl_ocsp_store_find(tcn_ocsp_cache_t *cache,
+                                                       const unsigned char *id, int idlen)
+{
+    const tcn_ocsp_store_hdr_t *hdr = (const tcn_ocsp_store_hdr_t *)cache->store;
+    const tcn_ocsp_store_rec_t *recs = (const tcn_ocsp_store_rec_t *)(hdr + 1);
+    apr_uint64_t hash = ssl_ocsp_store_hash(id, idlen);
+    apr_uint32_t lo = 0, hi = hdr->count;
+
+    while (lo < hi) {
+        apr_uint32_t mid = lo + (hi - lo) / 2;
+        if (recs[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; lo < hdr->count && recs[lo].hash == hash; lo++) {
+        if (recs[lo].idlen == (apr_uint32_t)idlen &&
+            !memcmp(cache->store + recs[lo].id, id, idlen))
+            return &recs[lo];
+    }
+    return NULL;
+}
+
+/* Takes the answer of a new entry from the store file if it is still
+ * good.  Must be called with the mutex held.
+ */
+static void ssl_ocsp_store_load(tcn_ocsp_cache_t *cache, tcn_ocsp_entry_t *ent, X509_STORE *store)
+{
+    const tcn_ocsp_store_rec_t *rec;
+    const unsigned char *der;
+    OCSP_RESPONSE *resp;
+    apr_time_t now = apr_time_now();
+    apr_time_t expires = 0;
+    int r, error = X509_V_OK;
+
+    ent->stored = 1;
+    if (cache->store == NULL || ent->cert == NULL ||
+        (rec = ssl_ocsp_store_find(cache, ent->id, ent->idlen)) == NULL ||
+        rec->expires <= now)
+        return;
+    der = (const unsigned char *)cache->store + rec->resp;
+    if ((resp = d2i_OCSP_RESPONSE(NULL, &der, rec->resplen)) == NULL)
+        return;
+    /* No nonce to check, the request is long gone */
+    r = process_ocsp_response(NULL, resp, ent->cert, ent->issuer, store,
+                              cache->ctx->ocsp_verify_flags, &error, &expires);
+    OCSP_RESPONSE_free(resp);
+    if ((r != OCSP_STATUS_OK && r != OCSP_STATUS_REVOKED) || expires <= now ||
+        (ent->resp = malloc(rec->resplen)) == NULL)
+        return;
+    memcpy(ent->resp, cache->store + rec->resp, rec->resplen);
+    ent->resplen = rec->resplen;
+    ssl_ocsp_entry_answer(cache, ent, r,
+                          r == OCSP_STATUS_OK ? X509_V_OK : X509_V_ERR_CERT_REVOKED,
+                          expires, now);
+    cache->restored++;
+}
+
+static int ssl_ocsp_store_cmp(const void *a, const void *b)
+{
+    apr_uint64_t ha = ((const tcn_ocsp_store_rec_t *)a)->hash;
+    apr_uint64_t hb = ((const tcn_ocsp_store_rec_t *)b)->hash;
+
+    return ha < hb ? -1 : ha > hb;
+}
+
+/* Writes the definitive answers that did not expire to the store file,
+ * those of the entries and those of the mapped file no entry replaced.
+ * Called without the mutex.  Unless force is set nothing is written
+ * within OCSP_STORE_INTERVAL of the last write.
+ */
+static void ssl_ocsp_store_sync(tcn_ocsp_cache_t *cache, int force)
+{
+    const tcn_ocsp_store_hdr_t *mhdr;
+    const tcn_ocsp_store_rec_t *mrecs;
+    tcn_ocsp_store_hdr_t *hdr;
+    tcn_ocsp_store_rec_t *recs;
+    tcn_ocsp_entry_t *ent;
+    apr_file_t *f;
+    apr_pool_t *p;
+    char *buf, *file, *tmp;
+    apr_size_t size, off;
+    apr_uint32_t i, n = 0;
+    apr_time_t now;
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(cache->mutex);
+    now = apr_time_now();
+    if (cache->store_file == NULL || !cache->store_dirty || cache->store_writing ||
+        (!force && now < cache->store_next)) {
+        apr_thread_mutex_unlock(cache->mutex);
+        return;
+    }
+    mhdr  = (const tcn_ocsp_store_hdr_t *)cache->store;
+    mrecs = mhdr != NULL ? (const tcn_ocsp_store_rec_t *)(mhdr + 1) : NULL;
+    size  = sizeof(tcn_ocsp_store_hdr_t);
+    for (ent = cache->head; ent != NULL; ent = ent->next) {
+        if (ent->resp != NULL && ent->expires > now) {
+            size += sizeof(tcn_ocsp_store_rec_t) + ent->idlen + ent->resplen;
+            n++;
+        }
+    }
+    for (i = 0; mhdr != NULL && i < mhdr->count; i++) {
+        if (mrecs[i].expires > now &&
+            apr_hash_get(cache->entries, cache->store + mrecs[i].id, mrecs[i].idlen) == NULL) {
+            size += sizeof(tcn_ocsp_store_rec_t) + mrecs[i].idlen + mrecs[i].resplen;
+            n++;
+        }
+    }
+    if (size > APR_UINT32_MAX || (buf = malloc(size)) == NULL) {
+        apr_thread_mutex_unlock(cache->mutex);
+        return;
+    }
+    hdr  = (tcn_ocsp_store_hdr_t *)buf;
+    recs = (tcn_ocsp_store_rec_t *)(hdr + 1);
+    off  = sizeof(tcn_ocsp_store_hdr_t) + n * sizeof(tcn_ocsp_store_rec_t);
+    n    = 0;
+    for (ent = cache->head; ent != NULL; ent = ent->next) {
+        if (ent->resp == NULL || ent->expires <= now)
+            continue;
+        recs[n].hash    = ssl_ocsp_store_hash(ent->id, ent->idlen);
+        recs[n].expires = ent->expires;
+        recs[n].id      = (apr_uint32_t)off;
+        recs[n].idlen   = ent->idlen;
+        memcpy(buf + off, ent->id, ent->idlen);
+        off += ent->idlen;
+        recs[n].resp    = (apr_uint32_t)off;
+        recs[n].resplen = ent->resplen;
+        memcpy(buf + off, ent->resp, ent->resplen);
+        off += ent->resplen;
+        n++;
+    }
+    for (i = 0; mhdr != NULL && i < mhdr->count; i++) {
+        if (mrecs[i].expires <= now ||
+            apr_hash_get(cache->entries, cache->store + mrecs[i].id, mrecs[i].idlen) != NULL)
+            continue;
+        recs[n]       = mrecs[i];
+        recs[n].id    = (apr_uint32_t)off;
+        memcpy(buf + off, cache->store + mrecs[i].id, mrecs[i].idlen);
+        off += mrecs[i].idlen;
+        recs[n].resp  = (apr_uint32_t)off;
+        memcpy(buf + off, cache->store + mrecs[i].resp, mrecs[i].resplen);
+        off += mrecs[i].resplen;
+        n++;
+    }
+    memcpy(hdr->magic, OCSP_STORE_MAGIC, 8);
+    hdr->count = n;
+    hdr->size  = (apr_uint32_t)size;
+    qsort(recs, n, sizeof(tcn_ocsp_store_rec_t), ssl_ocsp_store_cmp);
+    apr_pool_create(&p, NULL);
+    file = apr_pstrdup(p, cache->store_file);
+    cache->store_dirty   = 0;
+    cache->store_writing = 1;
+    cache->store_next    = now + OCSP_STORE_INTERVAL;
+    apr_thread_mutex_unlock(cache->mutex);
+
+    /* Replaced at once, the mapping of the old file stays valid */
+    tmp = apr_pstrcat(p, file, ".tmp", NULL);
+    rv = apr_file_open(&f, tmp, APR_FOPEN_WRITE | APR_FOPEN_CREATE | APR_FOPEN_TRUNCATE |
+                       APR_FOPEN_BINARY, APR_FPROT_UREAD | APR_FPROT_UWRITE, p);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_write_full(f, buf, size, NULL);
+        if (rv == APR_SUCCESS)
+            rv = apr_file_sync(f);
+        apr_file_close(f);
+        if (rv == APR_SUCCESS)
+            rv = apr_file_rename(tmp, file, p);
+        if (rv != APR_SUCCESS)
+            apr_file_remove(tmp, p);
+    }
+    free(buf);
+    apr_pool_destroy(p);
+
+    apr_thread_mutex_lock(cache->mutex);
+    cache->store_writing = 0;
+    if (rv != APR_SUCCESS)
+        cache->store_dirty = 1;
+    apr_thread_mutex_unlock(cache->mutex);
+}
+
+/* Ask the responders about n entries, marked pending by the caller, and
+ * store the answers.  Called with the mutex held, which is released while
+ * the requests are in flight.
+ */
+static void ssl_ocsp_fetch(tcn_ocsp_cache_t *cache, tcn_ocsp_entry_t **ents, int n,
+                           X509_STORE *store)
+{
+    tcn_ssl_ctxt_t *c = cache->ctx;
+    tcn_ocsp_lookup_t lookups[OCSP_FETCH_MAX];
+    apr_pool_t *p;
+    apr_time_t now;
+    int i;
+
+    for (i = 0; i < n; i++)
+        ents[i]->used = 0;
+    apr_thread_mutex_unlock(cache->mutex);
+
+    apr_pool_create(&p, NULL);
+    for (i = 0; i < n; i++) {
+        ssl_ocsp_lookup_init(&lookups[i], ents[i]->cert, ents[i]->issuer, c->ocsp_get, p);
+        lookups[i].keep = cache->store_file != NULL;
+    }
+    ssl_ocsp_lookup(lookups, n, store, c->ocsp_timeout, c->ocsp_verify_flags, c->ocsp_hedge_delay);
+    for (i = 0; i < n; i++) {
+        if (lookups[i].req != NULL)
+            OCSP_REQUEST_free(lookups[i].req);
+    }
+    apr_pool_destroy(p);
+
+    apr_thread_mutex_lock(cache->mutex);
+    now = apr_time_now();
+    for (i = 0; i < n; i++) {
+        tcn_ocsp_entry_t *ent = ents[i];
+        tcn_ocsp_lookup_t *l = &lookups[i];
+
+        if ((l->status == OCSP_STATUS_OK || l->status == OCSP_STATUS_REVOKED) && l->expires > now) {
+            ssl_ocsp_entry_answer(cache, ent, l->status, l->error, l->expires, now);
+            if (l->der != NULL) {
+                free(ent->resp);
+                ent->resp    = l->der;
+                ent->resplen = l->derlen;
+                l->der       = NULL;
+                cache->store_dirty = 1;
+            }
+        }
+        else if (ent->expires > now &&
+                 (ent->status == OCSP_STATUS_OK || ent->status == OCSP_STATUS_REVOKED)) {
+            /* A refresh failed, the previous answer is still good */
+            ent->refresh = now + TCN_MAX(cache->negative_ttl, OCSP_REFRESH_MIN);
+        }
+        else {
+            ent->status  = l->status;
+            ent->error   = l->error;
+            ent->expires = now + cache->negative_ttl;
+            ent->refresh = now + TCN_MAX(cache->negative_ttl, OCSP_REFRESH_MIN);
+            free(ent->resp);
+            ent->resp    = NULL;
+        }
+        free(l->der);
+        ent->pending = 0;
+    }
+    apr_thread_cond_broadcast(cache->cond);
+}
+
+static void *APR_THREAD_FUNC ssl_ocsp_refresh_thread(apr_thread_t *thd, void *data)
+{
+    tcn_ocsp_cache_t *cache = (tcn_ocsp_cache_t *)data;
+
+    apr_thread_mutex_lock(cache->mutex);
+    while (!cache->stop) {
+        tcn_ocsp_entry_t *ent, *due[OCSP_FETCH_MAX];
+        apr_time_t now = apr_time_now();
+        apr_time_t next = now + OCSP_REFRESH_WAIT;
+        int n = 0;
+
+        for (ent = cache->head; ent != NULL; ent = ent->next) {
+            if (ent->pending)
+                continue;
+            if (ent->refresh <= now) {
+                if (ent->used && n < OCSP_FETCH_MAX)
+                    due[n++] = ent;
+            }
+            else if (ent->refresh < next) {
+                next = ent->refresh;
+            }
+        }
+        if (n == 0) {
+            apr_thread_cond_timedwait(cache->cond, cache->mutex, next - now);
+        }
+        else {
+            X509_STORE *store;
+            int i;
+
+            for (i = 0; i < n; i++)
+                due[i]->pending = 1;
+            cache->refreshes += n;
+            /* The context is not freed before this thread is stopped */
+            store = SSL_trust_store_get(cache->ctx);
+            ssl_ocsp_fetch(cache, due, n, store);
+            apr_thread_mutex_unlock(cache->mutex);
+            X509_STORE_free(store);
+            ssl_ocsp_store_sync(cache, 0);
+            apr_thread_mutex_lock(cache->mutex);
+        }
+    }
+    apr_thread_mutex_unlock(cache->mutex);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+static void ssl_ocsp_refresh_stop(tcn_ocsp_cache_t *cache)
+{
+    apr_thread_t *thread;
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(cache->mutex);
+    thread = cache->thread;
+    cache->thread = NULL;
+    cache->stop = 1;
+    apr_thread_cond_broadcast(cache->cond);
+    apr_thread_mutex_unlock(cache->mutex);
+    if (thread != NULL)
+        apr_thread_join(&rv, thread);
+    cache->stop = 0;
+}
+
+/* Runs before the thread's pool, a child of the context pool, is destroyed */
+static apr_status_t ssl_ocsp_cache_pre_cleanup(void *data)
+{
+    ssl_ocsp_refresh_stop((tcn_ocsp_cache_t *)data);
+    return APR_SUCCESS;
+}
+
+apr_status_t SSL_ocsp_cache_create(tcn_ssl_ctxt_t *c)
+{
+    tcn_ocsp_cache_t *cache;
+    apr_status_t rv;
+
+    if ((cache = apr_pcalloc(c->pool, sizeof(tcn_ocsp_cache_t))) == NULL)
+        return APR_ENOMEM;
+    if ((rv = apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                      c->pool)) != APR_SUCCESS)
+        return rv;
+    if ((rv = apr_thread_cond_create(&cache->cond, c->pool)) != APR_SUCCESS)
+        return rv;
+    cache->ctx          = c;
+    cache->entries      = apr_hash_make(c->pool);
+    cache->size         = OCSP_CACHE_SIZE_DEFAULT;
+    cache->negative_ttl = OCSP_CACHE_NEGATIVE_TTL_DEFAULT;
+    apr_pool_pre_cleanup_register(c->pool, cache, ssl_ocsp_cache_pre_cleanup);
+    c->ocsp_cache = cache;
+    return APR_SUCCESS;
+}
+
+void SSL_ocsp_cache_configure(tcn_ssl_ctxt_t *c, int size, apr_interval_time_t negative_ttl,
+                              apr_interval_time_t refresh_ahead)
+{
+    tcn_ocsp_cache_t *cache = c->ocsp_cache;
+    int running;
+
+    if (cache == NULL)
+        return;
+    apr_thread_mutex_lock(cache->mutex);
+    cache->size          = size > 0 ? size : 0;
+    cache->negative_ttl  = negative_ttl > 0 ? negative_ttl : 0;
+    cache->refresh_ahead = refresh_ahead > 0 ? refresh_ahead : 0;
+    ssl_ocsp_evict(cache, cache->size);
+    running = cache->thread != NULL;
+    if (!running && cache->size > 0 && cache->refresh_ahead > 0) {
+        /* Lookups keep fetching inline if the thread cannot be started */
+        if (apr_thread_create(&cache->thread, NULL, ssl_ocsp_refresh_thread,
+                              cache, c->pool) != APR_SUCCESS)
+            cache->thread = NULL;
+    }
+    apr_thread_mutex_unlock(cache->mutex);
+    if (running && (cache->size == 0 || cache->refresh_ahead == 0))
+        ssl_ocsp_refresh_stop(cache);
+}
+
+/* Drops the answers, they are looked up again */
+void SSL_ocsp_cache_flush(tcn_ssl_ctxt_t *c)
+{
+    tcn_ocsp_cache_t *cache = c->ocsp_cache;
+
+    if (cache == NULL)
+        return;
+    apr_thread_mutex_lock(cache->mutex);
+    ssl_ocsp_evict(cache, 0);
+    apr_thread_mutex_unlock(cache->mutex);
+}
+
+void SSL_ocsp_cache_destroy(tcn_ssl_ctxt_t *c)
+{
+    tcn_ocsp_cache_t *cache = c->ocsp_cache;
+
+    if (cache == NULL)
+        return;
+    ssl_ocsp_refresh_stop(cache);
+    ssl_ocsp_store_sync(cache, 1);
+    apr_thread_mutex_lock(cache->mutex);
+    ssl_ocsp_evict(cache, 0);
+    apr_thread_mutex_unlock(cache->mutex);
+}
+apr_status_t SSL_ocsp_cache_store(tcn_ssl_ctxt_t *c, const char *file)
+{
+    tcn_ocsp_cache_t *cache = c->ocsp_cache;
+    apr_finfo_t finfo;
+    apr_mmap_t *mm;
+    apr_file_t *f;
+    apr_pool_t *p;
+    apr_status_t rv;
+
+    if (cache == NULL)
+        return APR_EINVAL;
+    if ((rv = apr_pool_create(&p, c->pool)) != APR_SUCCESS)
+        return rv;
+    apr_thread_mutex_lock(cache->mutex);
+    if (cache->store_pool != NULL)
+        apr_pool_destroy(cache->store_pool);
+    cache->store_pool = p;
+    cache->store_file = apr_pstrdup(p, file);
+    cache->store      = NULL;
+    cache->store_size = 0;
+    /* A missing or broken file is replaced by the first write */
+    if (apr_file_open(&f, file, APR_FOPEN_READ | APR_FOPEN_BINARY, APR_OS_DEFAULT,
+                      p) == APR_SUCCESS) {
+        if (apr_file_info_get(&finfo, APR_FINFO_SIZE, f) == APR_SUCCESS &&
+            finfo.size > 0 &&
+            apr_mmap_create(&mm, f, 0, (apr_size_t)finfo.size, APR_MMAP_READ, p) == APR_SUCCESS) {
+            if (ssl_ocsp_store_valid(mm->mm, mm->size)) {
+                cache->store      = mm->mm;
+                cache->store_size = mm->size;
+            }
+        }
+        apr_file_close(f);
+    }
+    apr_thread_mutex_unlock(cache->mutex);
+    return APR_SUCCESS;
+}
+
+
+/* hits, misses, coalesced, evictions, cached, refreshes, deferred, restored */
+void SSL_ocsp_cache_stats(tcn_ssl_ctxt_t *c, apr_uint64_t *stats)
+{
+    tcn_ocsp_cache_t *cache = c->ocsp_cache;
+
+    memset(stats, 0, OCSP_CACHE_STATS * sizeof(apr_uint64_t));
+    if (cache == NULL)
+        return;
+    apr_thread_mutex_lock(cache->mutex);
+    stats[0] = cache->hits;
+    stats[1] = cache->misses;
+    stats[2] = cache->coalesced;
+    stats[3] = cache->evictions;
+    stats[4] = cache->count;
+    stats[5] = cache->refreshes;
+    stats[6] = cache->deferred;
+    stats[7] = cache->restored;
+    apr_thread_mutex_unlock(cache->mutex);
+}
+
+/* Finds or creates the entry for cert.  Must be called with the mutex
+ * held, the caller evicts.
+ */
+static tcn_ocsp_entry_t *ssl_ocsp_entry_get(tcn_ocsp_cache_t *cache, X509 *cert, X509 *issuer)
+{
+    OCSP_CERTID *certid;
+    tcn_ocsp_entry_t *ent;
+    unsigned char *id = NULL;
+    int idlen;
+
+    if ((certid = OCSP_cert_to_id(NULL, cert, issuer)) == NULL)
+        return NULL;
+    idlen = i2d_OCSP_CERTID(certid, &id);
+    OCSP_CERTID_free(certid);
+    if (idlen <= 0)
+        return NULL;
+
+    ent = apr_hash_get(cache->entries, id, idlen);
+    if (ent == NULL) {
+        if ((ent = malloc(sizeof(tcn_ocsp_entry_t) + idlen)) == NULL) {
+            OPENSSL_free(id);
+            return NULL;
+        }
+        memset(ent, 0, sizeof(tcn_ocsp_entry_t));
+        ent->id     = (unsigned char *)(ent + 1);
+        ent->idlen  = idlen;
+        memcpy(ent->id, id, idlen);
+        ent->cert   = cert;
+        ent->issuer = issuer;
+        X509_up_ref(cert);
+        X509_up_ref(issuer);
+        ent->status = OCSP_STATUS_UNKNOWN;
+        ent->error  = X509_V_ERR_UNABLE_TO_GET_CRL;
+        apr_hash_set(cache->entries, ent->id, ent->idlen, ent);
+        ssl_ocsp_link(cache, ent);
+        cache->count++;
+    }
+    else {
+        ssl_ocsp_touch(cache, ent);
+    }
+    OPENSSL_free(id);
+    return ent;
+}
+
+/* Adds the entries of the rest of the chain that have no answer to ents
+ * and marks them pending, so that a single round trip covers the chain.
+ * Must be called with the mutex held.
+ */
+static int ssl_ocsp_prefetch(tcn_ocsp_cache_t *cache, X509_STORE_CTX *ctx, X509 *cert,
+                             tcn_ocsp_entry_t **ents, int max)
+{
+    STACK_OF(X509) *chain = X509_STORE_CTX_get0_chain(ctx);
+    apr_time_t now = apr_time_now();
+    int i, n = 0;
+
+    for (i = 0; chain != NULL && i + 1 < sk_X509_num(chain) && n < max; i++) {
+        X509 *x = sk_X509_value(chain, i);
+        X509 *issuer = sk_X509_value(chain, i + 1);
+        tcn_ocsp_entry_t *ent;
+
+        if (x == cert || X509_check_issued(x, x) == X509_V_OK ||
+            X509_check_issued(issuer, x) != X509_V_OK)
+            continue;
+        if ((ent = ssl_ocsp_entry_get(cache, x, issuer)) == NULL || ent->pending)
+            continue;
+        if (!ent->stored && ent->expires <= now)
+            ssl_ocsp_store_load(cache, ent, X509_STORE_CTX_get0_store(ctx));
+        if (ent->expires > now)
+            continue;
+        ent->pending = 1;
+        ents[n++] = ent;
+    }
+    return n;
+}
+
+static int ssl_ocsp_cached_request(X509 *cert, X509 *issuer, X509_STORE_CTX *ctx, tcn_ssl_ctxt_t *c)
+{
+    tcn_ocsp_cache_t *cache = c->ocsp_cache;
+    tcn_ocsp_entry_t *ent;
+    apr_time_t now;
+    int r, error, fetched = 0;
+
+    if (cache == NULL)
+        return ssl_ocsp_request(cert, issuer, ctx, c);
+
+    apr_thread_mutex_lock(cache->mutex);
+    if (cache->size == 0 || (ent = ssl_ocsp_entry_get(cache, cert, issuer)) == NULL) {
+        apr_thread_mutex_unlock(cache->mutex);
+        return ssl_ocsp_request(cert, issuer, ctx, c);
+    }
+    now = apr_time_now();
+    if (!ent->stored && !ent->pending && ent->expires <= now)
+        ssl_ocsp_store_load(cache, ent, X509_STORE_CTX_get0_store(ctx));
+    if (!ent->used) {
+        ent->used = 1;
+        /* Overdue while unused, the refresh thread did not wait for it */
+        if (cache->thread != NULL && ent->expires > now && ent->refresh <= now)
+            apr_thread_cond_broadcast(cache->cond);
+    }
+
+    if (ent->expires > now) {
+        cache->hits++;
+    }
+    else if (cache->thread != NULL && c->ocsp_soft_fail) {
+        /* Leave it to the refresh thread, new entries are due at once */
+        cache->deferred++;
+        if (!ent->pending)
+            apr_thread_cond_broadcast(cache->cond);
+        ssl_ocsp_evict(cache, cache->size);
+        apr_thread_mutex_unlock(cache->mutex);
+        X509_STORE_CTX_set_error(ctx, X509_V_ERR_UNABLE_TO_GET_CRL);
+        return OCSP_STATUS_UNKNOWN;
+    }
+    else if (ent->pending) {
+        cache->coalesced++;
+        ent->waiters++;
+        while (ent->pending)
+            apr_thread_cond_wait(cache->cond, cache->mutex);
+        ent->waiters--;
+    }
+    else {
+        tcn_ocsp_entry_t *ents[OCSP_FETCH_MAX];
+        int n;
+
+        cache->misses++;
+        ent->pending = 1;
+        ents[0] = ent;
+        n = 1 + ssl_ocsp_prefetch(cache, ctx, cert, ents + 1, OCSP_FETCH_MAX - 1);
+        ssl_ocsp_fetch(cache, ents, n, X509_STORE_CTX_get0_store(ctx));
+        fetched = 1;
+    }
+    r     = ent->status;
+    error = ent->error;
+    ssl_ocsp_evict(cache, cache->size);
+    apr_thread_mutex_unlock(cache->mutex);
+    if (fetched)
+        ssl_ocsp_store_sync(cache, 0);
+    X509_STORE_CTX_set_error(ctx, error);
+    return r;
+}
+
 /* Function that is used to do the OCSP verification */
-static int ssl_verify_OCSP(X509_STORE_CTX *ctx, int timeout, int verifyFlags)
+static int ssl_verify_OCSP(X509_STORE_CTX *ctx, tcn_ssl_ctxt_t *c)
 {
     X509 *cert, *issuer;
     int r = OCSP_STATUS_UNKNOWN;
@@ -523,7 +1306,7 @@ static int ssl_verify_OCSP(X509_STORE_CTX *ctx, int timeout, int verifyFlags)
     /* if we can't get the issuer, we cannot perform OCSP verification */
     issuer = X509_STORE_CTX_get0_current_issuer(ctx);
     if (issuer != NULL) {
-        r = ssl_ocsp_request(cert, issuer, ctx, timeout, verifyFlags);
+        r = ssl_ocsp_cached_request(cert, issuer, ctx, c);
         switch (r) {
         case OCSP_STATUS_OK:
             X509_STORE_CTX_set_error(ctx, X509_V_OK);
@@ -733,228 +1516,19 @@ static int add_ocsp_cert(OCSP_REQUEST *req, X509 *cert, X509 *issuer)
 }
 
 
-/* Creates the APR socket and connect to the hostname. Returns the
-   socket or NULL if there is an error.
-*/
-static apr_socket_t *make_socket(char *hostname, int port, apr_pool_t *mp)
-{
-    apr_sockaddr_t *sa_in;
-    apr_status_t status;
-    apr_socket_t *sock = NULL;
-
+#define BUFFER_SIZE 512
+#define OCSP_MAX_RESPONSE_SIZE 65536
+#define CRL_MAX_SIZE           (16 * 1024 * 1024)
+#define OCSP_MAX_BODY_SIZE(l)  ((l)->dp ? CRL_MAX_SIZE : OCSP_MAX_RESPONSE_SIZE)
 
-    status = apr_sockaddr_info_get(&sa_in, hostname, APR_INET, port, 0, mp);
+/* Creates an OCSP request */
+static OCSP_REQUEST *get_ocsp_request(X509 *cert, X509 *issuer, int nonce)
+{
+    OCSP_REQUEST *ocsp_req = NULL;
 
-    if (status == APR_SUCCESS)
-        status = apr_socket_create(&sock, sa_in->family, SOCK_STREAM, APR_PROTO_TCP, mp);
-    if (status == APR_SUCCESS)
-        status = apr_socket_connect(sock, sa_in);
-
-    if (status == APR_SUCCESS)
-        return sock;
-    return NULL;
-}
-
-
-/* Creates the request in a memory BIO in order to send it to the OCSP server.
-   Most parts of this function are taken from mod_ssl support for OCSP (with some
-   minor modifications
-*/
-static BIO *serialize_request(OCSP_REQUEST *req, char *host, int port, char *path)
-{
-    BIO *bio;
-    int len;
-
-    len = i2d_OCSP_REQUEST(req, NULL);
-
-    bio = BIO_new(BIO_s_mem());
-
-    BIO_printf(bio, "POST %s HTTP/1.0\r\n"
-      "Host: %s:%d\r\n"
-      "Content-Type: application/ocsp-request\r\n"
-      "Content-Length: %d\r\n"
-      "\r\n",
-      path, host, port, len);
-
-    if (i2d_OCSP_REQUEST_bio(bio, req) != 1) {
-        BIO_free(bio);
-        return NULL;
-    }
-
-    return bio;
-}
-
-
-/* Send the OCSP request to the OCSP server. Taken from mod_ssl OCSP support */
-static int ocsp_send_req(apr_socket_t *sock, BIO *req)
-{
-    int len;
-    char buf[TCN_BUFFER_SZ];
-    apr_status_t rv;
-
-    while ((len = BIO_read(req, buf, sizeof buf)) > 0) {
-        char *wbuf = buf;
-        apr_size_t remain = len;
-
-        do {
-            apr_size_t wlen = remain;
-            rv = apr_socket_send(sock, wbuf, &wlen);
-            wbuf += wlen;
-            remain -= wlen;
-        } while (rv == APR_SUCCESS && remain > 0);
-
-        if (rv != APR_SUCCESS) {
-            return 0;
-        }
-    }
-
-    return 1;
-}
-
-
-
-/* Parses the buffer from the response and extracts the OCSP response.
-   Taken from openssl library */
-static OCSP_RESPONSE *parse_ocsp_resp(char *buf, int len)
-{
-    BIO *mem = NULL;
-    char tmpbuf[1024];
-    OCSP_RESPONSE *resp = NULL;
-    char *p, *q, *r;
-    int retcode;
-
-    mem = BIO_new(BIO_s_mem());
-    if(mem == NULL)
-        return NULL;
-
-    BIO_write(mem, buf, len);  /* write the buffer to the bio */
-    if (BIO_gets(mem, tmpbuf, 512) <= 0) {
-        goto err;
-    }
-    /* Parse the HTTP response. This will look like this:
-     * "HTTP/1.0 200 OK". We need to obtain the numeric code and
-     * (optional) informational message.
-     */
-
-    /* Skip to first white space (passed protocol info) */
-    for (p = tmpbuf; *p && !apr_isspace(*p); p++)
-        continue;
-    if (!*p) {
-        goto err;
-    }
-    /* Skip past white space to start of response code */
-    while (apr_isspace(*p))
-        p++;
-    if (!*p) {
-        goto err;
-    }
-    /* Find end of response code: first whitespace after start of code */
-    for (q = p; *q && !apr_isspace(*q); q++)
-        continue;
-    if (!*q) {
-        goto err;
-    }
-    /* Set end of response code and start of message */
-    *q++ = 0;
-    /* Attempt to parse numeric code */
-    retcode = strtoul(p, &r, 10);
-    if (*r)
-        goto err;
-    /* Skip over any leading white space in message */
-    while (apr_isspace(*q))
-        q++;
-    if (*q) {
-        /* Finally zap any trailing white space in message (include CRLF) */
-        /* We know q has a non white space character so this is OK */
-        for(r = q + strlen(q) - 1; apr_isspace(*r); r--) *r = 0;
-    }
-    if (retcode != 200) {
-        goto err;
-    }
-    /* Find blank line marking beginning of content */
-    while (BIO_gets(mem, tmpbuf, 512) > 0) {
-        for (p = tmpbuf; apr_isspace(*p); p++)
-            continue;
-        if (!*p)
-            break;
-    }
-    if (*p) {
-        goto err;
-    }
-    if (!(resp = d2i_OCSP_RESPONSE_bio(mem, NULL))) {
-        goto err;
-    }
-err:
-    /* XXX No error logging? */
-    BIO_free(mem);
-    return resp;
-}
-
-
-/* Reads the response from the APR socket to a buffer, and parses the buffer to
-   return the OCSP response  */
-#define BUFFER_SIZE 512
-#define OCSP_MAX_RESPONSE_SIZE 65536
-static OCSP_RESPONSE *ocsp_get_resp(apr_pool_t *mp, apr_socket_t *sock)
-{
-    int buflen;
-    apr_size_t totalread = 0;
-    apr_size_t readlen;
-    char *buf, tmpbuf[BUFFER_SIZE];
-    apr_status_t rv = APR_SUCCESS;
-    apr_pool_t *p;
-    OCSP_RESPONSE *resp;
-
-    apr_pool_create(&p, mp);
-    buflen = BUFFER_SIZE;
-    buf = apr_palloc(p, buflen);
-    if (buf == NULL) {
-        apr_pool_destroy(p);
-        return NULL;
-    }
-
-    while (rv == APR_SUCCESS ) {
-        readlen = sizeof(tmpbuf);
-        rv = apr_socket_recv(sock, tmpbuf, &readlen);
-        if (rv == APR_SUCCESS) { /* if we have read something .. we can put it in the buffer*/
-            if ((totalread + readlen) > OCSP_MAX_RESPONSE_SIZE) {
-                apr_pool_destroy(p);
-                return NULL;
-            } else if ((totalread + readlen) >= buflen) {
-                buf = apr_xrealloc(buf, buflen, buflen * 2, p);
-                if (buf == NULL) {
-                    apr_pool_destroy(p);
-                    return NULL;
-                }
-                buflen *= 2; /* if needed we enlarge the buffer */
-            }
-            memcpy(buf + totalread, tmpbuf, readlen); /* the copy to the buffer */
-            totalread += readlen; /* update the total bytes read */
-        }
-        else {
-            if (rv == APR_EOF && readlen == 0)
-                ; /* EOF, normal situation */
-            else if (readlen == 0) {
-                /* Not success, and readlen == 0 .. some error */
-                apr_pool_destroy(p);
-                return NULL;
-            }
-        }
-    }
-
-    resp = parse_ocsp_resp(buf, totalread);
-    apr_pool_destroy(p);
-    return resp;
-}
-
-/* Creates an OCSP request */
-static OCSP_REQUEST *get_ocsp_request(X509 *cert, X509 *issuer)
-{
-    OCSP_REQUEST *ocsp_req = NULL;
-
-    ocsp_req = OCSP_REQUEST_new();
-    if (ocsp_req == NULL)
-        return NULL;
+    ocsp_req = OCSP_REQUEST_new();
+    if (ocsp_req == NULL)
+        return NULL;
 
     // Populate the request
     if (add_ocsp_cert(ocsp_req, cert, issuer) == 0) {
@@ -963,68 +1537,17 @@ static OCSP_REQUEST *get_ocsp_request(X509 *cert, X509 *issuer)
     }
 
     // Add a nonce to protect against replay attacks
-    OCSP_request_add1_nonce(ocsp_req, NULL, -1);
+    if (nonce)
+        OCSP_request_add1_nonce(ocsp_req, NULL, -1);
 
     return ocsp_req;
 }
 
-/* Submits an OCSP request and returns the OCSP_RESPONSE */
-static OCSP_RESPONSE *get_ocsp_response(apr_pool_t *p, char *url, OCSP_REQUEST *ocsp_req, int timeout)
-{
-    OCSP_RESPONSE *ocsp_resp = NULL;
-    BIO *bio_req;
-    char *hostname, *path, *c_port;
-    int port, use_ssl;
-    int ok = 0;
-    apr_socket_t *apr_sock = NULL;
-    apr_pool_t *mp;
-#ifdef LIBRESSL_VERSION_NUMBER
-    if (OCSP_parse_url(url, &hostname, &c_port, &path, &use_ssl) == 0)
-#else
-    if (OSSL_HTTP_parse_url(url, &use_ssl, NULL, &hostname, &c_port, NULL, &path, NULL, NULL) == 0)
-#endif
-        goto end;
-
-    if (sscanf(c_port, "%d", &port) != 1)
-        goto end;
-
-    /* create the BIO with the request to send */
-    bio_req = serialize_request(ocsp_req, hostname, port, path);
-    if (bio_req == NULL) {
-        goto end;
-    }
-
-    apr_pool_create(&mp, p);
-    apr_sock = make_socket(hostname, port, mp);
-    if (apr_sock == NULL) {
-        goto free_bio;
-    }
-
-    apr_socket_timeout_set(apr_sock, timeout);
-
-    ok = ocsp_send_req(apr_sock, bio_req);
-    if (ok) {
-        ocsp_resp = ocsp_get_resp(mp, apr_sock);
-    }
-    apr_socket_close(apr_sock);
-
-free_bio:
-    BIO_free(bio_req);
-    apr_pool_destroy(mp);
-
-end:
-    OPENSSL_free(hostname);
-    OPENSSL_free(c_port);
-    OPENSSL_free(path);
-
-    return ocsp_resp;
-}
-
 /* Process the OCSP_RESPONSE and returns the corresponding
    answer according to the status.
 */
 static int process_ocsp_response(OCSP_REQUEST *ocsp_req, OCSP_RESPONSE *ocsp_resp, X509 *cert, X509 *issuer,
-        X509_STORE_CTX *ctx, int verifyFlags)
+        X509_STORE *store, int verifyFlags, int *error, apr_time_t *expires)
 {
     int r, o = V_OCSP_CERTSTATUS_UNKNOWN, i;
     OCSP_BASICRESP *bs;
@@ -1041,23 +1564,23 @@ static int process_ocsp_response(OCSP_REQUEST *ocsp_req, OCSP_RESPONSE *ocsp_res
     }
 
     bs = OCSP_response_get1_basic(ocsp_resp);
-    if (OCSP_check_nonce(ocsp_req, bs) == 0) {
-        X509_STORE_CTX_set_error(ctx, X509_V_ERR_OCSP_RESP_INVALID);
+    if (ocsp_req != NULL && OCSP_check_nonce(ocsp_req, bs) == 0) {
+        *error = X509_V_ERR_OCSP_RESP_INVALID;
         o = OCSP_STATUS_UNKNOWN;
         goto clean_bs;
     }
 
     certStack = OCSP_resp_get0_certs(bs);
     // Cast to non-const pointer is OK here since OCSP_basic_verify does not modify the provided certs
-    if (OCSP_basic_verify(bs, (STACK_OF(X509) *)certStack, X509_STORE_CTX_get0_store(ctx), verifyFlags) <= 0) {
-        X509_STORE_CTX_set_error(ctx, X509_V_ERR_OCSP_SIGNATURE_FAILURE);
+    if (OCSP_basic_verify(bs, (STACK_OF(X509) *)certStack, store, verifyFlags) <= 0) {
+        *error = X509_V_ERR_OCSP_SIGNATURE_FAILURE;
         o = OCSP_STATUS_UNKNOWN;
         goto clean_bs;
     }
 
     certid = OCSP_cert_to_id(NULL, cert, issuer);
     if (certid == NULL) {
-        X509_STORE_CTX_set_error(ctx, X509_V_ERR_OCSP_RESP_INVALID);
+        *error = X509_V_ERR_OCSP_RESP_INVALID;
         o = OCSP_STATUS_UNKNOWN;
         goto clean_bs;
     }
@@ -1065,16 +1588,26 @@ static int process_ocsp_response(OCSP_REQUEST *ocsp_req, OCSP_RESPONSE *ocsp_res
     ss = OCSP_resp_get0(bs, OCSP_resp_find(bs, certid, -1)); /* find by serial number and get the matching response */
     i = OCSP_single_get0_status(ss, NULL, NULL, &thisupd, &nextupd);
     if (OCSP_check_validity(thisupd, nextupd, OCSP_MAX_SKEW, -1) <= 0) {
-        X509_STORE_CTX_set_error(ctx, X509_V_ERR_OCSP_NOT_YET_VALID);
+        *error = X509_V_ERR_OCSP_NOT_YET_VALID;
         o = OCSP_STATUS_UNKNOWN;
         goto clean_certid;
     }
     if (OCSP_check_validity(thisupd, nextupd, OCSP_MAX_SKEW, OCSP_MAX_SKEW) <= 0) {
-        X509_STORE_CTX_set_error(ctx, X509_V_ERR_OCSP_HAS_EXPIRED);
+        *error = X509_V_ERR_OCSP_HAS_EXPIRED;
         o = OCSP_STATUS_UNKNOWN;
         goto clean_certid;
     }
 
+    if (expires != NULL) {
+        /* The response is accepted up to OCSP_MAX_SKEW past nextUpdate,
+         * or past thisUpdate if the responder gave no nextUpdate.
+         */
+        int days, secs;
+        if (ASN1_TIME_diff(&days, &secs, NULL, nextupd != NULL ? nextupd : thisupd))
+            *expires = apr_time_now() +
+                       apr_time_from_sec((apr_time_t)days * 86400 + secs + OCSP_MAX_SKEW);
+    }
+
     if (i == V_OCSP_CERTSTATUS_GOOD)
         o =  OCSP_STATUS_OK;
     else if (i == V_OCSP_CERTSTATUS_REVOKED)
@@ -1089,68 +1622,2111 @@ clean_bs:
     return o;
 }
 
-static int ssl_ocsp_request(X509 *cert, X509 *issuer, X509_STORE_CTX *ctx, int timeout, int verifyFlags)
+/* Takes the CRL downloaded for l if its issuer signed it and it has not
+   expired.  Returns 0 otherwise.
+*/
+static int process_crl(tcn_ocsp_lookup_t *l, const unsigned char *der, long len)
 {
-    char **ocsp_urls = NULL;
-    int nid, numofresponses;
-    int rv = OCSP_STATUS_UNKNOWN;
-    X509_EXTENSION *ext;
-    ASN1_OCTET_STRING *os;
-    apr_pool_t *p;
+    X509_CRL *crl;
+    EVP_PKEY *pkey = X509_get0_pubkey(l->issuer);
+    const ASN1_TIME *nextupd;
+    int days, secs;
 
-    apr_pool_create(&p, NULL);
+    if (pkey == NULL || (crl = d2i_X509_CRL(NULL, &der, len)) == NULL)
+        return 0;
+    if (X509_NAME_cmp(X509_CRL_get_issuer(crl), X509_get_subject_name(l->issuer)) != 0 ||
+        X509_CRL_verify(crl, pkey) <= 0) {
+        X509_CRL_free(crl);
+        return 0;
+    }
+    /* Without a nextUpdate it is good until the next one is fetched */
+    l->expires = 0;
+    if ((nextupd = X509_CRL_get0_nextUpdate(crl)) != NULL) {
+        if (!ASN1_TIME_diff(&days, &secs, NULL, nextupd) || days < 0 || secs < 0 ||
+            (days == 0 && secs == 0)) {
+            X509_CRL_free(crl);
+            return 0;
+        }
+        l->expires = apr_time_now() + apr_time_from_sec((apr_time_t)days * 86400 + secs);
+    }
+    l->done   = 1;
+    l->status = OCSP_STATUS_OK;
+    l->error  = X509_V_OK;
+    l->crl    = crl;
+    return 1;
+}
 
-    /* Get the proper extension */
-    nid = X509_get_ext_by_NID(cert,NID_info_access,-1);
-    if (nid >= 0 ) {
-        ext = X509_get_ext(cert,nid);
-        os = X509_EXTENSION_get_data(ext);
-
-        ocsp_urls = decode_OCSP_url(os, &numofresponses, p);
-    }
-    /* if we find the extensions and we can parse it check
-       the ocsp status. Otherwise, return OCSP_STATUS_UNKNOWN */
-    if (ocsp_urls != NULL && numofresponses > 0) {
-        OCSP_REQUEST *req;
-        OCSP_RESPONSE *resp = NULL;
-        int i;
-
-        req = get_ocsp_request(cert, issuer);
-        if (req == NULL) {
-            /* correct error code for application errors? */
-            X509_STORE_CTX_set_error(ctx, X509_V_ERR_APPLICATION_VERIFICATION);
-        } else {
-            /* Iterate through all the possible OCSP URLs until we get a definitive response */
-            for (i = 0; i < numofresponses; i++) {
-                if (ocsp_urls[i] == NULL) {
-                    continue;
-                }
+/*
+ * OCSP HTTP client
+ *
+ * Connections to a responder are kept alive between lookups, next to its
+ * resolved address.  This state is shared by all the contexts and set up
+ * by SSL.initialize; without it every request opens a connection of its
+ * own and asks the responder to close it.
+ */
+typedef struct tcn_ocsp_conn_t tcn_ocsp_conn_t;
+
+struct tcn_ocsp_conn_t {
+    tcn_ocsp_conn_t *next;
+    /* the connection lives in a pool of its own */
+    apr_pool_t     *pool;
+    apr_socket_t   *sock;
+    /* when it was returned to the responder */
+    apr_time_t      idle;
+};
+
+typedef struct {
+    apr_pool_t     *sa_pool;
+    apr_sockaddr_t *sa;
+    apr_time_t      resolved;
+    /* most recently used first */
+    tcn_ocsp_conn_t *idle;
+} tcn_ocsp_responder_t;
+
+/* One request of a lookup, sent to one of its URLs */
+typedef struct {
+    tcn_ocsp_lookup_t *lookup;
+    tcn_ocsp_responder_t *responder;
+    tcn_ocsp_conn_t *conn;
+    /* the connection was kept alive by an earlier request */
+    int             reused;
+    char           *host;
+    int             port;
+    apr_sockaddr_t *sa;
+    BIO            *req;
+    apr_size_t      sent;
+    int             state;
+    /* response parser */
+    int             http;
+    int             keepalive;
+    int             chunked;
+    /* left of the body or chunk, -1 for a body ending with the connection */
+    apr_off_t       remaining;
+    char           *buf;
+    apr_size_t      len;
+    apr_size_t      size;
+    apr_size_t      pos;
+    /* the body, gathered in place */
+    apr_size_t      body;
+    apr_size_t      blen;
+} tcn_ocsp_fetch_t;
+
+#define OCSP_HTTP_STATUS      0
+#define OCSP_HTTP_HEADERS     1
+#define OCSP_HTTP_BODY        2
+#define OCSP_HTTP_CHUNK_SIZE  3
+#define OCSP_HTTP_CHUNK_DATA  4
+#define OCSP_HTTP_CHUNK_END   5
+#define OCSP_HTTP_TRAILERS    6
+
+/* Idle connections kept per responder, and for how long */
+#define OCSP_CONN_IDLE_MAX      4
+#define OCSP_CONN_IDLE_TIMEOUT  apr_time_from_sec(30)
+/* How long the address of a responder is used before resolving it again */
+#define OCSP_DNS_TTL            apr_time_from_sec(60)
+#define OCSP_RESPONDERS_MAX     64
+/* RFC 5019: longer requests are POSTed */
+#define OCSP_GET_MAX            255
+
+static apr_pool_t         *ocsp_client_pool = NULL;
+static apr_thread_mutex_t *ocsp_client_mutex = NULL;
+static apr_hash_t         *ocsp_responders = NULL;
+
+static void ssl_ocsp_conn_close(tcn_ocsp_conn_t *conn)
+{
+    apr_socket_close(conn->sock);
+    apr_pool_destroy(conn->pool);
+}
 
-                resp = get_ocsp_response(p, ocsp_urls[i], req, timeout);
-                if (resp != NULL) {
-                    rv = process_ocsp_response(req, resp, cert, issuer, ctx, verifyFlags);
-                    OCSP_RESPONSE_free(resp);
-                    resp = NULL;
+apr_status_t SSL_ocsp_client_init(apr_pool_t *p)
+{
+    apr_status_t rv;
 
-                    /* If we got a definitive answer (OK or REVOKED), stop trying */
-                    if (rv == OCSP_STATUS_OK || rv == OCSP_STATUS_REVOKED) {
-                        break;
-                    }
-                    /* Otherwise (UNKNOWN), try the next URL */
-                }
-            }
+    if ((rv = apr_thread_mutex_create(&ocsp_client_mutex, APR_THREAD_MUTEX_DEFAULT,
+                                      p)) != APR_SUCCESS) {
+        ocsp_client_mutex = NULL;
+        return rv;
+    }
+    ocsp_client_pool = p;
+    ocsp_responders  = apr_hash_make(p);
+    return APR_SUCCESS;
+}
 
-            /* If all URLs failed to respond or returned UNKNOWN */
-            if (rv == OCSP_STATUS_UNKNOWN) {
-                /* Unable to send request / receive response from any URL. */
-                X509_STORE_CTX_set_error(ctx, X509_V_ERR_UNABLE_TO_GET_CRL);
-            }
+void SSL_ocsp_client_terminate(void)
+{
+    apr_hash_index_t *hi;
 
-            OCSP_REQUEST_free(req);
+    if (ocsp_client_mutex == NULL)
+        return;
+    apr_thread_mutex_lock(ocsp_client_mutex);
+    for (hi = apr_hash_first(NULL, ocsp_responders); hi; hi = apr_hash_next(hi)) {
+        tcn_ocsp_responder_t *r;
+
+        apr_hash_this(hi, NULL, NULL, (void **)&r);
+        while (r->idle != NULL) {
+            tcn_ocsp_conn_t *conn = r->idle;
+            r->idle = conn->next;
+            ssl_ocsp_conn_close(conn);
         }
+        if (r->sa_pool != NULL)
+            apr_pool_destroy(r->sa_pool);
     }
-    apr_pool_destroy(p);
+    apr_thread_mutex_unlock(ocsp_client_mutex);
+    ocsp_client_mutex = NULL;
+    ocsp_responders   = NULL;
+    ocsp_client_pool  = NULL;
+}
+
+/* Returns the state kept for host:port, NULL if the client is not set up
+ * or keeps too many responders already.
+ */
+static tcn_ocsp_responder_t *ssl_ocsp_responder_get(const char *host, int port)
+{
+    tcn_ocsp_responder_t *r;
+    char key[256];
+
+    if (ocsp_client_mutex == NULL)
+        return NULL;
+    apr_snprintf(key, sizeof(key), "%s:%d", host, port);
+    apr_thread_mutex_lock(ocsp_client_mutex);
+    r = apr_hash_get(ocsp_responders, key, APR_HASH_KEY_STRING);
+    if (r == NULL && apr_hash_count(ocsp_responders) < OCSP_RESPONDERS_MAX) {
+        r = apr_pcalloc(ocsp_client_pool, sizeof(tcn_ocsp_responder_t));
+        apr_hash_set(ocsp_responders, apr_pstrdup(ocsp_client_pool, key),
+                     APR_HASH_KEY_STRING, r);
+    }
+    apr_thread_mutex_unlock(ocsp_client_mutex);
+    return r;
+}
+
+/* Resolves the responder into p, reusing its cached address until
+ * OCSP_DNS_TTL has passed.
+ */
+static apr_status_t ssl_ocsp_resolve(apr_sockaddr_t **sa, tcn_ocsp_responder_t *r,
+                                     const char *host, int port, apr_pool_t *p)
+{
+    apr_sockaddr_t *nsa;
+    apr_pool_t *np;
+    apr_status_t rv;
+
+    if (r == NULL)
+        return apr_sockaddr_info_get(sa, host, APR_INET, port, 0, p);
+    apr_thread_mutex_lock(ocsp_client_mutex);
+    if (r->sa != NULL && r->resolved + OCSP_DNS_TTL > apr_time_now()) {
+        rv = apr_sockaddr_info_copy(sa, r->sa, p);
+        apr_thread_mutex_unlock(ocsp_client_mutex);
+        return rv;
+    }
+    apr_thread_mutex_unlock(ocsp_client_mutex);
+
+    /* Resolved without the mutex, the last one to finish wins */
+    if ((rv = apr_pool_create(&np, NULL)) != APR_SUCCESS)
+        return rv;
+    if ((rv = apr_sockaddr_info_get(&nsa, host, APR_INET, port, 0, np)) != APR_SUCCESS) {
+        apr_pool_destroy(np);
+        return rv;
+    }
+    apr_thread_mutex_lock(ocsp_client_mutex);
+    if (r->sa_pool != NULL)
+        apr_pool_destroy(r->sa_pool);
+    r->sa_pool  = np;
+    r->sa       = nsa;
+    r->resolved = apr_time_now();
+    rv = apr_sockaddr_info_copy(sa, nsa, p);
+    apr_thread_mutex_unlock(ocsp_client_mutex);
     return rv;
 }
 
-#endif /* HAVE_OCSP */
+/* Takes the most recently used idle connection to the responder that the
+ * responder did not close.
+ */
+static tcn_ocsp_conn_t *ssl_ocsp_conn_reuse(tcn_ocsp_responder_t *r)
+{
+    tcn_ocsp_conn_t *conn;
+
+    for (;;) {
+        apr_pollfd_t pfd;
+        apr_int32_t nsds;
+
+        apr_thread_mutex_lock(ocsp_client_mutex);
+        if ((conn = r->idle) != NULL)
+            r->idle = conn->next;
+        apr_thread_mutex_unlock(ocsp_client_mutex);
+        if (conn == NULL)
+            return NULL;
+        /* Anything to read on an idle connection means it was closed */
+        memset(&pfd, 0, sizeof(apr_pollfd_t));
+        pfd.p         = conn->pool;
+        pfd.desc_type = APR_POLL_SOCKET;
+        pfd.reqevents = APR_POLLIN;
+        pfd.desc.s    = conn->sock;
+        if (conn->idle + OCSP_CONN_IDLE_TIMEOUT > apr_time_now() &&
+            APR_STATUS_IS_TIMEUP(apr_poll(&pfd, 1, &nsds, 0)))
+            return conn;
+        ssl_ocsp_conn_close(conn);
+    }
+}
+
+static void ssl_ocsp_conn_put(tcn_ocsp_responder_t *r, tcn_ocsp_conn_t *conn)
+{
+    tcn_ocsp_conn_t **pc, *drop = NULL;
+    apr_time_t now = apr_time_now();
+    int n = 0;
+
+    conn->idle = now;
+    apr_thread_mutex_lock(ocsp_client_mutex);
+    conn->next = r->idle;
+    r->idle = conn;
+    /* Drop the connections past the limit or idle for too long */
+    for (pc = &r->idle; *pc != NULL; ) {
+        tcn_ocsp_conn_t *c = *pc;
+        if (n >= OCSP_CONN_IDLE_MAX || c->idle + OCSP_CONN_IDLE_TIMEOUT <= now) {
+            *pc = c->next;
+            c->next = drop;
+            drop = c;
+        }
+        else {
+            pc = &c->next;
+            n++;
+        }
+    }
+    apr_thread_mutex_unlock(ocsp_client_mutex);
+    while (drop != NULL) {
+        conn = drop;
+        drop = conn->next;
+        ssl_ocsp_conn_close(conn);
+    }
+}
+
+/* Creates the request in a memory BIO in order to send it to the OCSP server.
+   Lookups with a short enough request are sent as RFC 5019 GET requests,
+   which caches between us and the responder can answer.  CRLs are simply
+   fetched from their URL.
+*/
+static BIO *serialize_request(tcn_ocsp_lookup_t *l, char *host, int port, char *path,
+                              int keepalive)
+{
+    const char *conn = keepalive ? "" : "Connection: close\r\n";
+    BIO *bio;
+    int len;
+
+    if ((bio = BIO_new(BIO_s_mem())) == NULL)
+        return NULL;
+
+    if (l->dp) {
+        BIO_printf(bio, "GET %s HTTP/1.1\r\n"
+          "Host: %s:%d\r\n"
+          "%s"
+          "\r\n",
+          path, host, port, conn);
+        return bio;
+    }
+    if (l->get != NULL) {
+        BIO_printf(bio, "GET %s%s%s HTTP/1.1\r\n"
+          "Host: %s:%d\r\n"
+          "%s"
+          "\r\n",
+          path, path[0] && path[strlen(path) - 1] == '/' ? "" : "/", l->get,
+          host, port, conn);
+        return bio;
+    }
+
+    len = i2d_OCSP_REQUEST(l->req, NULL);
+
+    BIO_printf(bio, "POST %s HTTP/1.1\r\n"
+      "Host: %s:%d\r\n"
+      "Content-Type: application/ocsp-request\r\n"
+      "Content-Length: %d\r\n"
+      "%s"
+      "\r\n",
+      path, host, port, len, conn);
+
+    if (i2d_OCSP_REQUEST_bio(bio, l->req) != 1) {
+        BIO_free(bio);
+        return NULL;
+    }
+
+    return bio;
+}
+
+/* The url-encoded base64 of the DER request, NULL if that is longer than
+ * RFC 5019 allows for a GET request.
+ */
+static char *ssl_ocsp_get_path(OCSP_REQUEST *req, apr_pool_t *p)
+{
+    unsigned char *der = NULL, *b64;
+    char *path, *s;
+    int len, i;
+
+    if ((len = i2d_OCSP_REQUEST(req, &der)) <= 0)
+        return NULL;
+    b64 = apr_palloc(p, 4 * ((len + 2) / 3) + 1);
+    len = EVP_EncodeBlock(b64, der, len);
+    OPENSSL_free(der);
+    /* '+', '/' and '=' are escaped */
+    path = s = apr_palloc(p, 3 * len + 1);
+    for (i = 0; i < len; i++) {
+        if (b64[i] == '+' || b64[i] == '/' || b64[i] == '=')
+            s += sprintf(s, "%%%02X", b64[i]);
+        else
+            *s++ = b64[i];
+    }
+    *s = '\0';
+    return s - path > OCSP_GET_MAX ? NULL : path;
+}
+
+/* Returns the next line read, NULL until it is complete */
+static char *ssl_ocsp_http_line(tcn_ocsp_fetch_t *f)
+{
+    char *line = f->buf + f->pos;
+    char *end = memchr(line, '\n', f->len - f->pos);
+
+    if (end == NULL)
+        return NULL;
+    f->pos = end + 1 - f->buf;
+    if (end > line && end[-1] == '\r')
+        end--;
+    *end = '\0';
+    return line;
+}
+
+static void ssl_ocsp_http_header(tcn_ocsp_fetch_t *f, char *line)
+{
+    char *value = strchr(line, ':');
+
+    if (value == NULL)
+        return;
+    *value++ = '\0';
+    while (apr_isspace(*value))
+        value++;
+    if (!strcasecmp(line, "Content-Length")) {
+        errno = 0;
+        f->remaining = strtol(value, NULL, 10);
+        if (errno || f->remaining < 0)
+            f->remaining = OCSP_MAX_RESPONSE_SIZE + 1;
+    }
+    else if (!strcasecmp(line, "Transfer-Encoding")) {
+        f->chunked = strcasecmp(value, "identity") != 0;
+    }
+    else if (!strcasecmp(line, "Connection")) {
+        if (!strcasecmp(value, "close"))
+            f->keepalive = 0;
+        else if (!strcasecmp(value, "keep-alive"))
+            f->keepalive = 1;
+    }
+}
+
+/* Parses the response as far as it was read.  Returns 1 while more is
+ * needed, 0 once the body is complete and -1 if the response cannot be
+ * used.
+ */
+static int ssl_ocsp_http_parse(tcn_ocsp_fetch_t *f, int eof)
+{
+    char *line, *end;
+    int minor, code;
+    apr_size_t n;
+
+    for (;;) {
+        switch (f->http) {
+        case OCSP_HTTP_STATUS:
+            if ((line = ssl_ocsp_http_line(f)) == NULL)
+                return eof ? -1 : 1;
+            /* "HTTP/1.1 200 OK" */
+            if (sscanf(line, "HTTP/1.%d %d", &minor, &code) != 2 || code != 200)
+                return -1;
+            f->keepalive = minor > 0;
+            f->remaining = -1;
+            f->http = OCSP_HTTP_HEADERS;
+            break;
+        case OCSP_HTTP_HEADERS:
+            if ((line = ssl_ocsp_http_line(f)) == NULL)
+                return eof ? -1 : 1;
+            if (*line != '\0') {
+                ssl_ocsp_http_header(f, line);
+                break;
+            }
+            /* Blank line marking beginning of content */
+            f->body = f->pos;
+            if (f->chunked) {
+                f->http = OCSP_HTTP_CHUNK_SIZE;
+                break;
+            }
+            if (f->remaining > OCSP_MAX_BODY_SIZE(f->lookup))
+                return -1;
+            if (f->remaining < 0)
+                f->keepalive = 0;
+            f->http = OCSP_HTTP_BODY;
+            break;
+        case OCSP_HTTP_BODY:
+            f->blen = f->len - f->body;
+            if (f->remaining < 0)
+                return eof ? 0 : 1;
+            if (f->blen < (apr_size_t)f->remaining)
+                return eof ? -1 : 1;
+            /* Whatever follows the body is not ours */
+            if (f->blen > (apr_size_t)f->remaining)
+                f->keepalive = 0;
+            f->blen = (apr_size_t)f->remaining;
+            return 0;
+        case OCSP_HTTP_CHUNK_SIZE:
+            if ((line = ssl_ocsp_http_line(f)) == NULL)
+                return eof ? -1 : 1;
+            errno = 0;
+            f->remaining = strtol(line, &end, 16);
+            if (errno || end == line || f->remaining < 0 ||
+                f->blen + f->remaining > OCSP_MAX_BODY_SIZE(f->lookup))
+                return -1;
+            f->http = f->remaining ? OCSP_HTTP_CHUNK_DATA : OCSP_HTTP_TRAILERS;
+            break;
+        case OCSP_HTTP_CHUNK_DATA:
+            n = TCN_MIN(f->len - f->pos, (apr_size_t)f->remaining);
+            memmove(f->buf + f->body + f->blen, f->buf + f->pos, n);
+            f->blen      += n;
+            f->pos       += n;
+            f->remaining -= n;
+            if (f->remaining > 0)
+                return eof ? -1 : 1;
+            f->http = OCSP_HTTP_CHUNK_END;
+            break;
+        case OCSP_HTTP_CHUNK_END:
+            if ((line = ssl_ocsp_http_line(f)) == NULL)
+                return eof ? -1 : 1;
+            if (*line != '\0')
+                return -1;
+            f->http = OCSP_HTTP_CHUNK_SIZE;
+            break;
+        case OCSP_HTTP_TRAILERS:
+            if ((line = ssl_ocsp_http_line(f)) == NULL)
+                return eof ? -1 : 1;
+            if (*line == '\0') {
+                if (f->pos < f->len)
+                    f->keepalive = 0;
+                return 0;
+            }
+            break;
+        }
+    }
+}
+
+/* Prepares the status lookup of cert.  Lookups without a responder to ask
+ * are done at once.
+ */
+static void ssl_ocsp_lookup_init(tcn_ocsp_lookup_t *l, X509 *cert, X509 *issuer, int get,
+                                 apr_pool_t *p)
+{
+    int nid;
+
+    memset(l, 0, sizeof(tcn_ocsp_lookup_t));
+    l->cert   = cert;
+    l->issuer = issuer;
+    l->status = OCSP_STATUS_UNKNOWN;
+    l->error  = X509_V_OK;
+
+    /* Get the proper extension */
+    nid = X509_get_ext_by_NID(cert, NID_info_access, -1);
+    if (nid >= 0) {
+        X509_EXTENSION *ext = X509_get_ext(cert, nid);
+        ASN1_OCTET_STRING *os = X509_EXTENSION_get_data(ext);
+
+        l->urls = decode_OCSP_url(os, &l->nurls, p);
+    }
+    if (l->urls == NULL || l->nurls <= 0) {
+        l->nurls = 0;
+        l->done  = 1;
+        return;
+    }
+    /* A nonce would make every GET request unique */
+    if ((l->req = get_ocsp_request(cert, issuer, !get)) == NULL) {
+        /* correct error code for application errors? */
+        l->nurls = 0;
+        l->done  = 1;
+        l->error = X509_V_ERR_APPLICATION_VERIFICATION;
+        return;
+    }
+    if (get)
+        l->get = ssl_ocsp_get_path(l->req, p);
+    /* Too long for GET, the POST keeps the nonce */
+    if (get && l->get == NULL) {
+        OCSP_REQUEST_free(l->req);
+        if ((l->req = get_ocsp_request(cert, issuer, 1)) == NULL) {
+            l->nurls = 0;
+            l->done  = 1;
+            l->error = X509_V_ERR_APPLICATION_VERIFICATION;
+        }
+    }
+}
+
+static void ssl_ocsp_fetch_close(tcn_ocsp_fetch_t *f, int keepalive)
+{
+    if (f->conn != NULL) {
+        if (keepalive && f->responder != NULL)
+            ssl_ocsp_conn_put(f->responder, f->conn);
+        else
+            ssl_ocsp_conn_close(f->conn);
+        f->conn = NULL;
+        f->lookup->active--;
+    }
+}
+
+/* Connects the request without waiting for the connection, over an idle
+ * one if reuse is set.  Returns 0 if that failed right away.
+ */
+static int ssl_ocsp_fetch_connect(tcn_ocsp_fetch_t *f, int reuse)
+{
+    tcn_ocsp_conn_t *conn;
+    apr_sockaddr_t *sa;
+    apr_pool_t *cp;
+    apr_status_t rv;
+
+    f->sent      = 0;
+    f->http      = OCSP_HTTP_STATUS;
+    f->keepalive = 0;
+    f->chunked   = 0;
+    f->len       = 0;
+    f->pos       = 0;
+    f->blen      = 0;
+    if (reuse && f->responder != NULL &&
+        (f->conn = ssl_ocsp_conn_reuse(f->responder)) != NULL) {
+        f->reused = 1;
+        f->state  = OCSP_FETCH_SENDING;
+        f->lookup->active++;
+        return 1;
+    }
+    f->reused = 0;
+
+    if (apr_pool_create(&cp, NULL) != APR_SUCCESS)
+        return 0;
+    conn = apr_pcalloc(cp, sizeof(tcn_ocsp_conn_t));
+    conn->pool = cp;
+    if (ssl_ocsp_resolve(&sa, f->responder, f->host, f->port, cp) != APR_SUCCESS ||
+        apr_socket_create(&conn->sock, sa->family, SOCK_STREAM, APR_PROTO_TCP, cp) != APR_SUCCESS) {
+        apr_pool_destroy(cp);
+        return 0;
+    }
+    f->conn = conn;
+    f->lookup->active++;
+    /* Non blocking, apr_poll() does the waiting */
+    apr_socket_timeout_set(conn->sock, 0);
+    rv = apr_socket_connect(conn->sock, sa);
+    if (rv == APR_SUCCESS) {
+        f->state = OCSP_FETCH_SENDING;
+    }
+    else if (APR_STATUS_IS_EINPROGRESS(rv)) {
+        /* Connected once writable, the address is kept for the check */
+        f->state = OCSP_FETCH_CONNECTING;
+        f->sa    = sa;
+    }
+    else {
+        ssl_ocsp_fetch_close(f, 0);
+        return 0;
+    }
+    return 1;
+}
+
+/* Starts sending the request of a lookup to url.  Returns 0 if that
+ * failed right away.
+ */
+static int ssl_ocsp_fetch_start(tcn_ocsp_fetch_t *f, tcn_ocsp_lookup_t *l, char *url, apr_pool_t *p)
+{
+    char *hostname = NULL, *c_port = NULL, *path = NULL;
+    int use_ssl, ok = 0;
+
+    memset(f, 0, sizeof(tcn_ocsp_fetch_t));
+    f->lookup = l;
+#ifdef LIBRESSL_VERSION_NUMBER
+    if (OCSP_parse_url(url, &hostname, &c_port, &path, &use_ssl) == 0)
+#else
+    if (OSSL_HTTP_parse_url(url, &use_ssl, NULL, &hostname, &c_port, NULL, &path, NULL, NULL) == 0)
+#endif
+        goto end;
+    if (sscanf(c_port, "%d", &f->port) != 1)
+        goto end;
+    f->host      = apr_pstrdup(p, hostname);
+    f->responder = ssl_ocsp_responder_get(hostname, f->port);
+
+    /* create the BIO with the request to send */
+    if ((f->req = serialize_request(l, hostname, f->port, path, f->responder != NULL)) == NULL)
+        goto end;
+    ok = ssl_ocsp_fetch_connect(f, 1);
+
+end:
+    if (!ok && f->req != NULL) {
+        BIO_free(f->req);
+        f->req = NULL;
+    }
+    OPENSSL_free(hostname);
+    OPENSSL_free(c_port);
+    OPENSSL_free(path);
+    return ok;
+}
+
+/* Moves a request along once its socket is ready.  Returns 1 while the
+ * request is in flight and 0 when it is over, with state
+ * OCSP_FETCH_DONE if a whole response was read.
+ */
+static int ssl_ocsp_fetch_step(tcn_ocsp_fetch_t *f, apr_pool_t *p)
+{
+    apr_status_t rv;
+    int r;
+
+    if (f->state == OCSP_FETCH_CONNECTING) {
+        /* Completes, or reports why the connection failed */
+        rv = apr_socket_connect(f->conn->sock, f->sa);
+        if (APR_STATUS_IS_EINPROGRESS(rv))
+            return 1;
+        if (rv != APR_SUCCESS) {
+            ssl_ocsp_fetch_close(f, 0);
+            return 0;
+        }
+        f->state = OCSP_FETCH_SENDING;
+    }
+    if (f->state == OCSP_FETCH_SENDING) {
+        char *data;
+        apr_size_t len = (apr_size_t)BIO_get_mem_data(f->req, &data);
+
+        while (f->sent < len) {
+            apr_size_t wlen = len - f->sent;
+            rv = apr_socket_send(f->conn->sock, data + f->sent, &wlen);
+            f->sent += wlen;
+            if (APR_STATUS_IS_EAGAIN(rv))
+                return 1;
+            if (rv != APR_SUCCESS)
+                goto failed;
+        }
+        f->state = OCSP_FETCH_RECEIVING;
+        return 1;
+    }
+    for (;;) {
+        apr_size_t rlen;
+
+        if (f->len == f->size) {
+            apr_size_t size = f->size ? f->size * 2 : BUFFER_SIZE;
+            if (f->size >= OCSP_MAX_BODY_SIZE(f->lookup))
+                goto failed;
+            /* if needed we enlarge the buffer */
+            if ((f->buf = apr_xrealloc(f->buf, f->len, size, p)) == NULL)
+                goto failed;
+            f->size = size;
+        }
+        rlen = f->size - f->len;
+        rv = apr_socket_recv(f->conn->sock, f->buf + f->len, &rlen);
+        f->len += rlen;
+        if (APR_STATUS_IS_EAGAIN(rv))
+            return 1;
+        if (rv != APR_SUCCESS && !APR_STATUS_IS_EOF(rv))
+            goto failed;
+        r = ssl_ocsp_http_parse(f, rv != APR_SUCCESS);
+        if (r == 0) {
+            f->state = OCSP_FETCH_DONE;
+            ssl_ocsp_fetch_close(f, f->keepalive);
+            return 0;
+        }
+        if (r < 0)
+            goto failed;
+        if (rv != APR_SUCCESS)
+            goto failed;
+    }
+
+failed:
+    if (f->reused && f->len == 0) {
+        /* The responder closed the idle connection meanwhile */
+        ssl_ocsp_fetch_close(f, 0);
+        return ssl_ocsp_fetch_connect(f, 0);
+    }
+    ssl_ocsp_fetch_close(f, 0);
+    return 0;
+}
+
+/* Looks up the status of n certificates at once.  The responders of every
+ * certificate are asked concurrently, each first with the first URL of
+ * its AIA extension and then with the next one whenever hedge passes
+ * without an answer or a request fails.  The first definitive answer
+ * wins.  Everything is given up once timeout has passed.  CRL downloads
+ * go the same way over the URLs of their distribution point.
+ */
+static void ssl_ocsp_lookup(tcn_ocsp_lookup_t *lookups, int n, X509_STORE *store,
+                            int timeout, int verifyFlags, apr_interval_time_t hedge)
+{
+    tcn_ocsp_fetch_t *fetches;
+    apr_pollfd_t *pfds;
+    apr_pool_t *p;
+    apr_time_t now = apr_time_now();
+    apr_time_t deadline = now + timeout;
+    int i, j, nfetches = 0, max = 0;
+
+    for (i = 0; i < n; i++)
+        max += lookups[i].nurls;
+    if (max == 0)
+        return;
+    apr_pool_create(&p, NULL);
+    fetches = apr_pcalloc(p, max * sizeof(tcn_ocsp_fetch_t));
+    pfds    = apr_pcalloc(p, max * sizeof(apr_pollfd_t));
+
+    for (;;) {
+        apr_time_t wake = deadline;
+        apr_int32_t npfds = 0, nsds;
+
+        for (i = 0; i < n; i++) {
+            tcn_ocsp_lookup_t *l = &lookups[i];
+            if (l->done)
+                continue;
+            while (l->next < l->nurls && (l->active == 0 || now >= l->hedge)) {
+                char *url = l->urls[l->next++];
+                if (url != NULL && ssl_ocsp_fetch_start(&fetches[nfetches], l, url, p)) {
+                    nfetches++;
+                    l->hedge = now + hedge;
+                }
+            }
+            if (l->next < l->nurls && l->hedge < wake)
+                wake = l->hedge;
+        }
+        for (j = 0; j < nfetches; j++) {
+            tcn_ocsp_fetch_t *f = &fetches[j];
+            if (f->conn == NULL)
+                continue;
+            pfds[npfds].p           = p;
+            pfds[npfds].desc_type   = APR_POLL_SOCKET;
+            pfds[npfds].reqevents   = f->state == OCSP_FETCH_RECEIVING ? APR_POLLIN : APR_POLLOUT;
+            pfds[npfds].rtnevents   = 0;
+            pfds[npfds].desc.s      = f->conn->sock;
+            pfds[npfds].client_data = f;
+            npfds++;
+        }
+        if (npfds == 0 || now >= deadline)
+            break;
+        if (apr_poll(pfds, npfds, &nsds, wake > now ? wake - now : 0) == APR_SUCCESS) {
+            for (j = 0; j < npfds; j++) {
+                tcn_ocsp_fetch_t *f = pfds[j].client_data;
+                tcn_ocsp_lookup_t *l = f->lookup;
+                OCSP_RESPONSE *resp;
+
+                const unsigned char *der;
+
+                if (pfds[j].rtnevents == 0 || f->conn == NULL || ssl_ocsp_fetch_step(f, p))
+                    continue;
+                if (f->state != OCSP_FETCH_DONE || l->done)
+                    continue;
+                der = (const unsigned char *)f->buf + f->body;
+                if (l->dp) {
+                    int k;
+                    if (!process_crl(l, der, (long)f->blen))
+                        continue;
+                    for (k = 0; k < nfetches; k++) {
+                        if (fetches[k].lookup == l)
+                            ssl_ocsp_fetch_close(&fetches[k], 0);
+                    }
+                }
+                else if ((resp = d2i_OCSP_RESPONSE(NULL, &der, (long)f->blen)) != NULL) {
+                    apr_time_t expires = 0;
+                    int error = X509_V_OK;
+                    int r = process_ocsp_response(l->req, resp, l->cert, l->issuer, store,
+                                                  verifyFlags, &error, &expires);
+                    OCSP_RESPONSE_free(resp);
+                    /* If we got a definitive answer (OK or REVOKED), stop trying */
+                    if (r == OCSP_STATUS_OK || r == OCSP_STATUS_REVOKED) {
+                        int k;
+                        l->done    = 1;
+                        l->status  = r;
+                        l->error   = r == OCSP_STATUS_OK ? X509_V_OK : X509_V_ERR_CERT_REVOKED;
+                        l->expires = expires;
+                        if (l->keep && (l->der = malloc(f->blen)) != NULL) {
+                            memcpy(l->der, f->buf + f->body, f->blen);
+                            l->derlen = (int)f->blen;
+                        }
+                        for (k = 0; k < nfetches; k++) {
+                            if (fetches[k].lookup == l)
+                                ssl_ocsp_fetch_close(&fetches[k], 0);
+                        }
+                    }
+                }
+            }
+        }
+        now = apr_time_now();
+    }
+
+    for (j = 0; j < nfetches; j++) {
+        ssl_ocsp_fetch_close(&fetches[j], 0);
+        BIO_free(fetches[j].req);
+    }
+    for (i = 0; i < n; i++) {
+        if (!lookups[i].done) {
+            /* Unable to send request / receive response from any URL. */
+            lookups[i].done  = 1;
+            lookups[i].error = X509_V_ERR_UNABLE_TO_GET_CRL;
+        }
+    }
+    apr_pool_destroy(p);
+}
+
+static int ssl_ocsp_request(X509 *cert, X509 *issuer, X509_STORE_CTX *ctx, tcn_ssl_ctxt_t *c)
+{
+    tcn_ocsp_lookup_t l;
+    apr_pool_t *p;
+
+    apr_pool_create(&p, NULL);
+    ssl_ocsp_lookup_init(&l, cert, issuer, c->ocsp_get, p);
+    ssl_ocsp_lookup(&l, 1, X509_STORE_CTX_get0_store(ctx), c->ocsp_timeout,
+                    c->ocsp_verify_flags, c->ocsp_hedge_delay);
+    if (l.req != NULL)
+        OCSP_REQUEST_free(l.req);
+    apr_pool_destroy(p);
+    if (l.status == OCSP_STATUS_UNKNOWN && l.error != X509_V_OK)
+        X509_STORE_CTX_set_error(ctx, l.error);
+    return l.status;
+}
+
+/*
+ * CRL distribution points
+ *
+ * With CRL_DP_FETCH a context downloads the CRLs named by the HTTP
+ * distribution points of the certificates it checks and hands them to
+ * OpenSSL through the lookup_crls hook of its X509_STORE, next to the
+ * CRLs loaded by setCARevocation.  A thread per context does all the
+ * downloading, over the OCSP HTTP client, and fetches the CRLs in use
+ * again before their nextUpdate; the CRL it had is served until a newer
+ * one arrives.  Under soft fail, the default, a certificate whose CRL is
+ * not there yet is accepted meanwhile.  Without it the handshake waits
+ * when there is no current CRL for a distribution point and a download
+ * is due.
+ */
+typedef struct tcn_crl_dp_t tcn_crl_dp_t;
+
+struct tcn_crl_dp_t {
+    /* the alternative URLs of one distribution point, keyed by the first */
+    char          **urls;
+    int             nurls;
+    X509           *issuer;
+    X509_CRL       *crl;
+    /* nextUpdate of crl, 0 if it has none */
+    apr_time_t      expires;
+    apr_time_t      refresh;
+    /* last lookup, and whether there was one since the last download */
+    apr_time_t      seen;
+    int             used;
+    int             pending;
+    int             waiters;
+    /* downloads over so far */
+    int             fetches;
+};
+
+struct tcn_crl_cache_t {
+    tcn_ssl_ctxt_t     *ctx;
+    apr_thread_mutex_t *mutex;
+    /* signals finished downloads and wakes the thread */
+    apr_thread_cond_t  *cond;
+    apr_hash_t         *dps;
+    int                 count;
+    apr_thread_t       *thread;
+    int                 stop;
+};
+
+/* Most distribution points followed per context */
+#define CRL_DP_MAX           256
+#define CRL_DP_URLS_MAX      8
+/* A CRL is fetched again at least this often while in use, */
+#define CRL_REFRESH_MAX      apr_time_from_sec(3600)
+/* that long before its nextUpdate, */
+#define CRL_REFRESH_AHEAD    apr_time_from_sec(300)
+/* and no sooner than this after a download, failed or not */
+#define CRL_REFRESH_MIN      apr_time_from_sec(30)
+
+#define CRL_DP_BUSY(dp)      ((dp)->pending || (dp)->waiters)
+
+/* Collects the HTTP URLs of a distribution point */
+static int ssl_crl_dp_urls(DIST_POINT *dp, const char **urls, int max)
+{
+    GENERAL_NAMES *names;
+    int i, n = 0;
+
+    if (dp->distpoint == NULL || dp->distpoint->type != 0)
+        return 0;
+    names = dp->distpoint->name.fullname;
+    for (i = 0; i < sk_GENERAL_NAME_num(names) && n < max; i++) {
+        GENERAL_NAME *gn = sk_GENERAL_NAME_value(names, i);
+        const char *uri;
+
+        if (gn->type != GEN_URI)
+            continue;
+        uri = (const char *)ASN1_STRING_get0_data(gn->d.uniformResourceIdentifier);
+        if (ASN1_STRING_length(gn->d.uniformResourceIdentifier) == (int)strlen(uri) &&
+            strncasecmp(uri, "http://", 7) == 0)
+            urls[n++] = uri;
+    }
+    return n;
+}
+
+static void ssl_crl_dp_free(tcn_crl_dp_t *dp)
+{
+    X509_free(dp->issuer);
+    X509_CRL_free(dp->crl);
+    free(dp);
+}
+
+/* Finds or creates the entry of a distribution point.  Must be called
+ * with the mutex held.
+ */
+static tcn_crl_dp_t *ssl_crl_dp_get(tcn_crl_cache_t *cache, DIST_POINT *point, X509 *issuer)
+{
+    const char *urls[CRL_DP_URLS_MAX];
+    apr_size_t size;
+    tcn_crl_dp_t *dp;
+    char *buf;
+    int i, n;
+
+    if ((n = ssl_crl_dp_urls(point, urls, CRL_DP_URLS_MAX)) == 0)
+        return NULL;
+    if ((dp = apr_hash_get(cache->dps, urls[0], APR_HASH_KEY_STRING)) != NULL)
+        return dp;
+    if (cache->count >= CRL_DP_MAX) {
+        /* Make room by dropping the one unused for the longest time */
+        apr_hash_index_t *hi;
+        tcn_crl_dp_t *old = NULL;
+
+        for (hi = apr_hash_first(NULL, cache->dps); hi; hi = apr_hash_next(hi)) {
+            tcn_crl_dp_t *d;
+            apr_hash_this(hi, NULL, NULL, (void **)&d);
+            if (!CRL_DP_BUSY(d) && (old == NULL || d->seen < old->seen))
+                old = d;
+        }
+        if (old == NULL)
+            return NULL;
+        apr_hash_set(cache->dps, old->urls[0], APR_HASH_KEY_STRING, NULL);
+        ssl_crl_dp_free(old);
+        cache->count--;
+    }
+    size = sizeof(tcn_crl_dp_t) + n * sizeof(char *);
+    for (i = 0; i < n; i++)
+        size += strlen(urls[i]) + 1;
+    if ((dp = malloc(size)) == NULL)
+        return NULL;
+    memset(dp, 0, sizeof(tcn_crl_dp_t));
+    dp->urls  = (char **)(dp + 1);
+    dp->nurls = n;
+    buf = (char *)(dp->urls + n);
+    for (i = 0; i < n; i++) {
+        apr_size_t len = strlen(urls[i]) + 1;
+        dp->urls[i] = memcpy(buf, urls[i], len);
+        buf += len;
+    }
+    dp->issuer = issuer;
+    X509_up_ref(issuer);
+    /* New ones are due at once */
+    dp->used = 1;
+    apr_hash_set(cache->dps, dp->urls[0], APR_HASH_KEY_STRING, dp);
+    cache->count++;
+    return dp;
+}
+
+/* Downloads the CRLs of n entries, marked pending by the caller.  Called
+ * with the mutex held, which is released meanwhile.
+ */
+static void ssl_crl_fetch(tcn_crl_cache_t *cache, tcn_crl_dp_t **dps, int n)
+{
+    tcn_ssl_ctxt_t *c = cache->ctx;
+    tcn_ocsp_lookup_t lookups[OCSP_FETCH_MAX];
+    apr_time_t now;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        tcn_ocsp_lookup_t *l = &lookups[i];
+
+        dps[i]->used = 0;
+        memset(l, 0, sizeof(tcn_ocsp_lookup_t));
+        l->dp     = 1;
+        l->issuer = dps[i]->issuer;
+        l->urls   = dps[i]->urls;
+        l->nurls  = dps[i]->nurls;
+        l->status = OCSP_STATUS_UNKNOWN;
+        l->error  = X509_V_OK;
+    }
+    apr_thread_mutex_unlock(cache->mutex);
+    ssl_ocsp_lookup(lookups, n, NULL, c->ocsp_timeout, 0, c->ocsp_hedge_delay);
+    apr_thread_mutex_lock(cache->mutex);
+
+    now = apr_time_now();
+    for (i = 0; i < n; i++) {
+        tcn_crl_dp_t *dp = dps[i];
+        X509_CRL *crl = lookups[i].crl;
+
+        dp->refresh = now + CRL_REFRESH_MAX;
+        /* Never go back to an older CRL than the one served */
+        if (crl != NULL && (dp->crl == NULL ||
+            ASN1_TIME_compare(X509_CRL_get0_lastUpdate(crl),
+                              X509_CRL_get0_lastUpdate(dp->crl)) >= 0)) {
+            if (dp->crl == NULL ||
+                ASN1_TIME_compare(X509_CRL_get0_lastUpdate(crl),
+                                  X509_CRL_get0_lastUpdate(dp->crl)) > 0)
+                SSL_verify_cache_invalidate(cache->ctx);
+            X509_CRL_free(dp->crl);
+            dp->crl     = crl;
+            dp->expires = lookups[i].expires;
+            if (dp->expires != 0 && dp->expires - CRL_REFRESH_AHEAD < dp->refresh)
+                dp->refresh = dp->expires - CRL_REFRESH_AHEAD;
+        }
+        else {
+            X509_CRL_free(crl);
+            dp->refresh = now;
+        }
+        if (dp->refresh < now + CRL_REFRESH_MIN)
+            dp->refresh = now + CRL_REFRESH_MIN;
+        dp->fetches++;
+        dp->pending = 0;
+    }
+    apr_thread_cond_broadcast(cache->cond);
+}
+
+static void *APR_THREAD_FUNC ssl_crl_thread(apr_thread_t *thd, void *data)
+{
+    tcn_crl_cache_t *cache = (tcn_crl_cache_t *)data;
+
+    apr_thread_mutex_lock(cache->mutex);
+    while (!cache->stop) {
+        tcn_crl_dp_t *due[OCSP_FETCH_MAX];
+        apr_hash_index_t *hi;
+        apr_time_t now = apr_time_now();
+        apr_time_t next = now + OCSP_REFRESH_WAIT;
+        int i, n = 0;
+
+        for (hi = apr_hash_first(NULL, cache->dps); hi; hi = apr_hash_next(hi)) {
+            tcn_crl_dp_t *dp;
+            apr_hash_this(hi, NULL, NULL, (void **)&dp);
+            if (dp->pending)
+                continue;
+            if (dp->refresh <= now) {
+                if (dp->used && n < OCSP_FETCH_MAX)
+                    due[n++] = dp;
+            }
+            else if (dp->refresh < next) {
+                next = dp->refresh;
+            }
+        }
+        if (n == 0) {
+            apr_thread_cond_timedwait(cache->cond, cache->mutex, next - now);
+            continue;
+        }
+        for (i = 0; i < n; i++)
+            due[i]->pending = 1;
+        ssl_crl_fetch(cache, due, n);
+    }
+    apr_thread_mutex_unlock(cache->mutex);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+/* Only while the thread runs are there any CRLs to hand out */
+static void ssl_crl_stop(tcn_crl_cache_t *cache)
+{
+    apr_thread_t *thread;
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(cache->mutex);
+    thread = cache->thread;
+    cache->thread = NULL;
+    cache->stop = 1;
+    apr_thread_cond_broadcast(cache->cond);
+    apr_thread_mutex_unlock(cache->mutex);
+    if (thread != NULL)
+        apr_thread_join(&rv, thread);
+}
+
+static apr_status_t ssl_crl_cache_pre_cleanup(void *data)
+{
+    ssl_crl_stop((tcn_crl_cache_t *)data);
+    return APR_SUCCESS;
+}
+
+/* The CRLs of the store for nm, with those downloaded for the current
+ * certificate added.
+ */
+static STACK_OF(X509_CRL) *ssl_crl_lookup(const X509_STORE_CTX *ctx, const X509_NAME *nm)
+{
+    STACK_OF(X509_CRL) *crls = X509_STORE_CTX_get1_crls(ctx, nm);
+    SSL *ssl = X509_STORE_CTX_get_ex_data(ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+    STACK_OF(X509) *chain = X509_STORE_CTX_get0_chain(ctx);
+    X509 *cert = X509_STORE_CTX_get_current_cert(ctx);
+    int depth = X509_STORE_CTX_get_error_depth(ctx);
+    CRL_DIST_POINTS *points;
+    tcn_crl_cache_t *cache;
+    tcn_ssl_ctxt_t *c;
+    X509 *issuer;
+    apr_time_t now;
+    int i;
+
+    if (ssl == NULL || cert == NULL || chain == NULL ||
+        (c = (tcn_ssl_ctxt_t *)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl))) == NULL ||
+        (cache = c->crl_cache) == NULL)
+        return crls;
+    issuer = sk_X509_value(chain, TCN_MIN(depth + 1, sk_X509_num(chain) - 1));
+    if (issuer == NULL || X509_check_issued(issuer, cert) != X509_V_OK ||
+        (points = X509_get_ext_d2i(cert, NID_crl_distribution_points, NULL, NULL)) == NULL)
+        return crls;
+
+    apr_thread_mutex_lock(cache->mutex);
+    for (i = 0; i < sk_DIST_POINT_num(points); i++) {
+        tcn_crl_dp_t *dp;
+
+        /* Stopped, the entries are about to be freed */
+        if (cache->thread == NULL)
+            break;
+        if ((dp = ssl_crl_dp_get(cache, sk_DIST_POINT_value(points, i), issuer)) == NULL)
+            continue;
+        now = apr_time_now();
+        dp->seen = now;
+        if (!dp->used) {
+            dp->used = 1;
+            /* Overdue while unused, the thread did not wait for it */
+            if (dp->refresh <= now)
+                apr_thread_cond_broadcast(cache->cond);
+        }
+        if (dp->crl == NULL || (dp->expires != 0 && dp->expires <= now)) {
+            if (dp->refresh <= now && !dp->pending)
+                apr_thread_cond_broadcast(cache->cond);
+            if (!c->crl_dp_soft_fail && (dp->pending || dp->refresh <= now)) {
+                /* Nothing to check against, wait for the download */
+                int fetches = dp->fetches;
+
+                dp->waiters++;
+                while (dp->fetches == fetches && cache->thread != NULL)
+                    apr_thread_cond_wait(cache->cond, cache->mutex);
+                /* SSL_crl_cache_destroy() waits for the last one to leave */
+                if (--dp->waiters == 0 && cache->thread == NULL)
+                    apr_thread_cond_broadcast(cache->cond);
+                now = apr_time_now();
+            }
+        }
+        if (dp->crl != NULL && (dp->expires == 0 || dp->expires > now) &&
+            X509_NAME_cmp(X509_CRL_get_issuer(dp->crl), nm) == 0) {
+            if (crls == NULL)
+                crls = sk_X509_CRL_new_null();
+            if (crls != NULL && sk_X509_CRL_push(crls, dp->crl))
+                X509_CRL_up_ref(dp->crl);
+        }
+    }
+    apr_thread_mutex_unlock(cache->mutex);
+    CRL_DIST_POINTS_free(points);
+    return crls;
+}
+
+/* Whether CRLs were loaded by setCARevocation or reloadTrust */
+static int ssl_crl_loaded(tcn_ssl_ctxt_t *c)
+{
+    int loaded;
+
+    if (c->trust_mutex == NULL)
+        return c->crl != NULL;
+    apr_thread_mutex_lock(c->trust_mutex);
+    loaded = c->crl != NULL;
+    apr_thread_mutex_unlock(c->trust_mutex);
+    return loaded;
+}
+
+#ifndef LIBRESSL_VERSION_NUMBER
+/* Sets or removes the lookup of the downloaded CRLs in the stores of the
+ * context, the one of the SSL_CTX and the one of the last reloadTrust.
+ */
+static void ssl_crl_hook(tcn_ssl_ctxt_t *c, X509_STORE_CTX_lookup_crls_fn fn)
+{
+    if (c->trust_mutex != NULL)
+        apr_thread_mutex_lock(c->trust_mutex);
+    X509_STORE_set_lookup_crls(SSL_CTX_get_cert_store(c->ctx), fn);
+    if (c->trust != NULL)
+        X509_STORE_set_lookup_crls(c->trust, fn);
+    if (c->trust_mutex != NULL)
+        apr_thread_mutex_unlock(c->trust_mutex);
+}
+#endif
+
+apr_status_t SSL_crl_cache_configure(tcn_ssl_ctxt_t *c, int fetch)
+{
+#ifdef LIBRESSL_VERSION_NUMBER
+    return fetch ? APR_ENOTIMPL : APR_SUCCESS;
+#else
+    tcn_crl_cache_t *cache = c->crl_cache;
+    apr_status_t rv;
+
+    if (!fetch) {
+        if (cache != NULL) {
+            ssl_crl_hook(c, NULL);
+            if (!ssl_crl_loaded(c))
+                X509_VERIFY_PARAM_clear_flags(SSL_CTX_get0_param(c->ctx), X509_V_FLAG_CRL_CHECK);
+            SSL_crl_cache_destroy(c);
+        }
+        return APR_SUCCESS;
+    }
+    if (cache != NULL)
+        return APR_SUCCESS;
+    if ((cache = apr_pcalloc(c->pool, sizeof(tcn_crl_cache_t))) == NULL)
+        return APR_ENOMEM;
+    if ((rv = apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                      c->pool)) != APR_SUCCESS)
+        return rv;
+    if ((rv = apr_thread_cond_create(&cache->cond, c->pool)) != APR_SUCCESS)
+        return rv;
+    cache->ctx = c;
+    cache->dps = apr_hash_make(c->pool);
+    if ((rv = apr_thread_create(&cache->thread, NULL, ssl_crl_thread,
+                                cache, c->pool)) != APR_SUCCESS)
+        return rv;
+    apr_pool_pre_cleanup_register(c->pool, cache, ssl_crl_cache_pre_cleanup);
+    c->crl_cache = cache;
+    ssl_crl_hook(c, ssl_crl_lookup);
+    /* Peer certificates only, not the signers of OCSP responses */
+    X509_VERIFY_PARAM_set_flags(SSL_CTX_get0_param(c->ctx), X509_V_FLAG_CRL_CHECK);
+    return APR_SUCCESS;
+#endif
+}
+
+/* Hooks the downloaded CRLs into a store made for the context.  Called
+ * with trust_mutex held.
+ */
+void SSL_crl_cache_attach(tcn_ssl_ctxt_t *c, X509_STORE *store)
+{
+#ifndef LIBRESSL_VERSION_NUMBER
+    if (c->crl_cache != NULL)
+        X509_STORE_set_lookup_crls(store, ssl_crl_lookup);
+#endif
+}
+
+void SSL_crl_cache_destroy(tcn_ssl_ctxt_t *c)
+{
+    tcn_crl_cache_t *cache = c->crl_cache;
+    apr_hash_index_t *hi;
+
+    if (cache == NULL)
+        return;
+    ssl_crl_stop(cache);
+    c->crl_cache = NULL;
+    apr_thread_mutex_lock(cache->mutex);
+    /* Handshakes woken by ssl_crl_stop() may still be in an entry */
+    for (;;) {
+        int busy = 0;
+
+        for (hi = apr_hash_first(NULL, cache->dps); hi && !busy; hi = apr_hash_next(hi)) {
+            tcn_crl_dp_t *dp;
+            apr_hash_this(hi, NULL, NULL, (void **)&dp);
+            busy = CRL_DP_BUSY(dp);
+        }
+        if (!busy)
+            break;
+        apr_thread_cond_wait(cache->cond, cache->mutex);
+    }
+    for (hi = apr_hash_first(NULL, cache->dps); hi; hi = apr_hash_next(hi)) {
+        tcn_crl_dp_t *dp;
+        apr_hash_this(hi, NULL, NULL, (void **)&dp);
+        ssl_crl_dp_free(dp);
+    }
+    apr_hash_clear(cache->dps);
+    cache->count = 0;
+    apr_thread_mutex_unlock(cache->mutex);
+}
+
+/* Whether a missing CRL is fine for the current certificate: one with a
+ * distribution point under soft fail, one without if no CRLs were loaded
+ * by setCARevocation or reloadTrust.
+ */
+int SSL_crl_cache_optional(tcn_ssl_ctxt_t *c, X509_STORE_CTX *ctx)
+{
+    X509 *cert = X509_STORE_CTX_get_current_cert(ctx);
+    CRL_DIST_POINTS *points;
+    const char *url;
+    int i, dp = 0;
+
+    if (c->crl_cache == NULL || cert == NULL)
+        return 0;
+    if ((points = X509_get_ext_d2i(cert, NID_crl_distribution_points, NULL, NULL)) != NULL) {
+        for (i = 0; i < sk_DIST_POINT_num(points) && !dp; i++)
+            dp = ssl_crl_dp_urls(sk_DIST_POINT_value(points, i), &url, 1);
+        CRL_DIST_POINTS_free(points);
+    }
+    return dp ? c->crl_dp_soft_fail : !ssl_crl_loaded(c);
+}
+
+#endif /* HAVE_OCSP */
+
+/*
+ * Revocation index
+ *
+ * The serial numbers of revoked certificates taken from CRLs, written to
+ * a file that contexts map read only.  However large the CRLs, their pages
+ * are shared by every context and process mapping the same file, and a
+ * lookup costs two binary searches without touching the X509_STORE.  The
+ * file is written by SSL_rev_index_build from CRLs that verify against
+ * the trust store of a context.  An issuer is found by the SHA-256 of its
+ * public key, and its serials are padded to the same width and sorted so
+ * they compare with memcmp.
+ */
+#define REV_INDEX_MAGIC      "TCNRIDX1"
+#define REV_INDEX_KEY_LEN    32
+/* Sign byte and magnitude of the longest serial, RFC 5280 allows 20 octets */
+#define REV_INDEX_WIDTH_MAX  32
+
+/* Index file layout, in native byte order: the header, the issuers sorted
+ * by key and the serials they point to.
+ */
+typedef struct {
+    char            magic[8];
+    apr_uint32_t    count;
+    apr_uint32_t    size;
+} tcn_rev_index_hdr_t;
+
+typedef struct {
+    unsigned char   key[REV_INDEX_KEY_LEN];
+    /* earliest nextUpdate of the CRLs, 0 if none has one */
+    apr_int64_t     expires;
+    apr_uint32_t    serials;
+    apr_uint32_t    count;
+    apr_uint32_t    width;
+    apr_uint32_t    reserved;
+} tcn_rev_index_rec_t;
+
+struct tcn_rev_index_t {
+    apr_pool_t     *pool;
+    const char     *map;
+    apr_size_t      size;
+    /* held by the context while set and by lookups in progress */
+    apr_uint32_t    refs;
+};
+
+/* Serials of one issuer while the index is built */
+typedef struct {
+    unsigned char   key[REV_INDEX_KEY_LEN];
+    apr_int64_t     expires;
+    apr_uint32_t    width;
+    apr_array_header_t *slots;
+} tcn_rev_index_issuer_t;
+
+/* Writes the sign byte and the magnitude right aligned in width bytes.
+ * Returns 0 if the serial is too long for that.
+ */
+static int ssl_rev_index_slot(const ASN1_INTEGER *serial, unsigned char *slot,
+                              apr_size_t width)
+{
+    const unsigned char *d = ASN1_STRING_get0_data(serial);
+    int len = ASN1_STRING_length(serial);
+
+    while (len > 0 && *d == 0) {
+        d++;
+        len--;
+    }
+    if ((apr_size_t)len >= width)
+        return 0;
+    memset(slot, 0, width - len);
+    slot[0] = ASN1_STRING_type(serial) == V_ASN1_NEG_INTEGER;
+    memcpy(slot + width - len, d, len);
+    return 1;
+}
+
+static int ssl_rev_index_slot_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, REV_INDEX_WIDTH_MAX);
+}
+
+static int ssl_rev_index_issuer_cmp(const void *a, const void *b)
+{
+    const tcn_rev_index_issuer_t *x = *(const tcn_rev_index_issuer_t * const *)a;
+    const tcn_rev_index_issuer_t *y = *(const tcn_rev_index_issuer_t * const *)b;
+
+    return memcmp(x->key, y->key, REV_INDEX_KEY_LEN);
+}
+
+/* Checks the layout of a mapped index file */
+static int ssl_rev_index_valid(const char *map, apr_size_t size)
+{
+    const tcn_rev_index_hdr_t *hdr = (const tcn_rev_index_hdr_t *)map;
+    const tcn_rev_index_rec_t *recs = (const tcn_rev_index_rec_t *)(hdr + 1);
+    apr_uint32_t i;
+
+    if (size < sizeof(tcn_rev_index_hdr_t) || memcmp(hdr->magic, REV_INDEX_MAGIC, 8) ||
+        hdr->size != size ||
+        hdr->count > (size - sizeof(tcn_rev_index_hdr_t)) / sizeof(tcn_rev_index_rec_t))
+        return 0;
+    for (i = 0; i < hdr->count; i++) {
+        if (recs[i].width < 2 || recs[i].width > REV_INDEX_WIDTH_MAX ||
+            recs[i].serials > size || recs[i].count > (size - recs[i].serials) / recs[i].width ||
+            (i > 0 && memcmp(recs[i].key, recs[i - 1].key, REV_INDEX_KEY_LEN) <= 0))
+            return 0;
+    }
+    return 1;
+}
+
+static void ssl_rev_index_release(tcn_rev_index_t *idx)
+{
+    if (apr_atomic_dec32(&idx->refs) == 0)
+        apr_pool_destroy(idx->pool);
+}
+
+/* Reads the CRLs of a file, PEM encoded or a single DER one */
+static int ssl_rev_index_read(const char *file, STACK_OF(X509_CRL) *crls)
+{
+    X509_CRL *crl;
+    BIO *bio;
+    int n = 0;
+
+    if ((bio = BIO_new_file(file, "rb")) == NULL)
+        return -1;
+    while ((crl = PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL)) != NULL) {
+        if (!sk_X509_CRL_push(crls, crl)) {
+            X509_CRL_free(crl);
+            n = -1;
+            break;
+        }
+        n++;
+    }
+    if (n == 0 && BIO_seek(bio, 0) == 0 &&
+        (crl = d2i_X509_CRL_bio(bio, NULL)) != NULL) {
+        if (sk_X509_CRL_push(crls, crl))
+            n++;
+        else
+            X509_CRL_free(crl);
+    }
+    ERR_clear_error();
+    BIO_free(bio);
+    return n;
+}
+
+/* The certificate of the trust store that signed crl */
+static X509 *ssl_rev_index_signer(X509_STORE_CTX *sctx, X509_CRL *crl)
+{
+    STACK_OF(X509) *certs;
+    X509 *signer = NULL;
+    int i;
+
+    if ((certs = X509_STORE_CTX_get1_certs(sctx, X509_CRL_get_issuer(crl))) == NULL)
+        return NULL;
+    for (i = 0; i < sk_X509_num(certs) && signer == NULL; i++) {
+        X509 *cert = sk_X509_value(certs, i);
+        EVP_PKEY *pkey = X509_get0_pubkey(cert);
+        if (pkey != NULL && X509_CRL_verify(crl, pkey) > 0) {
+            X509_up_ref(cert);
+            signer = cert;
+        }
+    }
+    sk_X509_pop_free(certs, X509_free);
+    ERR_clear_error();
+    return signer;
+}
+
+/* Takes the serials of a verified CRL into the issuer of signer */
+static const char *ssl_rev_index_add(apr_hash_t *issuers, apr_pool_t *p, X509_CRL *crl,
+                                     X509 *signer, apr_time_t now)
+{
+    STACK_OF(X509_REVOKED) *revoked = X509_CRL_get_REVOKED(crl);
+    const ASN1_TIME *next = X509_CRL_get0_nextUpdate(crl);
+    tcn_rev_index_issuer_t *is;
+    unsigned char key[REV_INDEX_KEY_LEN];
+    unsigned int keylen;
+    apr_time_t expires = 0;
+    int i, days, secs;
+
+    if (!X509_pubkey_digest(signer, EVP_sha256(), key, &keylen))
+        return "unable to hash the issuer key";
+    if (next != NULL) {
+        if (!ASN1_TIME_diff(&days, &secs, NULL, next))
+            return "invalid nextUpdate";
+        if (days < 0 || secs < 0 || (days == 0 && secs == 0))
+            return "expired";
+        expires = now + apr_time_from_sec((apr_time_t)days * 86400 + secs);
+    }
+    if ((is = apr_hash_get(issuers, key, REV_INDEX_KEY_LEN)) == NULL) {
+        is = apr_pcalloc(p, sizeof(*is));
+        memcpy(is->key, key, REV_INDEX_KEY_LEN);
+        is->slots = apr_array_make(p, sk_X509_REVOKED_num(revoked) + 1, REV_INDEX_WIDTH_MAX);
+        apr_hash_set(issuers, is->key, REV_INDEX_KEY_LEN, is);
+    }
+    /* Several CRLs of an issuer are merged, the first to expire counts */
+    if (expires != 0 && (is->expires == 0 || expires < is->expires))
+        is->expires = expires;
+    for (i = 0; i < sk_X509_REVOKED_num(revoked); i++) {
+        const ASN1_INTEGER *serial = X509_REVOKED_get0_serialNumber(sk_X509_REVOKED_value(revoked, i));
+        unsigned char *slot = apr_array_push(is->slots);
+        if (!ssl_rev_index_slot(serial, slot, REV_INDEX_WIDTH_MAX))
+            return "serial number too long";
+    }
+    return NULL;
+}
+
+/* Writes the index of the CRLs in crlfile to file, replacing it at once.
+ * Every CRL has to be a full one signed by a certificate of the trust
+ * store that has not expired.  Returns the number of serials, or -1 with
+ * the reason in err.
+ */
+int SSL_rev_index_build(tcn_ssl_ctxt_t *c, const char *file, const char *crlfile,
+                        char *err, apr_size_t errlen)
+{
+    STACK_OF(X509_CRL) *crls = NULL;
+    X509_STORE_CTX *sctx = NULL;
+    X509_STORE *store;
+    tcn_rev_index_issuer_t **list;
+    tcn_rev_index_hdr_t *hdr;
+    tcn_rev_index_rec_t *recs;
+    apr_hash_index_t *hi;
+    apr_hash_t *issuers;
+    apr_file_t *f;
+    apr_pool_t *p;
+    apr_size_t size, off;
+    apr_time_t now = apr_time_now();
+    char *buf = NULL, *tmp, name[256];
+    const char *msg;
+    int i, j, n, total = -1;
+
+    if (apr_pool_create(&p, NULL) != APR_SUCCESS) {
+        apr_snprintf(err, errlen, "Out of memory");
+        return -1;
+    }
+    issuers = apr_hash_make(p);
+    store = SSL_trust_store_get(c);
+    if ((crls = sk_X509_CRL_new_null()) == NULL || (sctx = X509_STORE_CTX_new()) == NULL ||
+        !X509_STORE_CTX_init(sctx, store, NULL, NULL)) {
+        apr_snprintf(err, errlen, "Out of memory");
+        goto cleanup;
+    }
+    if ((n = ssl_rev_index_read(crlfile, crls)) <= 0) {
+        apr_snprintf(err, errlen, "No CRL read from %s", crlfile);
+        goto cleanup;
+    }
+    for (i = 0; i < n; i++) {
+        X509_CRL *crl = sk_X509_CRL_value(crls, i);
+        ISSUING_DIST_POINT *idp;
+        X509 *signer;
+
+        X509_NAME_oneline(X509_CRL_get_issuer(crl), name, sizeof(name));
+        if (X509_CRL_get_ext_by_NID(crl, NID_delta_crl, -1) >= 0) {
+            apr_snprintf(err, errlen, "Delta CRL of %s", name);
+            goto cleanup;
+        }
+        /* Entries of indirect CRLs may belong to other issuers */
+        idp = X509_CRL_get_ext_d2i(crl, NID_issuing_distribution_point, NULL, NULL);
+        j = idp != NULL && idp->indirectCRL;
+        ISSUING_DIST_POINT_free(idp);
+        if (j) {
+            apr_snprintf(err, errlen, "Indirect CRL of %s", name);
+            goto cleanup;
+        }
+        if ((signer = ssl_rev_index_signer(sctx, crl)) == NULL) {
+            apr_snprintf(err, errlen, "CRL of %s not signed by a trusted certificate", name);
+            goto cleanup;
+        }
+        msg = ssl_rev_index_add(issuers, p, crl, signer, now);
+        X509_free(signer);
+        if (msg != NULL) {
+            apr_snprintf(err, errlen, "CRL of %s: %s", name, msg);
+            goto cleanup;
+        }
+    }
+
+    n = apr_hash_count(issuers);
+    list = apr_palloc(p, (n + 1) * sizeof(*list));
+    size = sizeof(tcn_rev_index_hdr_t) + n * sizeof(tcn_rev_index_rec_t);
+    i = 0;
+    for (hi = apr_hash_first(p, issuers); hi; hi = apr_hash_next(hi)) {
+        tcn_rev_index_issuer_t *is;
+        unsigned char *slots;
+        int k = 0;
+
+        apr_hash_this(hi, NULL, NULL, (void **)&is);
+        slots = (unsigned char *)is->slots->elts;
+        qsort(slots, is->slots->nelts, REV_INDEX_WIDTH_MAX, ssl_rev_index_slot_cmp);
+        /* Drop the duplicates and find the widest */
+        is->width = 2;
+        for (j = 0; j < is->slots->nelts; j++) {
+            unsigned char *slot = slots + j * REV_INDEX_WIDTH_MAX;
+            int w = REV_INDEX_WIDTH_MAX;
+            if (k > 0 && !memcmp(slot, slots + (k - 1) * REV_INDEX_WIDTH_MAX, REV_INDEX_WIDTH_MAX))
+                continue;
+            if (k != j)
+                memcpy(slots + k * REV_INDEX_WIDTH_MAX, slot, REV_INDEX_WIDTH_MAX);
+            k++;
+            while (w > 1 && slot[REV_INDEX_WIDTH_MAX - w + 1] == 0)
+                w--;
+            if ((apr_uint32_t)w > is->width)
+                is->width = w;
+        }
+        is->slots->nelts = k;
+        size += (apr_size_t)k * is->width;
+        list[i++] = is;
+    }
+    qsort(list, n, sizeof(*list), ssl_rev_index_issuer_cmp);
+    if (size > APR_UINT32_MAX || (buf = malloc(size)) == NULL) {
+        apr_snprintf(err, errlen, "Index too large");
+        goto cleanup;
+    }
+    hdr  = (tcn_rev_index_hdr_t *)buf;
+    recs = (tcn_rev_index_rec_t *)(hdr + 1);
+    memcpy(hdr->magic, REV_INDEX_MAGIC, 8);
+    hdr->count = n;
+    hdr->size  = (apr_uint32_t)size;
+    off   = sizeof(tcn_rev_index_hdr_t) + n * sizeof(tcn_rev_index_rec_t);
+    total = 0;
+    for (i = 0; i < n; i++) {
+        tcn_rev_index_issuer_t *is = list[i];
+        unsigned char *slots = (unsigned char *)is->slots->elts;
+
+        memset(&recs[i], 0, sizeof(tcn_rev_index_rec_t));
+        memcpy(recs[i].key, is->key, REV_INDEX_KEY_LEN);
+        recs[i].expires = is->expires;
+        recs[i].serials = (apr_uint32_t)off;
+        recs[i].count   = is->slots->nelts;
+        recs[i].width   = is->width;
+        for (j = 0; j < is->slots->nelts; j++) {
+            unsigned char *slot = slots + j * REV_INDEX_WIDTH_MAX;
+            buf[off] = slot[0];
+            memcpy(buf + off + 1, slot + REV_INDEX_WIDTH_MAX - is->width + 1, is->width - 1);
+            off += is->width;
+        }
+        total += is->slots->nelts;
+    }
+
+    /* Replaced at once, mappings of the old file stay valid */
+    tmp = apr_pstrcat(p, file, ".tmp", NULL);
+    if (apr_file_open(&f, tmp, APR_FOPEN_WRITE | APR_FOPEN_CREATE | APR_FOPEN_TRUNCATE |
+                      APR_FOPEN_BINARY, APR_OS_DEFAULT, p) != APR_SUCCESS) {
+        apr_snprintf(err, errlen, "Unable to create %s", tmp);
+        total = -1;
+        goto cleanup;
+    }
+    if (apr_file_write_full(f, buf, size, NULL) != APR_SUCCESS || apr_file_sync(f) != APR_SUCCESS) {
+        apr_file_close(f);
+        apr_file_remove(tmp, p);
+        apr_snprintf(err, errlen, "Unable to write %s", tmp);
+        total = -1;
+        goto cleanup;
+    }
+    apr_file_close(f);
+    if (apr_file_rename(tmp, file, p) != APR_SUCCESS) {
+        apr_file_remove(tmp, p);
+        apr_snprintf(err, errlen, "Unable to rename %s", tmp);
+        total = -1;
+    }
+
+cleanup:
+    free(buf);
+    X509_STORE_CTX_free(sctx);
+    sk_X509_CRL_pop_free(crls, X509_CRL_free);
+    X509_STORE_free(store);
+    apr_pool_destroy(p);
+    return total;
+}
+
+/* Maps file as the revocation index of the context, or drops it if file
+ * is NULL.  Lookups in progress keep the one they started with.
+ */
+apr_status_t SSL_rev_index_set(tcn_ssl_ctxt_t *c, const char *file)
+{
+    tcn_rev_index_t *idx = NULL, *old;
+    apr_finfo_t finfo;
+    apr_mmap_t *mm;
+    apr_file_t *f;
+    apr_pool_t *p;
+    apr_status_t rv;
+
+    if (file != NULL) {
+        if ((rv = apr_pool_create(&p, NULL)) != APR_SUCCESS)
+            return rv;
+        if ((rv = apr_file_open(&f, file, APR_FOPEN_READ | APR_FOPEN_BINARY, APR_OS_DEFAULT,
+                                p)) != APR_SUCCESS) {
+            apr_pool_destroy(p);
+            return rv;
+        }
+        if ((rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, f)) == APR_SUCCESS) {
+            if (finfo.size <= 0)
+                rv = APR_EINVAL;
+            else
+                rv = apr_mmap_create(&mm, f, 0, (apr_size_t)finfo.size, APR_MMAP_READ, p);
+        }
+        apr_file_close(f);
+        if (rv == APR_SUCCESS && !ssl_rev_index_valid(mm->mm, mm->size))
+            rv = APR_EINVAL;
+        if (rv != APR_SUCCESS) {
+            apr_pool_destroy(p);
+            return rv;
+        }
+        idx = apr_pcalloc(p, sizeof(*idx));
+        idx->pool = p;
+        idx->map  = mm->mm;
+        idx->size = mm->size;
+        idx->refs = 1;
+    }
+    apr_thread_mutex_lock(c->trust_mutex);
+    old = c->rev_index;
+    c->rev_index = idx;
+    apr_atomic_set32(&c->rev_indexed, idx != NULL);
+    apr_thread_mutex_unlock(c->trust_mutex);
+    if (old != NULL)
+        ssl_rev_index_release(old);
+    return APR_SUCCESS;
+}
+
+/* Called from the context cleanup, without the mutex */
+void SSL_rev_index_destroy(tcn_ssl_ctxt_t *c)
+{
+    if (c->rev_index != NULL) {
+        ssl_rev_index_release(c->rev_index);
+        c->rev_index = NULL;
+        c->rev_indexed = 0;
+    }
+}
+
+static const tcn_rev_index_rec_t *ssl_rev_index_find(const tcn_rev_index_t *idx,
+                                                     const unsigned char *key)
+{
+    const tcn_rev_index_hdr_t *hdr = (const tcn_rev_index_hdr_t *)idx->map;
+    const tcn_rev_index_rec_t *recs = (const tcn_rev_index_rec_t *)(hdr + 1);
+    apr_uint32_t lo = 0, hi = hdr->count;
+
+    while (lo < hi) {
+        apr_uint32_t mid = lo + (hi - lo) / 2;
+        int r = memcmp(recs[mid].key, key, REV_INDEX_KEY_LEN);
+        if (r == 0)
+            return &recs[mid];
+        if (r < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+/* Looks up the current certificate of ctx.  Returns X509_V_OK unless it
+ * is listed, or the CRLs of its issuer have expired.
+ */
+int SSL_rev_index_check(tcn_ssl_ctxt_t *c, X509_STORE_CTX *ctx)
+{
+    X509 *cert = X509_STORE_CTX_get_current_cert(ctx);
+    X509 *issuer = X509_STORE_CTX_get0_current_issuer(ctx);
+    const tcn_rev_index_rec_t *rec;
+    tcn_rev_index_t *idx;
+    unsigned char key[REV_INDEX_KEY_LEN], slot[REV_INDEX_WIDTH_MAX];
+    unsigned int keylen;
+    int rv = X509_V_OK;
+
+    if (apr_atomic_read32(&c->rev_indexed) == 0 || cert == NULL || issuer == NULL ||
+        cert == issuer)
+        return X509_V_OK;
+    if (!X509_pubkey_digest(issuer, EVP_sha256(), key, &keylen))
+        return X509_V_ERR_OUT_OF_MEM;
+    apr_thread_mutex_lock(c->trust_mutex);
+    if ((idx = c->rev_index) != NULL)
+        apr_atomic_inc32(&idx->refs);
+    apr_thread_mutex_unlock(c->trust_mutex);
+    if (idx == NULL)
+        return X509_V_OK;
+
+    if ((rec = ssl_rev_index_find(idx, key)) != NULL) {
+        if (rec->expires != 0 && rec->expires < apr_time_now()) {
+            rv = X509_V_ERR_CRL_HAS_EXPIRED;
+        }
+        else if (ssl_rev_index_slot(X509_get0_serialNumber(cert), slot, rec->width)) {
+            const unsigned char *serials = (const unsigned char *)idx->map + rec->serials;
+            apr_uint32_t lo = 0, hi = rec->count;
+
+            while (lo < hi) {
+                apr_uint32_t mid = lo + (hi - lo) / 2;
+                int r = memcmp(serials + (apr_size_t)mid * rec->width, slot, rec->width);
+                if (r == 0) {
+                    rv = X509_V_ERR_CERT_REVOKED;
+                    break;
+                }
+                if (r < 0)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+        }
+    }
+    ssl_rev_index_release(idx);
+    return rv;
+}
+
+/*
+ * Verification result cache
+ *
+ * Peer chains that verified, keyed by the SHA-256 of the chain and of the
+ * settings it was verified with, so a client coming back skips chain
+ * building, the revocation checks and the CertificateVerifier until its
+ * entry expires.  Only successes are kept, each for the TTL but not past
+ * the earliest notAfter of the chain.  The trust generation of the
+ * connection and the verify epoch of the context, read before verifying,
+ * are part of the key.  The epoch moves on whenever the cache is flushed,
+ * a newer distribution point CRL comes in or OCSP reports a revocation,
+ * so a verification in progress at that time is not found again.
+ */
+typedef struct tcn_verify_entry_t tcn_verify_entry_t;
+
+struct tcn_verify_entry_t {
+    /* LRU list, most recently used at the head */
+    tcn_verify_entry_t *prev;
+    tcn_verify_entry_t *next;
+    unsigned char   key[VERIFY_CACHE_KEY_LEN];
+    apr_time_t      expires;
+    /* verified chain, NULL if the CertificateVerifier built none */
+    STACK_OF(X509) *chain;
+};
+
+struct tcn_verify_cache_t {
+    tcn_ssl_ctxt_t     *ctx;
+    apr_thread_mutex_t *mutex;
+    apr_hash_t         *entries;
+    tcn_verify_entry_t *head;
+    tcn_verify_entry_t *tail;
+    int                 count;
+    int                 size;
+    apr_interval_time_t ttl;
+    apr_uint64_t        hits;
+    apr_uint64_t        misses;
+    apr_uint64_t        evictions;
+};
+
+static void ssl_verify_unlink(tcn_verify_cache_t *cache, tcn_verify_entry_t *ent)
+{
+    if (ent->prev)
+        ent->prev->next = ent->next;
+    else
+        cache->head = ent->next;
+    if (ent->next)
+        ent->next->prev = ent->prev;
+    else
+        cache->tail = ent->prev;
+    ent->prev = ent->next = NULL;
+}
+
+static void ssl_verify_link(tcn_verify_cache_t *cache, tcn_verify_entry_t *ent)
+{
+    ent->prev = NULL;
+    ent->next = cache->head;
+    if (cache->head)
+        cache->head->prev = ent;
+    else
+        cache->tail = ent;
+    cache->head = ent;
+}
+
+static void ssl_verify_remove(tcn_verify_cache_t *cache, tcn_verify_entry_t *ent)
+{
+    ssl_verify_unlink(cache, ent);
+    apr_hash_set(cache->entries, ent->key, VERIFY_CACHE_KEY_LEN, NULL);
+    if (ent->chain != NULL)
+        sk_X509_pop_free(ent->chain, X509_free);
+    free(ent);
+    cache->count--;
+}
+
+/* Drop entries from the tail until no more than limit are left.  Must be
+ * called with the mutex held.
+ */
+static void ssl_verify_evict(tcn_verify_cache_t *cache, int limit)
+{
+    while (cache->tail != NULL && cache->count > limit) {
+        ssl_verify_remove(cache, cache->tail);
+        cache->evictions++;
+    }
+}
+
+static apr_status_t ssl_verify_cache_pre_cleanup(void *data)
+{
+    tcn_verify_cache_t *cache = (tcn_verify_cache_t *)data;
+
+    apr_thread_mutex_lock(cache->mutex);
+    ssl_verify_evict(cache, 0);
+    apr_thread_mutex_unlock(cache->mutex);
+    cache->ctx->verify_cache  = NULL;
+    cache->ctx->verify_cached = 0;
+    return APR_SUCCESS;
+}
+
+apr_status_t SSL_verify_cache_create(tcn_ssl_ctxt_t *c)
+{
+    tcn_verify_cache_t *cache;
+    apr_status_t rv;
+
+    if ((cache = apr_pcalloc(c->pool, sizeof(tcn_verify_cache_t))) == NULL)
+        return APR_ENOMEM;
+    if ((rv = apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                      c->pool)) != APR_SUCCESS)
+        return rv;
+    cache->ctx     = c;
+    cache->entries = apr_hash_make(c->pool);
+    apr_pool_pre_cleanup_register(c->pool, cache, ssl_verify_cache_pre_cleanup);
+    c->verify_cache = cache;
+    return APR_SUCCESS;
+}
+
+/* A size of 0 turns the cache off, the entries cached go either way */
+void SSL_verify_cache_configure(tcn_ssl_ctxt_t *c, int size, apr_interval_time_t ttl)
+{
+    tcn_verify_cache_t *cache = c->verify_cache;
+
+    if (cache == NULL)
+        return;
+    apr_thread_mutex_lock(cache->mutex);
+    cache->size = size > 0 && ttl > 0 ? size : 0;
+    cache->ttl  = ttl;
+    ssl_verify_evict(cache, 0);
+    apr_thread_mutex_unlock(cache->mutex);
+    c->verify_cached = cache->size > 0;
+}
+
+/* Results put under the previous epoch are never looked up again */
+void SSL_verify_cache_invalidate(tcn_ssl_ctxt_t *c)
+{
+    apr_atomic_inc32(&c->verify_epoch);
+}
+
+void SSL_verify_cache_flush(tcn_ssl_ctxt_t *c)
+{
+    tcn_verify_cache_t *cache = c->verify_cache;
+
+    SSL_verify_cache_invalidate(c);
+    if (cache == NULL)
+        return;
+    apr_thread_mutex_lock(cache->mutex);
+    ssl_verify_evict(cache, 0);
+    apr_thread_mutex_unlock(cache->mutex);
+}
+
+/* hits, misses, evictions, cached */
+void SSL_verify_cache_stats(tcn_ssl_ctxt_t *c, apr_uint64_t *stats)
+{
+    tcn_verify_cache_t *cache = c->verify_cache;
+
+    memset(stats, 0, VERIFY_CACHE_STATS * sizeof(apr_uint64_t));
+    if (cache == NULL)
+        return;
+    apr_thread_mutex_lock(cache->mutex);
+    stats[0] = cache->hits;
+    stats[1] = cache->misses;
+    stats[2] = cache->evictions;
+    stats[3] = cache->count;
+    apr_thread_mutex_unlock(cache->mutex);
+}
+
+/* Hashes the chain the peer sent with the settings of its connection and
+ * method, the authentication method passed to the CertificateVerifier.
+ * Returns 0 if that fails.
+ */
+int SSL_verify_cache_key(tcn_ssl_ctxt_t *c, X509_STORE_CTX *ctx, const char *method,
+                         unsigned char *key)
+{
+    SSL *ssl = X509_STORE_CTX_get_ex_data(ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+    tcn_ssl_conn_t *con = (tcn_ssl_conn_t *)SSL_get_app_data(ssl);
+    STACK_OF(X509) *sk = X509_STORE_CTX_get0_untrusted(ctx);
+    X509 *cert = X509_STORE_CTX_get0_cert(ctx);
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdlen;
+    EVP_MD_CTX *mctx;
+    unsigned long flags = X509_VERIFY_PARAM_get_flags(X509_STORE_CTX_get0_param(ctx));
+    int settings[6];
+    int i, ok;
+
+    if (cert == NULL || (mctx = EVP_MD_CTX_new()) == NULL)
+        return 0;
+    settings[0] = c->verify_mode;
+    settings[1] = c->verify_depth;
+    settings[2] = SSL_get_verify_mode(ssl);
+    settings[3] = SSL_get_verify_depth(ssl);
+    settings[4] = (int)con->trust_generation;
+    settings[5] = (int)apr_atomic_read32(&c->verify_epoch);
+    ok = EVP_DigestInit_ex(mctx, EVP_sha256(), NULL) &&
+         EVP_DigestUpdate(mctx, settings, sizeof(settings)) &&
+         EVP_DigestUpdate(mctx, &flags, sizeof(flags)) &&
+         EVP_DigestUpdate(mctx, method != NULL ? method : "", method != NULL ? strlen(method) + 1 : 1) &&
+         X509_digest(cert, EVP_sha256(), md, &mdlen) &&
+         EVP_DigestUpdate(mctx, md, mdlen);
+    for (i = 0; ok && i < sk_X509_num(sk); i++) {
+        ok = X509_digest(sk_X509_value(sk, i), EVP_sha256(), md, &mdlen) &&
+             EVP_DigestUpdate(mctx, md, mdlen);
+    }
+    ok = ok && EVP_DigestFinal_ex(mctx, key, &mdlen) && mdlen == VERIFY_CACHE_KEY_LEN;
+    EVP_MD_CTX_free(mctx);
+    return ok;
+}
+
+/* Returns 1 and sets the verified chain of ctx if the key verified before */
+int SSL_verify_cache_get(tcn_ssl_ctxt_t *c, const unsigned char *key, X509_STORE_CTX *ctx)
+{
+    tcn_verify_cache_t *cache = c->verify_cache;
+    tcn_verify_entry_t *ent;
+    STACK_OF(X509) *chain = NULL;
+    int hit = 0;
+
+    if (cache == NULL)
+        return 0;
+    apr_thread_mutex_lock(cache->mutex);
+    if ((ent = apr_hash_get(cache->entries, key, VERIFY_CACHE_KEY_LEN)) != NULL &&
+        ent->expires <= apr_time_now()) {
+        ssl_verify_remove(cache, ent);
+        ent = NULL;
+    }
+    if (ent != NULL) {
+        if (cache->head != ent) {
+            ssl_verify_unlink(cache, ent);
+            ssl_verify_link(cache, ent);
+        }
+        if (ent->chain == NULL || (chain = X509_chain_up_ref(ent->chain)) != NULL) {
+            cache->hits++;
+            hit = 1;
+        }
+    }
+    if (!hit && cache->size > 0)
+        cache->misses++;
+    apr_thread_mutex_unlock(cache->mutex);
+    if (hit) {
+        if (chain != NULL)
+            X509_STORE_CTX_set0_verified_chain(ctx, chain);
+        X509_STORE_CTX_set_error(ctx, X509_V_OK);
+    }
+    return hit;
+}
+
+/* Takes the result of a verification that succeeded */
+void SSL_verify_cache_put(tcn_ssl_ctxt_t *c, const unsigned char *key, X509_STORE_CTX *ctx)
+{
+    tcn_verify_cache_t *cache = c->verify_cache;
+    tcn_verify_entry_t *ent;
+    STACK_OF(X509) *chain, *certs;
+    apr_time_t now = apr_time_now(), expires;
+    int i, days, secs;
+
+    if (cache == NULL)
+        return;
+    chain = X509_STORE_CTX_get1_chain(ctx);
+    certs = chain != NULL ? chain : X509_STORE_CTX_get0_untrusted(ctx);
+    apr_thread_mutex_lock(cache->mutex);
+    expires = now + cache->ttl;
+    apr_thread_mutex_unlock(cache->mutex);
+    /* Not kept past the first certificate to expire */
+    for (i = 0; i < sk_X509_num(certs); i++) {
+        apr_time_t t;
+        if (!ASN1_TIME_diff(&days, &secs, NULL, X509_get0_notAfter(sk_X509_value(certs, i))) ||
+            days < 0 || secs < 0) {
+            expires = now;
+            break;
+        }
+        t = now + apr_time_from_sec((apr_time_t)days * 86400 + secs);
+        if (t < expires)
+            expires = t;
+    }
+    if (expires <= now || (ent = calloc(1, sizeof(tcn_verify_entry_t))) == NULL) {
+        if (chain != NULL)
+            sk_X509_pop_free(chain, X509_free);
+        return;
+    }
+    memcpy(ent->key, key, VERIFY_CACHE_KEY_LEN);
+    ent->expires = expires;
+    ent->chain   = chain;
+
+    apr_thread_mutex_lock(cache->mutex);
+    if (cache->size > 0 &&
+        apr_hash_get(cache->entries, ent->key, VERIFY_CACHE_KEY_LEN) == NULL) {
+        apr_hash_set(cache->entries, ent->key, VERIFY_CACHE_KEY_LEN, ent);
+        ssl_verify_link(cache, ent);
+        cache->count++;
+        ssl_verify_evict(cache, cache->size);
+        ent = NULL;
+    }
+    apr_thread_mutex_unlock(cache->mutex);
+    if (ent != NULL) {
+        if (ent->chain != NULL)
+            sk_X509_pop_free(ent->chain, X509_free);
+        free(ent);
+    }
+}
@@ -0,0 +1,180 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package org.apache.tomcat.jni;
+
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.OutputStream;
+import java.net.InetSocketAddress;
+import java.net.ServerSocket;
+import java.net.Socket;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.nio.file.Paths;
+import java.util.Base64;
+import java.util.concurrent.atomic.AtomicInteger;
+
+import org.junit.After;
+import org.junit.Assert;
+import org.junit.Before;
+import org.junit.Test;
+
+/*
+ * Downloads the CRL of the client-dp-*-cert.pem certificates from a local
+ * HTTP server, which sends the body with a Content-Length, chunked and until
+ * the connection is closed depending on the path asked for.
+ */
+public class TestCRLDistributionPoints {
+
+    private static final int PORT = 18891;
+
+    private final AtomicInteger accepts = new AtomicInteger();
+    private final AtomicInteger requests = new AtomicInteger();
+
+    private byte[] crl;
+    private ServerSocket listener;
+    private Thread acceptor;
+
+    private long pool;
+    private long serverCtx;
+    private long cctx;
+
+    @Before
+    public void setUp() throws Exception {
+        TesterSSLConnection.initialize();
+
+        String pem = new String(Files.readAllBytes(Paths.get(TesterSSLConnection.DIR + "ca-crl.pem")),
+                StandardCharsets.US_ASCII);
+        String begin = "-----BEGIN X509 CRL-----";
+        crl = Base64.getMimeDecoder().decode(
+                pem.substring(pem.indexOf(begin) + begin.length(), pem.indexOf("-----END X509 CRL-----")));
+
+        listener = new ServerSocket();
+        listener.setReuseAddress(true);
+        listener.bind(new InetSocketAddress("127.0.0.1", PORT), 8);
+        acceptor = new Thread(this::accept, "CRL server");
+        acceptor.setDaemon(true);
+        acceptor.start();
+
+        pool = Pool.create(0);
+        serverCtx = TesterSSLConnection.makeServerContext(pool);
+        cctx = SSLConf.make(pool, SSL.SSL_CONF_FLAG_SERVER);
+        Assert.assertEquals(1, SSLConf.check(cctx, "CRL_DP_FETCH", "true"));
+        // Handshakes wait for the download
+        Assert.assertEquals(1, SSLConf.check(cctx, "CRL_DP_SOFT_FAIL", "false"));
+        SSLConf.assign(cctx, serverCtx);
+    }
+
+    @After
+    public void tearDown() throws Exception {
+        SSLConf.free(cctx);
+        SSLContext.free(serverCtx);
+        Pool.destroy(pool);
+        listener.close();
+        acceptor.join();
+    }
+
+    @Test(timeout = 60000)
+    public void testFetch() throws Exception {
+        Assert.assertTrue(handshake("client-dp-length-cert.pem"));
+        Assert.assertTrue(handshake("client-dp-chunked-cert.pem"));
+        // Both downloads used the same connection
+        Assert.assertEquals(1, accepts.get());
+        Assert.assertEquals(2, requests.get());
+
+        Assert.assertTrue(handshake("client-dp-close-cert.pem"));
+        Assert.assertEquals(3, requests.get());
+    }
+
+    private boolean handshake(String cert) throws Exception {
+        long clientCtx = TesterSSLConnection.makeClientContext(pool, cert);
+        TesterSSLConnection con = new TesterSSLConnection(serverCtx, clientCtx);
+        try {
+            return con.handshake();
+        } finally {
+            con.free();
+            SSLContext.free(clientCtx);
+        }
+    }
+
+    private void accept() {
+        while (true) {
+            Socket socket;
+            try {
+                socket = listener.accept();
+            } catch (IOException e) {
+                // Closed by tearDown()
+                return;
+            }
+            accepts.incrementAndGet();
+            Thread t = new Thread(() -> serve(socket), "CRL connection");
+            t.setDaemon(true);
+            t.start();
+        }
+    }
+
+    private void serve(Socket s) {
+        try (Socket socket = s) {
+            InputStream in = socket.getInputStream();
+            OutputStream out = socket.getOutputStream();
+            String head;
+            while ((head = readHead(in)) != null) {
+                requests.incrementAndGet();
+                String path = head.split(" ")[1];
+                if (path.equals("/length.crl")) {
+                    write(out, "HTTP/1.1 200 OK\r\nContent-Type: application/pkix-crl\r\nContent-Length: " +
+                            crl.length + "\r\n\r\n");
+                    out.write(crl);
+                } else if (path.equals("/chunked.crl")) {
+                    int half = crl.length / 2;
+                    write(out, "HTTP/1.1 200 OK\r\nContent-Type: application/pkix-crl\r\n" +
+                            "Transfer-Encoding: chunked\r\n\r\n" + Integer.toHexString(half) + "\r\n");
+                    out.write(crl, 0, half);
+                    write(out, "\r\n" + Integer.toHexString(crl.length - half) + "\r\n");
+                    out.write(crl, half, crl.length - half);
+                    write(out, "\r\n0\r\n\r\n");
+                } else if (path.equals("/close.crl")) {
+                    write(out, "HTTP/1.0 200 OK\r\nContent-Type: application/pkix-crl\r\n\r\n");
+                    out.write(crl);
+                    out.flush();
+                    return;
+                } else {
+                    write(out, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+                }
+                out.flush();
+            }
+        } catch (IOException e) {
+            // The client went away
+        }
+    }
+
+    private static String readHead(InputStream in) throws IOException {
+        StringBuilder head = new StringBuilder();
+        int c;
+        while ((c = in.read()) != -1) {
+            head.append((char) c);
+            if (head.length() >= 4 && head.substring(head.length() - 4).equals("\r\n\r\n")) {
+                return head.toString();
+            }
+        }
+        return null;
+    }
+
+    private static void write(OutputStream out, String s) throws IOException {
+        out.write(s.getBytes(StandardCharsets.US_ASCII));
+    }
+}
@@ -0,0 +1,85 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package org.apache.tomcat.jni;
+
+import java.io.File;
+
+import org.junit.After;
+import org.junit.Assert;
+import org.junit.Before;
+import org.junit.Test;
+
+/*
+ * Checks that a revocation index built from ca-crl.pem rejects the revoked
+ * client certificate, and only while it is set.
+ */
+public class TestRevocationIndex {
+
+    private long pool;
+    private long serverCtx;
+    private long goodCtx;
+    private long revokedCtx;
+    private File index;
+
+    @Before
+    public void setUp() throws Exception {
+        TesterSSLConnection.initialize();
+        pool = Pool.create(0);
+        serverCtx = TesterSSLConnection.makeServerContext(pool);
+        goodCtx = TesterSSLConnection.makeClientContext(pool, "client-cert.pem");
+        revokedCtx = TesterSSLConnection.makeClientContext(pool, "client-revoked-cert.pem");
+        index = File.createTempFile("tcn-revocation", ".idx");
+    }
+
+    @After
+    public void tearDown() {
+        SSLContext.free(revokedCtx);
+        SSLContext.free(goodCtx);
+        SSLContext.free(serverCtx);
+        Pool.destroy(pool);
+        Assert.assertTrue(index.delete());
+    }
+
+    @Test
+    public void testRevoked() throws Exception {
+        Assert.assertTrue(handshake(goodCtx));
+        Assert.assertTrue(handshake(revokedCtx));
+
+        Assert.assertEquals(1, SSLContext.buildRevocationIndex(serverCtx, index.getPath(),
+                TesterSSLConnection.DIR + "ca-crl.pem"));
+        SSLContext.setRevocationIndex(serverCtx, index.getPath());
+        Assert.assertTrue(handshake(goodCtx));
+        Assert.assertFalse(handshake(revokedCtx));
+
+        SSLContext.setRevocationIndex(serverCtx, null);
+        Assert.assertTrue(handshake(revokedCtx));
+    }
+
+    @Test(expected = Exception.class)
+    public void testNoIndex() throws Exception {
+        SSLContext.setRevocationIndex(serverCtx, TesterSSLConnection.DIR + "ca-crl.pem");
+    }
+
+    private boolean handshake(long clientCtx) {
+        TesterSSLConnection con = new TesterSSLConnection(serverCtx, clientCtx);
+        try {
+            return con.handshake();
+        } finally {
+            con.free();
+        }
+    }
+}
@@ -0,0 +1,70 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package org.apache.tomcat.jni;
+
+import java.nio.ByteBuffer;
+
+import org.junit.Assert;
+import org.junit.Before;
+import org.junit.Test;
+
+public class TestSSLRandom {
+
+    @Before
+    public void setUp() throws Exception {
+        TesterSSLConnection.initialize();
+    }
+
+    @Test
+    public void testArray() throws Exception {
+        // More than one block of the native stage buffer
+        byte[] buf = new byte[10000];
+        SSL.randomBytesArray(buf, 8, buf.length - 16, true);
+        for (int i = 0; i < 8; i++) {
+            Assert.assertEquals(0, buf[i]);
+            Assert.assertEquals(0, buf[buf.length - 1 - i]);
+        }
+        for (int block = 8; block < buf.length - 8; block += 1024) {
+            boolean set = false;
+            for (int i = block; i < Math.min(block + 1024, buf.length - 8); i++) {
+                set |= buf[i] != 0;
+            }
+            Assert.assertTrue(set);
+        }
+    }
+
+    @Test
+    public void testAddress() throws Exception {
+        ByteBuffer a = ByteBuffer.allocateDirect(64);
+        ByteBuffer b = ByteBuffer.allocateDirect(64);
+        SSL.randomBytes(Buffer.address(a), 64, false);
+        SSL.randomBytes(Buffer.address(b), 64, true);
+        Assert.assertNotEquals(a, b);
+        Assert.assertNotEquals(ByteBuffer.allocateDirect(64), a);
+    }
+
+    @Test
+    public void testReseed() {
+        long[] before = new long[6];
+        long[] after = new long[6];
+        SSL.getRandomStats(before);
+        SSL.reseed();
+        SSL.getRandomStats(after);
+        Assert.assertEquals(before[0] + before[1] + 1, after[0] + after[1]);
+        Assert.assertEquals(0, after[2]);
+    }
+}
@@ -0,0 +1,149 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package org.apache.tomcat.jni;
+
+import java.nio.ByteBuffer;
+import java.nio.charset.StandardCharsets;
+
+import org.junit.After;
+import org.junit.Assert;
+import org.junit.Before;
+import org.junit.Test;
+
+/*
+ * Checks the consumed and produced byte counts, the SSL_get_error state and
+ * the SSL_STATUS flags packed into the results of SSL.wrap() and SSL.unwrap().
+ */
+public class TestSSLWrapUnwrap {
+
+    private static final byte[] DATA = "hello world".getBytes(StandardCharsets.US_ASCII);
+
+    private long pool;
+    private long serverCtx;
+    private long clientCtx;
+
+    @Before
+    public void setUp() throws Exception {
+        TesterSSLConnection.initialize();
+        pool = Pool.create(0);
+        serverCtx = TesterSSLConnection.makeServerContext(pool);
+        clientCtx = TesterSSLConnection.makeClientContext(pool, "client-cert.pem");
+    }
+
+    @After
+    public void tearDown() {
+        SSLContext.free(clientCtx);
+        SSLContext.free(serverCtx);
+        Pool.destroy(pool);
+    }
+
+    @Test
+    public void testHandshake() throws Exception {
+        TesterSSLConnection con = new TesterSSLConnection(serverCtx, clientCtx);
+        try {
+            ByteBuffer net = ByteBuffer.allocateDirect(TesterSSLConnection.BUFFER_SIZE);
+            long result = SSL.wrap(con.getClientBIO(), con.getClientSSL(), 0, 0, Buffer.address(net),
+                    TesterSSLConnection.BUFFER_SIZE);
+            // ClientHello
+            Assert.assertEquals(0, SSL.getConsumed(result));
+            Assert.assertTrue(SSL.getProduced(result) > 0);
+            Assert.assertEquals(SSL.SSL_ERROR_WANT_READ, SSL.getError(result));
+            Assert.assertEquals(SSL.SSL_STATUS_IN_INIT, SSL.getStatus(result));
+
+            // Hand the ClientHello over
+            result = SSL.unwrap(con.getServerBIO(), con.getServerSSL(), Buffer.address(net), SSL.getProduced(result),
+                    0, 0);
+            Assert.assertEquals(SSL.SSL_ERROR_WANT_READ, SSL.getError(result));
+            Assert.assertTrue((SSL.getStatus(result) & SSL.SSL_STATUS_IN_INIT) != 0);
+            Assert.assertTrue((SSL.getStatus(result) & SSL.SSL_STATUS_NETWORK_PENDING) != 0);
+
+            Assert.assertTrue(con.handshake());
+            Assert.assertTrue((con.getServerStatus() & SSL.SSL_STATUS_HANDSHAKE_DONE) != 0);
+            Assert.assertTrue((con.getClientStatus() & SSL.SSL_STATUS_HANDSHAKE_DONE) != 0);
+        } finally {
+            con.free();
+        }
+    }
+
+    @Test
+    public void testData() throws Exception {
+        TesterSSLConnection con = new TesterSSLConnection(serverCtx, clientCtx);
+        try {
+            Assert.assertTrue(con.handshake());
+
+            ByteBuffer src = ByteBuffer.allocateDirect(DATA.length);
+            src.put(DATA);
+            ByteBuffer net = ByteBuffer.allocateDirect(TesterSSLConnection.BUFFER_SIZE);
+            ByteBuffer dst = ByteBuffer.allocateDirect(TesterSSLConnection.BUFFER_SIZE);
+
+            long result = SSL.wrap(con.getClientBIO(), con.getClientSSL(), Buffer.address(src), DATA.length,
+                    Buffer.address(net), TesterSSLConnection.BUFFER_SIZE);
+            Assert.assertEquals(DATA.length, SSL.getConsumed(result));
+            int record = SSL.getProduced(result);
+            Assert.assertTrue(record > DATA.length);
+            Assert.assertEquals(SSL.SSL_ERROR_NONE, SSL.getError(result));
+            Assert.assertEquals(0, SSL.getStatus(result));
+
+            // The whole record is taken, the plaintext that does not fit stays pending
+            result = SSL.unwrap(con.getServerBIO(), con.getServerSSL(), Buffer.address(net), record,
+                    Buffer.address(dst), 4);
+            Assert.assertEquals(record, SSL.getConsumed(result));
+            Assert.assertEquals(4, SSL.getProduced(result));
+            Assert.assertEquals(SSL.SSL_ERROR_NONE, SSL.getError(result));
+            Assert.assertEquals(SSL.SSL_STATUS_SSL_PENDING, SSL.getStatus(result));
+
+            result = SSL.unwrap(con.getServerBIO(), con.getServerSSL(), 0, 0, Buffer.address(dst) + 4,
+                    TesterSSLConnection.BUFFER_SIZE - 4);
+            Assert.assertEquals(0, SSL.getConsumed(result));
+            Assert.assertEquals(DATA.length - 4, SSL.getProduced(result));
+            Assert.assertEquals(SSL.SSL_ERROR_WANT_READ, SSL.getError(result));
+            Assert.assertEquals(0, SSL.getStatus(result));
+
+            byte[] received = new byte[DATA.length];
+            dst.get(received);
+            Assert.assertArrayEquals(DATA, received);
+        } finally {
+            con.free();
+        }
+    }
+
+    @Test
+    public void testShutdown() throws Exception {
+        TesterSSLConnection con = new TesterSSLConnection(serverCtx, clientCtx);
+        try {
+            Assert.assertTrue(con.handshake());
+
+            ByteBuffer net = ByteBuffer.allocateDirect(TesterSSLConnection.BUFFER_SIZE);
+            ByteBuffer dst = ByteBuffer.allocateDirect(TesterSSLConnection.BUFFER_SIZE);
+
+            SSL.shutdownSSL(con.getClientSSL());
+            long result = SSL.wrap(con.getClientBIO(), con.getClientSSL(), 0, 0, Buffer.address(net),
+                    TesterSSLConnection.BUFFER_SIZE);
+            int alert = SSL.getProduced(result);
+            Assert.assertTrue(alert > 0);
+
+            result = SSL.unwrap(con.getServerBIO(), con.getServerSSL(), Buffer.address(net), alert,
+                    Buffer.address(dst), TesterSSLConnection.BUFFER_SIZE);
+            Assert.assertEquals(alert, SSL.getConsumed(result));
+            Assert.assertEquals(0, SSL.getProduced(result));
+            Assert.assertEquals(SSL.SSL_ERROR_ZERO_RETURN, SSL.getError(result));
+            Assert.assertEquals(SSL.SSL_STATUS_RECEIVED_SHUTDOWN, SSL.getStatus(result));
+        } finally {
+            con.free();
+        }
+    }
+}
@@ -0,0 +1,171 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package org.apache.tomcat.jni;
+
+import java.nio.ByteBuffer;
+
+import org.junit.Assert;
+
+/*
+ * Helper class connecting a client and a server SSL instance in memory. The
+ * records are moved between the network BIOs with SSL.wrap() and SSL.unwrap().
+ *
+ * The certificates and keys are those of this directory. All certificates are
+ * issued by ca-cert.pem, ca-crl.pem revokes client-revoked-cert.pem and the
+ * client-dp-*-cert.pem certificates point to a CRL distribution point on
+ * http://127.0.0.1:18891/.
+ */
+public class TesterSSLConnection {
+
+    public static final String DIR = "test/org/apache/tomcat/jni/";
+
+    public static final int BUFFER_SIZE = 65536;
+
+    private static boolean initialized = false;
+
+    public static synchronized void initialize() throws Exception {
+        if (!initialized) {
+            Library.initialize(null);
+            SSL.initialize(null);
+            initialized = true;
+        }
+    }
+
+    /*
+     * Server context that requires a client certificate issued by the test CA.
+     */
+    public static long makeServerContext(long pool) throws Exception {
+        long ctx = SSLContext.make(pool, SSL.SSL_PROTOCOL_TLSV1_2 | SSL.SSL_PROTOCOL_TLSV1_3, SSL.SSL_MODE_SERVER);
+        Assert.assertTrue(SSLContext.setCertificate(ctx, DIR + "localhost-cert.pem", DIR + "localhost-key.pem", null,
+                SSL.SSL_AIDX_RSA));
+        Assert.assertTrue(SSLContext.setCACertificate(ctx, DIR + "ca-cert.pem", null));
+        SSLContext.setVerify(ctx, SSL.SSL_CVERIFY_REQUIRE, 10);
+        return ctx;
+    }
+
+    /*
+     * Client context presenting the given certificate of this directory. The
+     * server certificate is not verified.
+     */
+    public static long makeClientContext(long pool, String cert) throws Exception {
+        long ctx = SSLContext.make(pool, SSL.SSL_PROTOCOL_TLSV1_2 | SSL.SSL_PROTOCOL_TLSV1_3, SSL.SSL_MODE_CLIENT);
+        Assert.assertTrue(SSLContext.setCertificate(ctx, DIR + cert, DIR + "client-key.pem", null, SSL.SSL_AIDX_RSA));
+        SSLContext.setVerify(ctx, SSL.SSL_CVERIFY_NONE, 10);
+        return ctx;
+    }
+
+
+    private final long serverSSL;
+    private final long serverBIO;
+    private final long clientSSL;
+    private final long clientBIO;
+
+    private final ByteBuffer toServer = ByteBuffer.allocateDirect(BUFFER_SIZE);
+    private final ByteBuffer toClient = ByteBuffer.allocateDirect(BUFFER_SIZE);
+    private final ByteBuffer app = ByteBuffer.allocateDirect(BUFFER_SIZE);
+
+    private int serverStatus = 0;
+    private int clientStatus = 0;
+
+    public TesterSSLConnection(long serverCtx, long clientCtx) {
+        serverSSL = SSL.newSSL(serverCtx, true);
+        serverBIO = SSL.makeNetworkBIO(serverSSL);
+        clientSSL = SSL.newSSL(clientCtx, false);
+        clientBIO = SSL.makeNetworkBIO(clientSSL);
+    }
+
+    /*
+     * Returns true once the server finished the handshake. With TLS 1.3 the
+     * client finishes before the server has verified the client certificate,
+     * so only the server tells whether the handshake succeeded.
+     */
+    public boolean handshake() {
+        long toServerAddress = Buffer.address(toServer);
+        long toClientAddress = Buffer.address(toClient);
+        long appAddress = Buffer.address(app);
+
+        for (int i = 0; i < 20; i++) {
+            long result = SSL.wrap(clientBIO, clientSSL, 0, 0, toServerAddress, BUFFER_SIZE);
+            clientStatus |= SSL.getStatus(result);
+            int sent = SSL.getProduced(result);
+            if (SSL.getError(result) == SSL.SSL_ERROR_SSL) {
+                return false;
+            }
+            result = SSL.unwrap(serverBIO, serverSSL, toServerAddress, sent, appAddress, BUFFER_SIZE);
+            serverStatus |= SSL.getStatus(result);
+            if (SSL.getError(result) == SSL.SSL_ERROR_SSL) {
+                return false;
+            }
+            Assert.assertEquals(sent, SSL.getConsumed(result));
+
+            result = SSL.wrap(serverBIO, serverSSL, 0, 0, toClientAddress, BUFFER_SIZE);
+            serverStatus |= SSL.getStatus(result);
+            int received = SSL.getProduced(result);
+            if (SSL.getError(result) == SSL.SSL_ERROR_SSL) {
+                return false;
+            }
+            result = SSL.unwrap(clientBIO, clientSSL, toClientAddress, received, appAddress, BUFFER_SIZE);
+            clientStatus |= SSL.getStatus(result);
+            if (SSL.getError(result) == SSL.SSL_ERROR_SSL) {
+                return false;
+            }
+            Assert.assertEquals(received, SSL.getConsumed(result));
+
+            if (sent == 0 && received == 0 && SSL.isInInit(serverSSL) == 0 && SSL.isInInit(clientSSL) == 0) {
+                break;
+            }
+        }
+        return SSL.isInInit(serverSSL) == 0;
+    }
+
+    public long getServerSSL() {
+        return serverSSL;
+    }
+
+    public long getServerBIO() {
+        return serverBIO;
+    }
+
+    public long getClientSSL() {
+        return clientSSL;
+    }
+
+    public long getClientBIO() {
+        return clientBIO;
+    }
+
+    /*
+     * SSL_STATUS flags of all calls made for the server during the handshake.
+     */
+    public int getServerStatus() {
+        return serverStatus;
+    }
+
+    /*
+     * SSL_STATUS flags of all calls made for the client during the handshake.
+     */
+    public int getClientStatus() {
+        return clientStatus;
+    }
+
+    public void free() {
+        SSL.freeBIO(serverBIO);
+        SSL.freeSSL(serverSSL);
+        SSL.freeBIO(clientBIO);
+        SSL.freeSSL(clientSSL);
+    }
+}